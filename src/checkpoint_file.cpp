@@ -0,0 +1,98 @@
+#include "checkpoint_file.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <fmt/core.h>
+
+error_code save_checkpoint(const Intel8086& x86, const char* filename, std::span<const DeviceState* const> devices) {
+    CheckpointHeader header;
+    header.instruction_count = x86.get_instruction_count();
+    header.cycle_count = x86.get_cycle_count();
+    header.registers = x86.get_registers();
+    header.ip = x86.get_ip();
+    header.flags = x86.get_flags().word;
+    header.device_count = static_cast<u32>(devices.size());
+    header.memory_size = Intel8086::memory_size;
+
+    std::vector<std::vector<u8>> states;
+    size_t size = sizeof(header);
+    for (const auto* device : devices) {
+        states.push_back(device->save_state());
+        size += 2 * sizeof(u32) + states.back().size();
+    }
+    auto alignment = CheckpointHeader::memory_alignment;
+    header.memory_offset = static_cast<u32>((size + alignment - 1) / alignment * alignment);
+
+    auto temporary_filename = std::string(filename) + ".tmp";
+    FILE* file = fopen(temporary_filename.data(), "wb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", temporary_filename);
+        return make_error_code_errno();
+    }
+    auto write = [&]() -> error_code {
+        if (fwrite(&header, sizeof(header), 1, file) != 1) return make_error_code_errno();
+        for (size_t i = 0; i < devices.size(); ++i) {
+            std::array<u32, 2> section = { devices[i]->state_id(), static_cast<u32>(states[i].size()) };
+            if (fwrite(section.data(), sizeof(u32), section.size(), file) != section.size()) return make_error_code_errno();
+            if (fwrite(states[i].data(), 1, states[i].size(), file) != states[i].size()) return make_error_code_errno();
+        }
+
+        std::vector<u8> memory(header.memory_offset - size + Intel8086::memory_size);
+        x86.read_image(0, std::span(memory).subspan(header.memory_offset - size));
+        if (fwrite(memory.data(), 1, memory.size(), file) != memory.size()) return make_error_code_errno();
+        return {};
+    };
+    auto e = write();
+    if (fclose(file) != 0 && !e) e = make_error_code_errno();
+    if (!e && rename(temporary_filename.data(), filename) != 0) e = make_error_code_errno();
+    if (e) remove(temporary_filename.data());
+    return e;
+}
+
+expected<CheckpointFile, error_code> CheckpointFile::open(const char* filename) {
+    UNWRAP(auto file, MappedFile::open_copy_on_write(filename));
+    auto data = file.data();
+    if (data.size() < sizeof(CheckpointHeader)) return unexpected(Errc::InvalidCheckpoint);
+    CheckpointFile checkpoint(std::move(file));
+
+    const auto& header = checkpoint.get_header();
+    if (header.magic != CheckpointHeader::signature || header.version != CheckpointHeader::current_version
+        || header.memory_size != Intel8086::memory_size || header.memory_offset % CheckpointHeader::memory_alignment != 0
+        || data.size() < static_cast<size_t>(header.memory_offset) + header.memory_size) {
+        return unexpected(Errc::InvalidCheckpoint);
+    }
+
+    size_t offset = sizeof(CheckpointHeader);
+    for (u32 i = 0; i < header.device_count; ++i) {
+        std::array<u32, 2> section;
+        if (offset + sizeof(section) > header.memory_offset) return unexpected(Errc::InvalidCheckpoint);
+        memcpy(section.data(), data.data() + offset, sizeof(section));
+        offset += sizeof(section);
+        if (section[1] > header.memory_offset - offset) return unexpected(Errc::InvalidCheckpoint);
+        checkpoint.device_states.emplace_back(section[0], data.subspan(offset, section[1]));
+        offset += section[1];
+    }
+    return checkpoint;
+}
+
+void CheckpointFile::restore(Intel8086& x86) {
+    const auto& header = get_header();
+    x86.set_registers(header.registers);
+    x86.set_ip(header.ip);
+    Intel8086::Flags flags;
+    flags.load(header.flags);
+    x86.set_flags(flags);
+    x86.set_counts(header.instruction_count, header.cycle_count);
+    x86.use_memory(file.data().subspan(header.memory_offset, header.memory_size));
+}
+
+error_code CheckpointFile::restore_device(DeviceState& device) const {
+    auto id = device.state_id();
+    auto state = std::find_if(device_states.begin(), device_states.end(), [&](const auto& s) { return s.first == id; });
+    if (state == device_states.end()) {
+        fflush(stdout);
+        fmt::print(stderr, "The checkpoint has no state for device {:#x}\n", id);
+        return Errc::InvalidCheckpoint;
+    }
+    return device.load_state(state->second);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.hpp"
+#include <utility>
+#include <vector>
+
+#include "device.hpp"
+#include "emulator.hpp"
+#include "mapped_file.hpp"
+
+// The state of an emulator in a file, to stop a run and resume it later or
+// on another machine. The header with the CPU state and the clock is
+// followed by the states of the devices, each as its id, its size and its
+// data, and then the memory. The memory starts at a multiple of 64 KB, so
+// it's page aligned on every host and resuming maps it copy-on-write instead
+// of reading it.
+//
+// Scheduled events, device and interrupt mappings and devices without a
+// saved state have to be set up again by the host.
+struct CheckpointHeader {
+    static constexpr std::array<char, 4> signature = { 'X', '8', '6', 'C' };
+    static constexpr u32 current_version = 1;
+    static constexpr u32 memory_alignment = 64 << 10;
+
+    std::array<char, 4> magic = signature;
+    u32 version = current_version;
+    u64 instruction_count = 0;
+    u64 cycle_count = 0;
+    // In the order of Intel8086::get_registers()
+    std::array<u16, 12> registers = {};
+    u16 ip = 0;
+    u16 flags = 0;
+    u32 device_count = 0;
+    u32 memory_offset = 0;
+    u32 memory_size = 0;
+};
+static_assert(sizeof(CheckpointHeader) == 64);
+
+// Writes the checkpoint under a temporary name and renames it, so an
+// existing checkpoint is replaced atomically
+error_code save_checkpoint(const Intel8086& x86, const char* filename, std::span<const DeviceState* const> devices = {});
+
+class CheckpointFile {
+public:
+    static expected<CheckpointFile, error_code> open(const char* filename);
+
+    const CheckpointHeader& get_header() const { return *reinterpret_cast<const CheckpointHeader*>(file.data().data()); }
+
+    // Loads the CPU state and the clock, and makes the emulator use the
+    // memory of the mapping in place. The checkpoint file has to outlive the
+    // emulator and can only be restored once.
+    void restore(Intel8086& x86);
+    error_code restore_device(DeviceState& device) const;
+
+private:
+    explicit CheckpointFile(MappedFile file) : file(std::move(file)) {}
+
+    MappedFile file;
+    // By id
+    std::vector<std::pair<u32, std::span<const u8>>> device_states;
+};
@@ -18,6 +18,14 @@ namespace {
                     return "invalid expected output file";
                 case EmulationError:
                     return "emulation error";
+                case InvalidProgramFile:
+                    return "invalid program file";
+                case InvalidMemoryDump:
+                    return "invalid memory dump";
+                case InvalidTrace:
+                    return "invalid trace";
+                case InvalidCheckpoint:
+                    return "invalid checkpoint";
             }
             return "(unrecognized error)";
         };
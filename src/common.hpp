@@ -72,6 +72,10 @@ enum class Errc {
     ReassemblyError,
     InvalidExpectedOutputFile,
     EmulationError,
+    InvalidProgramFile,
+    InvalidMemoryDump,
+    InvalidTrace,
+    InvalidCheckpoint,
 };
 namespace std {
     template<> struct is_error_code_enum<Errc> : true_type {};
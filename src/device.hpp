@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.hpp"
+#include <vector>
+
+// Host-side model of a peripheral attached to a range of I/O ports. A word
+// access is delivered to the device mapped at the first port with wide set.
+class PortDevice {
+public:
+    PortDevice() = default;
+    PortDevice(const PortDevice&) = default;
+    PortDevice(PortDevice&&) = default;
+    PortDevice& operator=(const PortDevice&) = default;
+    PortDevice& operator=(PortDevice&&) = default;
+    virtual ~PortDevice() = default;
+
+    virtual u16 in(u16 port, bool wide) = 0;
+    virtual void out(u16 port, u16 value, bool wide) = 0;
+};
+
+// Handler for ports without a device: reads float high and writes are ignored
+class UnmappedPorts final : public PortDevice {
+public:
+    u16 in(u16, bool wide) override { return wide ? 0xffff : 0xff; }
+    void out(u16, u16, bool) override {}
+};
+
+// Host-side model of a memory-mapped peripheral. The emulator passes the
+// physical address of every byte accessed on the pages mapped to the device.
+class MemoryDevice {
+public:
+    MemoryDevice() = default;
+    MemoryDevice(const MemoryDevice&) = default;
+    MemoryDevice(MemoryDevice&&) = default;
+    MemoryDevice& operator=(const MemoryDevice&) = default;
+    MemoryDevice& operator=(MemoryDevice&&) = default;
+    virtual ~MemoryDevice() = default;
+
+    virtual u8 read(u32 address) = 0;
+    virtual void write(u32 address, u8 value) = 0;
+};
+
+// State of a device that is saved with the emulator in checkpoint files
+class DeviceState {
+public:
+    DeviceState() = default;
+    DeviceState(const DeviceState&) = default;
+    DeviceState(DeviceState&&) = default;
+    DeviceState& operator=(const DeviceState&) = default;
+    DeviceState& operator=(DeviceState&&) = default;
+    virtual ~DeviceState() = default;
+
+    // Tells the states of different devices apart in a checkpoint
+    virtual u32 state_id() const = 0;
+    virtual std::vector<u8> save_state() const = 0;
+    virtual error_code load_state(std::span<const u8> state) = 0;
+};
+
+class Intel8086;
+
+// Host implementation of a software interrupt. The guest's interrupt vector
+// table is bypassed for the interrupt numbers the handler is mapped to.
+class InterruptHandler {
+public:
+    InterruptHandler() = default;
+    InterruptHandler(const InterruptHandler&) = default;
+    InterruptHandler(InterruptHandler&&) = default;
+    InterruptHandler& operator=(const InterruptHandler&) = default;
+    InterruptHandler& operator=(InterruptHandler&&) = default;
+    virtual ~InterruptHandler() = default;
+
+    // Returns false to stop the emulation, e.g. when the program exits
+    virtual bool interrupt(Intel8086& x86, u8 number) = 0;
+};
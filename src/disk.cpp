@@ -0,0 +1,183 @@
+#include "disk.hpp"
+#include <algorithm>
+#include <fmt/core.h>
+
+// Status codes returned in ah
+static constexpr u8 disk_ok = 0x00;
+static constexpr u8 disk_invalid_function = 0x01;
+static constexpr u8 disk_write_protected = 0x03;
+static constexpr u8 disk_sector_not_found = 0x04;
+
+static constexpr u8 floppy_drive = 0x00;
+static constexpr u8 hard_disk_drive = 0x80;
+
+struct FloppyFormat {
+    u32 size;
+    Disk::Geometry geometry;
+};
+
+static constexpr std::array<FloppyFormat, 8> floppy_formats = {{
+    { 160 * 1024, { 40, 1, 8 } },
+    { 180 * 1024, { 40, 1, 9 } },
+    { 320 * 1024, { 40, 2, 8 } },
+    { 360 * 1024, { 40, 2, 9 } },
+    { 720 * 1024, { 80, 2, 9 } },
+    { 1200 * 1024, { 80, 2, 15 } },
+    { 1440 * 1024, { 80, 2, 18 } },
+    { 2880 * 1024, { 80, 2, 36 } },
+}};
+
+expected<Disk, error_code> Disk::open(const char* filename, bool writable) {
+    UNWRAP(auto image, MappedFile::open(filename, writable));
+    if (image.size() < sector_size || image.size() % sector_size) {
+        fmt::print(stderr, "Disk image {} isn't a whole number of sectors\n", filename);
+        return unexpected(Errc::InvalidProgramFile);
+    }
+
+    for (const auto& format : floppy_formats) {
+        if (image.size() == format.size) return Disk(std::move(image), writable, floppy_drive, format.geometry);
+    }
+
+    // Hard disks use the common translated geometry of 16 heads and 63
+    // sectors per track. A partial last cylinder is left inaccessible.
+    Geometry geometry = { 0, 16, 63 };
+    auto cylinders = image.size() / (sector_size * geometry.heads * geometry.sectors);
+    geometry.cylinders = static_cast<u16>(std::clamp<size_t>(cylinders, 1, 1024));
+    if (cylinders == 0) {
+        geometry.heads = 1;
+        geometry.sectors = static_cast<u8>(std::min<size_t>(image.size() / sector_size, 63));
+    }
+    return Disk(std::move(image), writable, hard_disk_drive, geometry);
+}
+
+Disk::~Disk() {
+    (void)flush();
+}
+
+void Disk::map(Intel8086& x86) {
+    x86.map_interrupt(0x13, *this);
+}
+
+error_code Disk::boot(Intel8086& x86) {
+    using enum Register;
+
+    auto sector = image.data().first(sector_size);
+    if (sector[510] != 0x55 || sector[511] != 0xaa) {
+        fmt::print(stderr, "The boot sector doesn't end with the 55aah signature\n");
+        return Errc::InvalidProgramFile;
+    }
+
+    x86.load_image(boot_sector_address, sector);
+    x86.set(cs, 0);
+    x86.set(ds, 0);
+    x86.set(es, 0);
+    x86.set(ss, 0);
+    x86.set(sp, boot_sector_address);
+    x86.set(dl, drive);
+    x86.set_ip(boot_sector_address);
+    return {};
+}
+
+bool Disk::interrupt(Intel8086& x86, u8 number) {
+    using enum Register;
+    assert(number == 0x13);
+    (void)number;
+
+    if (x86.get(dl) != drive) {
+        finish(x86, disk_invalid_function);
+        return true;
+    }
+
+    auto function = x86.get(ah);
+    switch (function) {
+        case 0x00:
+            finish(x86, disk_ok);
+            break;
+        case 0x01:
+            x86.set(al, status);
+            finish(x86, status);
+            break;
+        case 0x02:
+            transfer_sectors(x86, false);
+            break;
+        case 0x03:
+            transfer_sectors(x86, true);
+            break;
+        case 0x08:
+            get_parameters(x86);
+            break;
+        default:
+            fflush(stdout);
+            fmt::print(stderr, "\nUnsupported disk service {:#04x}\n", function);
+            return false;
+    }
+    return true;
+}
+
+error_code Disk::flush() {
+    if (!dirty) return {};
+    dirty = false;
+    return image.flush();
+}
+
+void Disk::transfer_sectors(Intel8086& x86, bool write) {
+    using enum Register;
+
+    u32 count = x86.get(al);
+    u32 cylinder = x86.get(ch) | ((x86.get(cl) & 0xc0) << 2);
+    u32 head = x86.get(dh);
+    u32 sector = x86.get(cl) & 0x3f;
+
+    x86.set(al, 0);
+    if (write && !writable) return finish(x86, disk_write_protected);
+    if (count == 0 || sector == 0 || sector > geometry.sectors || head >= geometry.heads || cylinder >= geometry.cylinders) {
+        return finish(x86, disk_sector_not_found);
+    }
+
+    // Transfers may continue on the following tracks, but not past the end
+    // of the image or the guest memory
+    u32 lba = (cylinder * geometry.heads + head) * geometry.sectors + sector - 1;
+    u32 address = Intel8086::physical_address(x86.get(es), x86.get(bx));
+    u32 available = static_cast<u32>(image.size() / sector_size) - lba;
+    count = std::min({ count, available, (Intel8086::memory_size - address) / sector_size });
+    if (count == 0) return finish(x86, disk_sector_not_found);
+
+    auto sectors = image.data().subspan(static_cast<size_t>(lba) * sector_size, count * sector_size);
+    if (write) {
+        x86.read_image(address, sectors);
+        dirty = true;
+    } else {
+        x86.load_image(address, sectors);
+    }
+
+    x86.set(al, count);
+    finish(x86, disk_ok);
+}
+
+void Disk::get_parameters(Intel8086& x86) {
+    using enum Register;
+
+    u32 last_cylinder = geometry.cylinders - 1;
+    x86.set(ch, last_cylinder & 0xff);
+    x86.set(cl, ((last_cylinder >> 2) & 0xc0) | geometry.sectors);
+    x86.set(dh, geometry.heads - 1);
+    x86.set(dl, 1);
+    if (drive == floppy_drive) {
+        // Drive type: 360K, 1.2M, 720K, 1.44M or 2.88M
+        u8 type = 1;
+        if (geometry.sectors == 15) type = 2;
+        else if (geometry.sectors == 9 && geometry.cylinders == 80) type = 3;
+        else if (geometry.sectors == 18) type = 4;
+        else if (geometry.sectors == 36) type = 5;
+        x86.set(bl, type);
+    }
+    finish(x86, disk_ok);
+}
+
+void Disk::finish(Intel8086& x86, u8 result) {
+    status = result;
+    x86.set(Register::ah, result);
+    auto flags = x86.get_flags();
+    flags.set(Intel8086::Flags::carry, result != disk_ok);
+    x86.set_flags(flags);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "common.hpp"
+
+#include "device.hpp"
+#include "emulator.hpp"
+#include "mapped_file.hpp"
+
+// A disk drive backed by an image file, serviced through the int 13h BIOS
+// disk functions. The image is mapped to memory, so sector reads and writes
+// are copies between the mapping and the guest memory. Written sectors reach
+// the file when the mapping is flushed, at the latest when the disk is closed.
+class Disk final : public InterruptHandler {
+public:
+    static constexpr u32 sector_size = 512;
+    static constexpr u32 boot_sector_address = 0x7c00;
+
+    struct Geometry {
+        u16 cylinders = 0;
+        u8 heads = 0;
+        u8 sectors = 0;
+    };
+
+    // Images of the standard floppy disk sizes are floppy drive 0, others
+    // are hard disk 80h
+    static expected<Disk, error_code> open(const char* filename, bool writable);
+
+    Disk(const Disk&) = delete;
+    Disk(Disk&&) = default;
+    Disk& operator=(const Disk&) = delete;
+    Disk& operator=(Disk&&) = default;
+    ~Disk() override;
+
+    // Maps int 13h to this disk
+    void map(Intel8086& x86);
+    // Loads the boot sector to 0000:7c00 and sets up the registers to start
+    // executing it with dl holding the drive number
+    error_code boot(Intel8086& x86);
+
+    bool interrupt(Intel8086& x86, u8 number) override;
+
+    error_code flush();
+
+    u8 get_drive() const { return drive; }
+    const Geometry& get_geometry() const { return geometry; }
+
+private:
+    Disk(MappedFile image, bool writable, u8 drive, Geometry geometry)
+        : image(std::move(image)), writable(writable), drive(drive), geometry(geometry) {}
+
+    MappedFile image;
+    bool writable = false;
+    bool dirty = false;
+    u8 drive = 0;
+    Geometry geometry;
+    u8 status = 0;
+
+    void transfer_sectors(Intel8086& x86, bool write);
+    void get_parameters(Intel8086& x86);
+    void finish(Intel8086& x86, u8 result);
+};
@@ -0,0 +1,368 @@
+#include "dos_services.hpp"
+#include <algorithm>
+#include <fmt/core.h>
+
+#include "mapped_file.hpp"
+
+// DOS error codes returned in ax with the carry flag set
+static constexpr u16 dos_invalid_function = 1;
+static constexpr u16 dos_file_not_found = 2;
+static constexpr u16 dos_too_many_open_files = 4;
+static constexpr u16 dos_access_denied = 5;
+static constexpr u16 dos_invalid_handle = 6;
+
+static constexpr u32 max_path_length = 128;
+
+static void set_result(Intel8086& x86, u16 value) {
+    auto flags = x86.get_flags();
+    flags.set(Intel8086::Flags::carry, false);
+    x86.set_flags(flags);
+    x86.set(Register::ax, value);
+}
+
+static void set_error(Intel8086& x86, u16 code) {
+    auto flags = x86.get_flags();
+    flags.set(Intel8086::Flags::carry, true);
+    x86.set_flags(flags);
+    x86.set(Register::ax, code);
+}
+
+// Physical address of the i-th byte of the buffer at ds:dx
+static u32 buffer_address(const Intel8086& x86, u32 i) {
+    return Intel8086::physical_address(x86.get(Register::ds), static_cast<u16>(x86.get(Register::dx) + i));
+}
+
+static std::string read_path(const Intel8086& x86) {
+    std::string path;
+    for (u32 i = 0; i < max_path_length; ++i) {
+        char c = static_cast<char>(x86.read_byte(buffer_address(x86, i)));
+        if (c == '\0') break;
+        path.push_back(c);
+    }
+    return path;
+}
+
+DosServices::~DosServices() {
+    flush_console();
+    for (auto file : files) {
+        if (file) fclose(file);
+    }
+}
+
+void DosServices::map(Intel8086& x86) {
+    x86.map_interrupt(0x10, *this);
+    x86.map_interrupt(0x20, *this);
+    x86.map_interrupt(0x21, *this);
+}
+
+bool DosServices::interrupt(Intel8086& x86, u8 number) {
+    switch (number) {
+        case 0x10:
+            return video_service(x86);
+        case 0x20:
+            return exit_program(0);
+        case 0x21:
+            return dos_service(x86);
+        default:
+            fflush(stdout);
+            fmt::print(stderr, "\nUnsupported interrupt {:#04x}\n", number);
+            return false;
+    }
+}
+
+void DosServices::flush_console() {
+    if (console_buffer.empty()) return;
+    fwrite(console_buffer.data(), 1, console_buffer.size(), console);
+    fflush(console);
+    console_buffer.clear();
+}
+
+void DosServices::write_console(char c) {
+    console_buffer.push_back(c);
+    if (console_buffer.size() >= console_buffer_size) flush_console();
+}
+
+bool DosServices::video_service(Intel8086& x86) {
+    auto function = x86.get(Register::ah);
+    switch (function) {
+        case 0x0e:
+            write_console(static_cast<char>(x86.get(Register::al)));
+            return true;
+        default:
+            fflush(stdout);
+            fmt::print(stderr, "\nUnsupported video service {:#04x}\n", function);
+            return false;
+    }
+}
+
+bool DosServices::dos_service(Intel8086& x86) {
+    using enum Register;
+
+    auto function = x86.get(ah);
+    switch (function) {
+        case 0x02:
+            write_console(static_cast<char>(x86.get(dl)));
+            x86.set(al, x86.get(dl));
+            return true;
+        case 0x09: {
+            for (u32 i = 0; i < 0x10000; ++i) {
+                char c = static_cast<char>(x86.read_byte(buffer_address(x86, i)));
+                if (c == '$') break;
+                write_console(c);
+            }
+            x86.set(al, '$');
+            return true;
+        }
+        case 0x3c:
+            open_file(x86, "w+b");
+            return true;
+        case 0x3d: {
+            constexpr std::array<const char*, 3> modes = { "rb", "r+b", "r+b" };
+            u32 access = x86.get(al) & 0b111;
+            if (access >= modes.size()) {
+                set_error(x86, dos_invalid_function);
+                return true;
+            }
+            // Write only access still needs an existing file
+            open_file(x86, modes[access]);
+            return true;
+        }
+        case 0x3e:
+            close_file(x86);
+            return true;
+        case 0x3f:
+            read_file(x86);
+            return true;
+        case 0x40:
+            write_file(x86);
+            return true;
+        case 0x42:
+            seek_file(x86);
+            return true;
+        case 0x4c:
+            return exit_program(x86.get(al));
+        default:
+            fflush(stdout);
+            fmt::print(stderr, "\nUnsupported DOS service {:#04x}\n", function);
+            return false;
+    }
+}
+
+bool DosServices::exit_program(u8 code) {
+    exit_code = code;
+    flush_console();
+    return false;
+}
+
+void DosServices::open_file(Intel8086& x86, const char* mode) {
+    auto path = read_path(x86);
+    FILE* file = fopen(path.data(), mode);
+    if (!file) {
+        set_error(x86, errno == ENOENT ? dos_file_not_found : dos_access_denied);
+        return;
+    }
+
+    u16 handle = first_file_handle;
+    while (handle < files.size() && files[handle]) ++handle;
+    if (handle > 0xff) {
+        fclose(file);
+        set_error(x86, dos_too_many_open_files);
+        return;
+    }
+    if (handle == files.size()) files.push_back(nullptr);
+    files[handle] = file;
+    set_result(x86, handle);
+}
+
+void DosServices::close_file(Intel8086& x86) {
+    u16 handle = x86.get(Register::bx);
+    FILE* file = lookup_file(handle);
+    if (!file) {
+        // Closing a standard device is accepted and does nothing
+        if (handle < first_file_handle) set_result(x86, 0);
+        else set_error(x86, dos_invalid_handle);
+        return;
+    }
+    fclose(file);
+    files[handle] = nullptr;
+    set_result(x86, 0);
+}
+
+void DosServices::read_file(Intel8086& x86) {
+    using enum Register;
+
+    u16 handle = x86.get(bx);
+    if (handle == 0) {
+        // Reading the console always reports the end of input
+        set_result(x86, 0);
+        return;
+    }
+    FILE* file = lookup_file(handle);
+    if (!file) {
+        set_error(x86, dos_invalid_handle);
+        return;
+    }
+
+    std::vector<u8> buffer(x86.get(cx));
+    auto count = fread(buffer.data(), 1, buffer.size(), file);
+    for (u32 i = 0; i < count; ++i) x86.write_byte(buffer_address(x86, i), buffer[i]);
+    set_result(x86, static_cast<u16>(count));
+}
+
+void DosServices::write_file(Intel8086& x86) {
+    using enum Register;
+
+    u16 handle = x86.get(bx);
+    u16 size = x86.get(cx);
+    if (handle == 1 || handle == 2) {
+        for (u32 i = 0; i < size; ++i) write_console(static_cast<char>(x86.read_byte(buffer_address(x86, i))));
+        set_result(x86, size);
+        return;
+    }
+    FILE* file = lookup_file(handle);
+    if (!file) {
+        set_error(x86, dos_invalid_handle);
+        return;
+    }
+
+    std::vector<u8> buffer(size);
+    for (u32 i = 0; i < size; ++i) buffer[i] = x86.read_byte(buffer_address(x86, i));
+    auto count = fwrite(buffer.data(), 1, buffer.size(), file);
+    set_result(x86, static_cast<u16>(count));
+}
+
+void DosServices::seek_file(Intel8086& x86) {
+    using enum Register;
+
+    FILE* file = lookup_file(x86.get(bx));
+    if (!file) {
+        set_error(x86, dos_invalid_handle);
+        return;
+    }
+
+    constexpr std::array<int, 3> origins = { SEEK_SET, SEEK_CUR, SEEK_END };
+    auto origin = x86.get(al);
+    if (origin >= origins.size()) {
+        set_error(x86, dos_invalid_function);
+        return;
+    }
+    auto offset = static_cast<i32>((x86.get(cx) << 16) | x86.get(dx));
+    if (fseek(file, offset, origins[origin]) != 0) {
+        set_error(x86, dos_invalid_function);
+        return;
+    }
+
+    auto position = static_cast<u32>(ftell(file));
+    x86.set(dx, position >> 16);
+    set_result(x86, position & 0xffff);
+}
+
+FILE* DosServices::lookup_file(u16 handle) const {
+    return handle < files.size() ? files[handle] : nullptr;
+}
+
+// Top of the conventional memory, stored in the PSP
+static constexpr u16 memory_end_segment = 0xa000;
+static constexpr u16 psp_paragraphs = 0x10;
+static constexpr u32 max_com_program_size = 0x10000 - 0x100 - 2;
+
+static void set_up_psp(Intel8086& x86, u16 psp_segment) {
+    using enum Register;
+
+    auto psp = Intel8086::physical_address(psp_segment, 0);
+    // int 20h at offset 0, so a program can exit by returning to it
+    x86.write_byte(psp + 0x00, 0xcd);
+    x86.write_byte(psp + 0x01, 0x20);
+    x86.write_word(psp + 0x02, memory_end_segment);
+    // Empty command line
+    x86.write_byte(psp + 0x80, 0);
+    x86.write_byte(psp + 0x81, '\r');
+
+    x86.set(ds, psp_segment);
+    x86.set(es, psp_segment);
+}
+
+static error_code invalid_program(const char* filename, const char* reason) {
+    fmt::print(stderr, "Invalid program {}: {}\n", filename, reason);
+    return Errc::InvalidProgramFile;
+}
+
+error_code load_com_program(Intel8086& x86, const char* filename) {
+    using enum Register;
+
+    UNWRAP_BARE(auto file, MappedFile::open(filename));
+    if (file.size() > max_com_program_size) return invalid_program(filename, "too large for a .COM program");
+
+    set_up_psp(x86, dos_psp_segment);
+    x86.load_image(Intel8086::physical_address(dos_psp_segment, 0x100), file.data());
+
+    x86.set(cs, dos_psp_segment);
+    x86.set(ss, dos_psp_segment);
+    x86.set_ip(0x100);
+    // A near return from the program goes to the int 20h at the start of the PSP
+    x86.set(sp, 0xfffe);
+    x86.write_word(dos_psp_segment, 0xfffe, 0);
+    return {};
+}
+
+static u16 read_header_word(std::span<const u8> file, u32 offset) {
+    return file[offset] | (file[offset + 1] << 8);
+}
+
+error_code load_exe_program(Intel8086& x86, const char* filename) {
+    using enum Register;
+
+    UNWRAP_BARE(auto file, MappedFile::open(filename));
+    auto data = file.data();
+
+    constexpr u32 header_size = 0x1c;
+    if (data.size() < header_size) return invalid_program(filename, "truncated header");
+    auto signature = read_header_word(data, 0x00);
+    if (signature != 0x5a4d && signature != 0x4d5a) return invalid_program(filename, "missing MZ signature");
+
+    auto last_page_size = read_header_word(data, 0x02);
+    auto page_count = read_header_word(data, 0x04);
+    auto relocation_count = read_header_word(data, 0x06);
+    auto header_paragraphs = read_header_word(data, 0x08);
+    auto min_alloc_paragraphs = read_header_word(data, 0x0a);
+    auto initial_ss = read_header_word(data, 0x0e);
+    auto initial_sp = read_header_word(data, 0x10);
+    auto initial_ip = read_header_word(data, 0x14);
+    auto initial_cs = read_header_word(data, 0x16);
+    auto relocation_offset = read_header_word(data, 0x18);
+
+    // The image size is given in 512 byte pages, the last one possibly partial
+    if (page_count == 0) return invalid_program(filename, "no pages in the image");
+    if (last_page_size > 512) return invalid_program(filename, "last page larger than 512 bytes");
+    u32 image_size = page_count * 512;
+    if (last_page_size) image_size -= 512 - last_page_size;
+    u32 module_offset = header_paragraphs * 16;
+    image_size = std::min<u32>(image_size, data.size());
+    if (module_offset > image_size) return invalid_program(filename, "header larger than the image");
+    if (relocation_offset + relocation_count * 4u > data.size()) return invalid_program(filename, "truncated relocation table");
+
+    u16 load_segment = dos_psp_segment + psp_paragraphs;
+    auto load_address = Intel8086::physical_address(load_segment, 0);
+    auto module = data.subspan(module_offset, image_size - module_offset);
+    if (load_address + module.size() + min_alloc_paragraphs * 16u > Intel8086::memory_size) {
+        return invalid_program(filename, "doesn't fit in the memory");
+    }
+
+    set_up_psp(x86, dos_psp_segment);
+    x86.load_image(load_address, module);
+
+    // Every relocation names a word in the load module holding a segment,
+    // which is rebased to where the module was loaded
+    for (u32 i = 0; i < relocation_count; ++i) {
+        u32 entry = relocation_offset + i * 4;
+        u16 offset = read_header_word(data, entry);
+        u16 segment = load_segment + read_header_word(data, entry + 2);
+        x86.write_word(segment, offset, x86.read_word(segment, offset) + load_segment);
+    }
+
+    x86.set(ss, load_segment + initial_ss);
+    x86.set(sp, initial_sp);
+    x86.set(cs, load_segment + initial_cs);
+    x86.set_ip(initial_ip);
+    return {};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "common.hpp"
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "device.hpp"
+#include "emulator.hpp"
+
+// High-level emulation of the BIOS and DOS services used by simple programs:
+// int 10h teletype output, int 20h and int 21h. Console output is collected
+// in a host buffer and written out in large chunks, and DOS file handles are
+// backed by files of the host file system.
+class DosServices final : public InterruptHandler {
+public:
+    explicit DosServices(FILE* console = stdout) : console(console) {}
+    DosServices(const DosServices&) = delete;
+    DosServices(DosServices&&) = delete;
+    DosServices& operator=(const DosServices&) = delete;
+    DosServices& operator=(DosServices&&) = delete;
+    ~DosServices() override;
+
+    // Maps int 10h, int 20h and int 21h to this handler
+    void map(Intel8086& x86);
+
+    bool interrupt(Intel8086& x86, u8 number) override;
+
+    void flush_console();
+    // Set once the program exits through int 20h or int 21h function 4ch
+    std::optional<u8> get_exit_code() const { return exit_code; }
+
+private:
+    static constexpr size_t console_buffer_size = 1 << 16;
+
+    FILE* console;
+    std::string console_buffer;
+    // Indexed by the DOS handle, the first five are the standard devices
+    std::vector<FILE*> files = std::vector<FILE*>(first_file_handle, nullptr);
+    static constexpr u16 first_file_handle = 5;
+    std::optional<u8> exit_code;
+
+    void write_console(char c);
+    bool video_service(Intel8086& x86);
+    bool dos_service(Intel8086& x86);
+    bool exit_program(u8 code);
+
+    void open_file(Intel8086& x86, const char* mode);
+    void close_file(Intel8086& x86);
+    void read_file(Intel8086& x86);
+    void write_file(Intel8086& x86);
+    void seek_file(Intel8086& x86);
+    FILE* lookup_file(u16 handle) const;
+};
+
+// Segment of the program segment prefix of loaded programs. The memory below
+// it is left for the interrupt vector table and the BIOS data area.
+constexpr u16 dos_psp_segment = 0x0100;
+
+// Loads a .COM program after a PSP at dos_psp_segment:0 and sets up the
+// registers to start at offset 0x100 with all segments pointing to the PSP
+error_code load_com_program(Intel8086& x86, const char* filename);
+// Loads the load module of an MZ .EXE program after a PSP, applies its
+// relocations and sets up ss:sp and cs:ip from its header
+error_code load_exe_program(Intel8086& x86, const char* filename);
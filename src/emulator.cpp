@@ -1,4 +1,5 @@
 #include "emulator.hpp"
+#include "emulator_run.hpp"
 #include <algorithm>
 #include <bit>
 #include <cmath>
@@ -6,48 +7,222 @@
 
 #include "instruction.hpp"
 #include "program.hpp"
-
-#ifdef TESTING
-constexpr bool verbose_execution = false;
-#else
-constexpr bool verbose_execution = true;
-#endif
+#include "trace.hpp"
 
 #define UNIMPLEMENTED_INSTRUCTION\
     do {\
         fflush(stdout);\
         fmt::print(stderr, "\nUnimplemented instruction {}\n", i.name());\
-        return true;\
+        stop_reason = StopReason::Unimplemented;\
+        return ExecuteResult::Halt;\
     } while (false)
 
-#define UNIMPLEMENTED_SHORT\
-    if (!i.flags.wide) {\
-        fflush(stdout);\
-        fmt::print(stderr, "\nUnimplemented short version of instruction {}\n", i.name());\
-        return true;\
-    }
-
 #define ONE_OPERAND_REQUIRED\
     if (ocount == 0) {\
         fflush(stdout);\
         fmt::print(stderr, "\nInstruction {} requires at least one operand\n", i.name());\
-        return true;\
+        stop_reason = StopReason::Unimplemented;\
+        return ExecuteResult::Halt;\
     }
 
 #define TWO_OPERANDS_REQUIRED\
     if (ocount != 2) {\
         fflush(stdout);\
         fmt::print(stderr, "\nInstruction {} requires two operands\n", i.name());\
-        return true;\
+        stop_reason = StopReason::Unimplemented;\
+        return ExecuteResult::Halt;\
     }
 
-// Normally not used x86 op code
-constexpr u8 inserted_halt_instruction = 0xf;
+constexpr u8 divide_error_interrupt = 0;
+
+// Clock advance for instructions without an entry in base_instruction_cycles, so
+// that the emulated time still moves forward in loops made of them
+constexpr u32 unestimated_instruction_cycles = 4;
+
+// Clocks of the register forms of the instructions, which advance the emulated
+// time when the cycles aren't estimated from the operands with estimate_cycles
+constexpr auto base_instruction_cycles = [] {
+    using enum Instruction::Type;
+    std::array<u8, Instruction::instruction_count> cycles;
+    cycles.fill(unestimated_instruction_cycles);
+    auto set = [&](Instruction::Type type, u8 c) { cycles[static_cast<size_t>(type)] = c; };
+
+    set(Mov, 2); set(Push, 11); set(Pop, 8); set(Xchg, 4); set(In, 10); set(Out, 10);
+    set(Xlat, 11); set(Lea, 2); set(Lds, 16); set(Les, 16);
+    set(Lahf, 4); set(Sahf, 4); set(Pushf, 10); set(Popf, 8);
+
+    set(Add, 3); set(Adc, 3); set(Inc, 3); set(Aaa, 4); set(Daa, 4);
+    set(Sub, 3); set(Sbb, 3); set(Dec, 3); set(Neg, 3);
+    set(Cmp, 3); set(Aas, 4); set(Das, 4);
+    set(Mul, 70); set(Imul, 80); set(Aam, 83);
+    set(Div, 80); set(Idiv, 101); set(Aad, 60);
+    set(Cbw, 2); set(Cwd, 5);
+
+    set(Not, 3);
+    set(Shl, 2); set(Shr, 2); set(Sar, 2); set(Rol, 2);
+    set(Ror, 2); set(Rcl, 2); set(Rcr, 2);
+    set(And, 3); set(Test, 3); set(Or, 3); set(Xor, 3);
+
+    set(Movs, 18); set(Cmps, 22); set(Scas, 15); set(Lods, 12); set(Stos, 11);
+
+    set(Call, 19); set(Jmp, 15); set(Ret, 16);
+
+    // Conditional branches are counted as taken, as they mostly are in the loops
+    // that the time is spent in
+    for (auto type : { Jo, Jno, Jb, Jnb, Je, Jnz, Jbe, Ja, Js, Jns, Jp, Jnp, Jl, Jnl, Jle, Jg }) set(type, 16);
+    set(Loop, 17); set(Loopz, 18); set(Loopnz, 19); set(Jcxz, 18);
+
+    set(Int, 51); set(Int3, 52); set(Into, 4); set(Iret, 24);
+
+    set(Clc, 2); set(Cmc, 2); set(Stc, 2); set(Cld, 2); set(Std, 2); set(Cli, 2); set(Sti, 2);
+    set(Hlt, 2); set(Wait, 3); set(Esc, 2);
+    return cycles;
+}();
+
+namespace {
+    struct AluOperation {
+        enum class Kind : u8 {
+            None,
+            Addition,
+            Subtraction,
+            Logic,
+        } kind = Kind::None;
+        bool carry_in = false;
+        bool write_back = true;
+        bool keep_carry = false;
+        bool negate = false;
+        bool keep_flags = false;
+    };
+
+    constexpr std::array<AluOperation, Instruction::instruction_count> alu_operations = [] {
+        using enum Instruction::Type;
+        using K = AluOperation::Kind;
+
+        std::array<AluOperation, Instruction::instruction_count> operations = {};
+        auto set = [&](Instruction::Type type, AluOperation operation) {
+            operations[static_cast<size_t>(type)] = operation;
+        };
+        set(Add, { .kind = K::Addition });
+        set(Adc, { .kind = K::Addition, .carry_in = true });
+        set(Inc, { .kind = K::Addition, .keep_carry = true });
+        set(Sub, { .kind = K::Subtraction });
+        set(Sbb, { .kind = K::Subtraction, .carry_in = true });
+        set(Cmp, { .kind = K::Subtraction, .write_back = false });
+        set(Dec, { .kind = K::Subtraction, .keep_carry = true });
+        set(Neg, { .kind = K::Subtraction, .negate = true });
+        set(And, { .kind = K::Logic });
+        set(Test, { .kind = K::Logic, .write_back = false });
+        set(Or, { .kind = K::Logic });
+        set(Xor, { .kind = K::Logic });
+        set(Not, { .kind = K::Logic, .keep_flags = true });
+        return operations;
+    }();
+
+    using F = Intel8086::Flags;
+
+    // The parity flag bit for each value of the low byte of a result
+    constexpr std::array<u8, 256> parity_table = [] {
+        std::array<u8, 256> parity = {};
+        for (u32 i = 0; i < parity.size(); ++i) parity[i] = std::popcount(i) % 2 == 0 ? F::parity : 0;
+        return parity;
+    }();
+
+    constexpr u8 bcd_result_flags(u8 result) {
+        return parity_table[result] | (result == 0 ? F::zero : 0) | (result & F::sign);
+    }
+
+    // Result of a decimal adjust and the flags it sets
+    struct BcdAdjust {
+        u8 al;
+        u8 flags;
+    };
+
+    // Indexed by al | AF << 8. The carry flag tells that ah is adjusted too.
+    template<bool subtract>
+    constexpr std::array<BcdAdjust, 512> make_ascii_adjust_table() {
+        std::array<BcdAdjust, 512> table = {};
+        for (u32 i = 0; i < table.size(); ++i) {
+            u8 al = i & 0xff;
+            bool af = i >> 8;
+            bool adjust = (al & 0x0f) > 9 || af;
+            if (adjust) al = subtract ? al - 6 : al + 6;
+            table[i] = { static_cast<u8>(al & 0x0f), adjust ? static_cast<u8>(F::carry | F::auxiliary) : u8(0) };
+        }
+        return table;
+    }
+
+    // Indexed by al | CF << 8 | AF << 9
+    template<bool subtract>
+    constexpr std::array<BcdAdjust, 1024> make_decimal_adjust_table() {
+        std::array<BcdAdjust, 1024> table = {};
+        for (u32 i = 0; i < table.size(); ++i) {
+            u8 old_al = i & 0xff;
+            bool old_cf = (i >> 8) & 1;
+            bool af = (i >> 9) & 1;
+
+            u8 al = old_al;
+            bool cf = false;
+            if ((al & 0x0f) > 9 || af) {
+                cf = old_cf || (subtract ? al < 6 : al > 0xff - 6);
+                al = subtract ? al - 6 : al + 6;
+                af = true;
+            }
+            if (old_al > 0x99 || old_cf) {
+                al = subtract ? al - 0x60 : al + 0x60;
+                cf = true;
+            }
+
+            u8 f = bcd_result_flags(al) | (cf ? F::carry : 0) | (af ? F::auxiliary : 0);
+            table[i] = { al, f };
+        }
+        return table;
+    }
+
+    constexpr auto aaa_table = make_ascii_adjust_table<false>();
+    constexpr auto aas_table = make_ascii_adjust_table<true>();
+    constexpr auto daa_table = make_decimal_adjust_table<false>();
+    constexpr auto das_table = make_decimal_adjust_table<true>();
+}
 
 void Intel8086::load_program(std::span<const u8> program) {
-    auto size = std::min(program.size(), memory.size());
-    memcpy(memory.data(), program.data(), size);
-    if (memory.size() > size) memory[size] = inserted_halt_instruction;
+    auto size = std::min<size_t>(program.size(), memory.size());
+    load_image(0, program.first(size));
+    if (memory.size() > size) {
+        log_pages(size / page_size, size / page_size);
+        memory[size] = inserted_halt_instruction;
+        mark_changed(size / page_size);
+    }
+}
+
+void Intel8086::move_memory_to(std::span<u8> storage) {
+    assert(storage.size() == memory_size);
+    memcpy(storage.data(), memory.data(), memory_size);
+    memory = storage;
+    owned_memory = {};
+}
+
+void Intel8086::use_memory(std::span<u8> storage) {
+    assert(storage.size() == memory_size);
+    log_pages(0, page_count - 1);
+    memory = storage;
+    owned_memory = {};
+    for (u32 page = 0; page < page_count; ++page) mark_changed(page);
+}
+
+void Intel8086::load_image(u32 address, std::span<const u8> image) {
+    assert(address + image.size() <= memory_size);
+    if (!image.empty()) log_pages(address / page_size, (address + image.size() - 1) / page_size);
+    memcpy(memory.data() + address, image.data(), image.size());
+    if (trace) trace->memory_write(address, image);
+
+    if (!image.empty()) {
+        for (u32 page = address / page_size; page <= (address + image.size() - 1) / page_size; ++page) mark_changed(page);
+    }
+}
+
+void Intel8086::read_image(u32 address, std::span<u8> image) const {
+    assert(address + image.size() <= memory_size);
+    memcpy(image.data(), memory.data() + address, image.size());
 }
 
 error_code Intel8086::load_program(const char* filename) {
@@ -56,7 +231,8 @@ error_code Intel8086::load_program(const char* filename) {
     return {};
 }
 
-error_code Intel8086::dump_memory(const char* filename) {
+error_code Intel8086::dump_memory(const char* filename, u32 size) {
+    assert(size <= memory_size);
     FILE* file = fopen(filename, "wb");
     if (!file) {
         fmt::print(stderr, "Couldn't open file {}\n", filename);
@@ -64,11 +240,264 @@ error_code Intel8086::dump_memory(const char* filename) {
     }
     DEFER { fclose(file); };
 
-    if (fwrite(memory.data(), 1, memory.size(), file) != memory.size()) return make_error_code_errno();
+    if (fwrite(memory.data(), 1, size, file) != size) return make_error_code_errno();
 
     return {};
 }
 
+void Intel8086::map_ports(u16 first, u16 last, PortDevice& device) {
+    assert(first <= last);
+    std::fill(ports.begin() + first, ports.begin() + last + 1, &device);
+}
+
+void Intel8086::unmap_ports(u16 first, u16 last) {
+    assert(first <= last);
+    std::fill(ports.begin() + first, ports.begin() + last + 1, &unmapped_ports);
+}
+
+void Intel8086::map_mmio(u32 address, u32 size, MemoryDevice& device) {
+    assert(address % page_size == 0 && size % page_size == 0 && address + size <= memory_size);
+    for (auto page = address / page_size; page < (address + size) / page_size; ++page) {
+        pages[page] = { &device, false };
+        update_page_access(page);
+    }
+}
+
+void Intel8086::map_rom(u32 address, u32 size) {
+    assert(address % page_size == 0 && size % page_size == 0 && address + size <= memory_size);
+    for (auto page = address / page_size; page < (address + size) / page_size; ++page) {
+        pages[page] = { nullptr, true };
+        update_page_access(page);
+    }
+}
+
+void Intel8086::map_ram(u32 address, u32 size) {
+    assert(address % page_size == 0 && size % page_size == 0 && address + size <= memory_size);
+    for (auto page = address / page_size; page < (address + size) / page_size; ++page) {
+        pages[page] = { nullptr, false, pages[page].watched };
+        update_page_access(page);
+    }
+}
+
+void Intel8086::watch_writes(u32 address, u32 size) {
+    assert(address % page_size == 0 && size % page_size == 0 && address + size <= memory_size);
+    for (auto page = address / page_size; page < (address + size) / page_size; ++page) {
+        pages[page].watched = true;
+        update_page_access(page);
+    }
+}
+
+u8 Intel8086::read_byte_slow(u32 address) const {
+    const auto& page = pages[address / page_size];
+    u8 value = memory[address];
+    if (page.device) {
+        value = page.device->read(address);
+        if (trace) trace->input(value);
+    } else if (breakpoints_armed) {
+        if (auto b = breakpoint_index(address); b != breakpoints.size()) value = breakpoints[b].original;
+    }
+    if (!watchpoints.empty()) check_watchpoints(address, value, WatchAccess::Read);
+    if (hook_callbacks.memory_read) hook_callbacks.memory_read(hook_callbacks.hooks, address, value);
+    return value;
+}
+
+void Intel8086::write_byte_slow(u32 address, u8 value) {
+    const auto& page = pages[address / page_size];
+    if (!watchpoints.empty()) check_watchpoints(address, value, WatchAccess::Write);
+    if (hook_callbacks.memory_write) hook_callbacks.memory_write(hook_callbacks.hooks, address, value);
+    if (page.device) return page.device->write(address, value);
+    if (page.read_only) return;
+    if (dirty_baseline && !is_dirty(address / page_size)) mark_dirty(address / page_size);
+    if (page.watched && !is_written(address / page_size)) mark_written(address / page_size);
+    if (undo_log && !is_logged(address / page_size)) log_page(address / page_size);
+    if (tracing_host_writes) trace->memory_write(address, { &value, 1 });
+    if (breakpoints_armed) {
+        if (auto b = breakpoint_index(address); b != breakpoints.size()) {
+            breakpoints[b].original = value;
+            return;
+        }
+    }
+    memory[address] = value;
+}
+
+void Intel8086::update_page_access(u32 page) {
+    const auto& p = pages[page];
+    u8 access = 0;
+    if (p.device) access |= slow_read | slow_write;
+    if (p.read_only) access |= slow_write;
+    if (dirty_baseline && !is_dirty(page)) access |= slow_write;
+    if (p.watched && !is_written(page)) access |= slow_write;
+    if (undo_log && !is_logged(page) && !p.device && !p.read_only) access |= slow_write;
+    if (breakpoints_armed && has_breakpoint_on_page(page)) access |= slow_read | slow_write;
+    if (hook_callbacks.memory_read) access |= slow_read;
+    if (hook_callbacks.memory_write) access |= slow_write;
+    if (!watchpoints.empty()) {
+        if (is_watched(page, WatchAccess::Read)) access |= slow_read;
+        if (is_watched(page, WatchAccess::Write)) access |= slow_write;
+    }
+    if (tracing_host_writes) [[unlikely]] {
+        untraced_page_access[page] = access;
+        access |= slow_write;
+    }
+    page_access[page] = access;
+}
+
+void Intel8086::add_breakpoint(u32 address) {
+    assert(address < memory_size);
+    if (has_breakpoint(address)) return;
+    auto it = std::lower_bound(breakpoints.begin(), breakpoints.end(), address,
+                               [](const Breakpoint& b, u32 a) { return b.address < a; });
+    breakpoints.insert(it, { address, memory[address] });
+    if (breakpoints_armed) memory[address] = inserted_halt_instruction;
+    update_page_access(address / page_size);
+}
+
+void Intel8086::remove_breakpoint(u32 address) {
+    auto b = breakpoint_index(address);
+    if (b == breakpoints.size()) return;
+    if (breakpoints_armed) memory[address] = breakpoints[b].original;
+    breakpoints.erase(breakpoints.begin() + b);
+    update_page_access(address / page_size);
+}
+
+bool Intel8086::has_breakpoint_on_page(u32 page) const {
+    auto it = std::lower_bound(breakpoints.begin(), breakpoints.end(), page * page_size,
+                               [](const Breakpoint& b, u32 a) { return b.address < a; });
+    return it != breakpoints.end() && it->address / page_size == page;
+}
+
+void Intel8086::arm_breakpoints(bool arm) {
+    if (arm == breakpoints_armed) return;
+    breakpoints_armed = arm;
+    for (auto& b : breakpoints) {
+        if (arm) b.original = std::exchange(memory[b.address], inserted_halt_instruction);
+        else memory[b.address] = b.original;
+        update_page_access(b.address / page_size);
+    }
+}
+
+void Intel8086::add_watchpoint(u32 address, u32 size, WatchAccess access) {
+    assert(size > 0 && address + size <= memory_size);
+    watchpoints.push_back({ address, size, access });
+    for (u32 page = address / page_size; page <= (address + size - 1) / page_size; ++page) update_page_access(page);
+}
+
+void Intel8086::remove_watchpoint(u32 address) {
+    std::vector<Watchpoint> removed;
+    std::erase_if(watchpoints, [&](const Watchpoint& w) {
+        if (w.address == address) removed.push_back(w);
+        return w.address == address;
+    });
+    for (const auto& w : removed) {
+        for (u32 page = w.address / page_size; page <= (w.address + w.size - 1) / page_size; ++page) update_page_access(page);
+    }
+}
+
+bool Intel8086::is_watched(u32 page, WatchAccess access) const {
+    return std::any_of(watchpoints.begin(), watchpoints.end(), [&](const Watchpoint& w) {
+        return (static_cast<u8>(w.access) & static_cast<u8>(access)) && w.address < (page + 1) * page_size
+            && w.address + w.size > page * page_size;
+    });
+}
+
+void Intel8086::check_watchpoints(u32 address, u8 value, WatchAccess access) const {
+    if (watchpoint_hit) return;
+    for (const auto& w : watchpoints) {
+        if ((static_cast<u8>(w.access) & static_cast<u8>(access)) && address - w.address < w.size) {
+            watchpoint_hit = { address, value, access == WatchAccess::Write };
+            return;
+        }
+    }
+}
+
+Intel8086::Snapshot Intel8086::snapshot() {
+    auto image = std::make_shared<const std::vector<u8>>(memory.begin(), memory.end());
+    track_dirty_pages(image);
+    return { registers, ip, flags, std::move(image) };
+}
+
+void Intel8086::restore(const Snapshot& snapshot) {
+    assert(snapshot.memory && snapshot.memory->size() == memory.size());
+
+    registers = snapshot.registers;
+    ip = snapshot.ip;
+    flags = snapshot.flags;
+
+    if (dirty_baseline != snapshot.memory) {
+        log_pages(0, page_count - 1);
+        memcpy(memory.data(), snapshot.memory->data(), memory.size());
+        for (u32 page = 0; page < page_count; ++page) {
+            if (pages[page].watched) written_pages[page / 64] |= u64(1) << (page % 64);
+        }
+        track_dirty_pages(snapshot.memory);
+        return;
+    }
+
+    const auto* image = snapshot.memory->data();
+    for (u32 i = 0; i < dirty_pages.size(); ++i) {
+        while (dirty_pages[i]) {
+            u32 page = i * 64 + std::countr_zero(dirty_pages[i]);
+            dirty_pages[i] &= dirty_pages[i] - 1;
+
+            log_pages(page, page);
+            memcpy(memory.data() + page * page_size, image + page * page_size, page_size);
+            if (pages[page].watched) written_pages[page / 64] |= u64(1) << (page % 64);
+            update_page_access(page);
+        }
+    }
+}
+
+void Intel8086::set_undo_log(UndoLog* log) {
+    undo_log = log;
+    if (log) {
+        log->pages.clear();
+        log->data.clear();
+    }
+    std::fill(logged_pages.begin(), logged_pages.end(), 0);
+    for (u32 page = 0; page < page_count; ++page) update_page_access(page);
+}
+
+void Intel8086::undo(const UndoLog& log) {
+    for (size_t i = 0; i < log.pages.size(); ++i) {
+        load_image(log.pages[i] * page_size, std::span(log.data).subspan(i * page_size, page_size));
+    }
+}
+
+void Intel8086::log_page(u32 page) {
+    logged_pages[page / 64] |= u64(1) << (page % 64);
+    undo_log->pages.push_back(page);
+    undo_log->data.insert(undo_log->data.end(), memory.begin() + page * page_size, memory.begin() + (page + 1) * page_size);
+    if (breakpoints_armed) {
+        auto* logged = undo_log->data.data() + undo_log->data.size() - page_size;
+        for (const auto& b : breakpoints) {
+            if (b.address / page_size == page) logged[b.address % page_size] = b.original;
+        }
+    }
+    update_page_access(page);
+}
+
+void Intel8086::mark_dirty(u32 page) {
+    dirty_pages[page / 64] |= u64(1) << (page % 64);
+    update_page_access(page);
+}
+
+void Intel8086::mark_written(u32 page) {
+    written_pages[page / 64] |= u64(1) << (page % 64);
+    update_page_access(page);
+}
+
+void Intel8086::mark_changed(u32 page) {
+    if (dirty_baseline) dirty_pages[page / 64] |= u64(1) << (page % 64);
+    if (pages[page].watched) written_pages[page / 64] |= u64(1) << (page % 64);
+    update_page_access(page);
+}
+
+void Intel8086::track_dirty_pages(std::shared_ptr<const std::vector<u8>> baseline) {
+    dirty_baseline = std::move(baseline);
+    std::fill(dirty_pages.begin(), dirty_pages.end(), 0);
+    for (u32 page = 0; page < page_count; ++page) update_page_access(page);
+}
+
 void Intel8086::print_state(FILE* out) const {
     constexpr int padding = 8;
 
@@ -112,38 +541,125 @@ u16 Intel8086::calculate_address(const MemoryOperand& mo) const {
     return 0;
 }
 
-error_code Intel8086::run(bool estimate_cycles) {
-    DEFER { if constexpr (verbose_execution) print_state(); };
+Register Intel8086::memory_segment(const MemoryOperand& mo) const {
+    if (segment_override) return *segment_override;
+    switch (mo.eac) {
+        using E = EffectiveAddressCalculation;
+        case E::bp_si:
+        case E::bp_di:
+        case E::bp:
+            return ss;
+        default:
+            return ds;
+    }
+}
 
-    u32 cycles = 0;
-    while (true) {
-        if (memory[ip] == inserted_halt_instruction) break;
-
-        auto instruction = Instruction::decode_at({ memory.data(), (u32)memory.size() }, ip);
-        if (!instruction) {
-            fflush(stdout);
-            fmt::print(stderr, "Unknown instruction at location {} (first byte {:#x})\n", ip, memory[ip]);
-            return Errc::UnknownInstruction;
-        }
+template error_code Intel8086::run(NoHooks& hooks, const RunOptions& options);
+
+void Intel8086::begin_run(const RunOptions& options, RunState& state) {
+    state.first_instruction = instruction_count;
+    stop_reason = StopReason::Halt;
+    watchpoint_hit.reset();
+    for (auto address : options.stop_addresses) {
+        if (has_breakpoint(address)) continue;
+        add_breakpoint(address);
+        state.added_breakpoints.push_back(address);
+    }
+    if (options.max_instructions < UINT64_MAX - instruction_count) {
+        state.instruction_limit = instruction_count + options.max_instructions;
+    }
+    // The cycle budget is delivered by the scheduler, which is checked anyway
+    if (options.max_cycles < UINT64_MAX - cycle_count) {
+        state.cycle_budget = scheduler.schedule(cycle_count + options.max_cycles, [this, &state](u64) {
+            state.out_of_cycles = true;
+            stop();
+        });
+    }
+    arm_breakpoints(true);
+}
 
-        if (execute(*instruction, estimate_cycles, cycles)) break;
+void Intel8086::end_run(RunState& state) {
+    arm_breakpoints(false);
+    for (auto address : state.added_breakpoints) remove_breakpoint(address);
+    if (state.cycle_budget) scheduler.cancel(*state.cycle_budget);
+    // Also when the block with the access halted
+    if (watchpoint_hit && stop_reason == StopReason::Halt) stop_reason = StopReason::Watchpoint;
+}
+
+bool Intel8086::decode_at_breakpoint(u32 address, const RunOptions& options, const RunState& state, std::optional<Instruction>& instruction) {
+    auto b = breakpoints_armed ? breakpoint_index(address) : breakpoints.size();
+    if (b == breakpoints.size() || breakpoints[b].original == inserted_halt_instruction) return false;
+    if (instruction_count != state.first_instruction || options.break_at_start) {
+        auto& stops = options.stop_addresses;
+        bool stop_address = std::find(stops.begin(), stops.end(), address) != stops.end();
+        stop_reason = stop_address ? StopReason::StopAddress : StopReason::Breakpoint;
+        return false;
+    }
+    // The run starts at the breakpoint, so its instruction is executed
+    memory[address] = breakpoints[b].original;
+    instruction = Instruction::decode_at({ memory.data(), (u32)memory.size() }, address);
+    memory[address] = inserted_halt_instruction;
+    return true;
+}
+
+void Intel8086::set_hook_callbacks(const HookCallbacks& callbacks) {
+    bool memory_hooks = hook_callbacks.memory_read || hook_callbacks.memory_write;
+    hook_callbacks = callbacks;
+    if (memory_hooks || hook_callbacks.memory_read || hook_callbacks.memory_write) {
+        for (u32 page = 0; page < page_count; ++page) update_page_access(page);
+    }
+}
+
+expected<Intel8086::ExecuteResult, error_code> Intel8086::step(bool estimate_cycles) {
+    watchpoint_hit.reset();
+    auto address = get_physical_ip();
+    if (memory[address] == inserted_halt_instruction) return ExecuteResult::Halt;
+
+    auto instruction = Instruction::decode_at({ memory.data(), (u32)memory.size() }, address);
+    if (!instruction) {
+        fflush(stdout);
+        fmt::print(stderr, "Unknown instruction at location {:04x}:{:04x} (first byte {:#x})\n", get(cs), ip, memory[address]);
+        return unexpected(Errc::UnknownInstruction);
     }
 
+    u32 cycles = 0;
+    auto result = execute(*instruction, estimate_cycles, cycles);
+    ++instruction_count;
+    return result;
+}
+
+error_code Intel8086::run_to(u32 address, bool estimate_cycles) {
+    auto original = memory[address];
+    memory[address] = inserted_halt_instruction;
+    auto result = run(estimate_cycles);
+    memory[address] = original;
+    RET_IF(result);
+
+    if (get_physical_ip() != address) {
+        fflush(stdout);
+        fmt::print(stderr, "Execution stopped at {:#07x} before reaching {:#07x}\n", get_physical_ip(), address);
+        return Errc::EmulationError;
+    }
     return {};
 }
 
-bool Intel8086::execute(const Instruction& i, bool estimate_cycles, u32& cycles) {
+Intel8086::ExecuteResult Intel8086::execute(const Instruction& i, bool estimate_cycles, u32& cycles) {
     using enum Instruction::Type;
     using enum Operand::Type;
+    using enum ExecuteResult;
 
-    if constexpr (verbose_execution) {
+    if (verbose_execution && verbose) {
         fmt::print("{}", i);
-        if (estimate_cycles) {
-            fmt::print(" ; ");
-            cycles += i.estimate_cycles(cycles, stdout);
-        }
+        if (estimate_cycles) fmt::print(" ; ");
+    }
+    DEFER { if (verbose_execution && verbose) fmt::print("\n"); };
+
+    u32 instruction_cycles = 0;
+    if (estimate_cycles) {
+        instruction_cycles = i.estimate_cycles(cycles, verbose_execution && verbose ? stdout : nullptr);
+        cycles += instruction_cycles;
     }
-    DEFER { if constexpr (verbose_execution) fmt::print("\n"); };
+    cycle_count += instruction_cycles ? instruction_cycles : base_instruction_cycles[static_cast<size_t>(i.type)];
 
     const auto& o1 = i.operands[0];
     const auto& o2 = i.operands[1];
@@ -152,131 +668,531 @@ bool Intel8086::execute(const Instruction& i, bool estimate_cycles, u32& cycles)
     if (ocount == 1 && o2.type != None) ++ocount;
 
     ip += i.size;
+    segment_override = i.segment_override;
 
     switch (i.type) {
         case Mov:
             TWO_OPERANDS_REQUIRED;
             set(o1, o2, i.flags.wide);
             break;
-        case Add: {
+        case Add:
+        case Or:
+        case Adc:
+        case Sbb:
+        case And:
+        case Sub:
+        case Xor:
+        case Cmp:
+        case Test:
             TWO_OPERANDS_REQUIRED;
-            UNIMPLEMENTED_SHORT;
-
-            u16 a = get(o1, true);
-            u16 b = get(o2, true);
-
-            u32 wide_result = a + b;
-            u16 result = wide_result & 0xffff;
-
-            set(o1, result, true);
-            set_flags(a, b, result, wide_result, false);
-
+            if (i.flags.wide) execute_alu<u16>(i.type, o1, get(o2, true));
+            else execute_alu<u8>(i.type, o1, get(o2, false));
+            break;
+        case Inc:
+        case Dec:
+        case Neg:
+        case Not:
+            ONE_OPERAND_REQUIRED;
+            if (i.flags.wide) execute_alu<u16>(i.type, o1, 1);
+            else execute_alu<u8>(i.type, o1, 1);
+            break;
+        case Lea:
+            TWO_OPERANDS_REQUIRED;
+            if (o1.type != Register || o2.type != Memory) UNIMPLEMENTED_INSTRUCTION;
+            set(o1.reg, calculate_address(o2.memory));
+            break;
+        case Lds:
+        case Les: {
+            TWO_OPERANDS_REQUIRED;
+            if (o1.type != Register || o2.type != Memory) UNIMPLEMENTED_INSTRUCTION;
+            auto segment = get(memory_segment(o2.memory));
+            auto offset = calculate_address(o2.memory);
+            set(o1.reg, read_word(segment, offset));
+            set(i.type == Lds ? ds : es, read_word(segment, offset + 2));
             break;
         }
-        case Sub:
-        case Cmp: {
+        case Lahf:
+            set(ah, flags.word & 0xff);
+            break;
+        case Sahf:
+            flags.assign(Flags::sign | Flags::zero | Flags::auxiliary | Flags::parity | Flags::carry, get(ah));
+            break;
+        case Pushf:
+            push(flags.word);
+            break;
+        case Popf:
+            flags.load(pop());
+            break;
+        case Aaa:
+        case Aas: {
+            auto& adjust = (i.type == Aaa ? aaa_table : aas_table)[get(al) | (flags.a() << 8)];
+            set(al, adjust.al);
+            if (adjust.flags & Flags::carry) set(ah, get(ah) + (i.type == Aaa ? 1 : -1));
+            set_adjust_flags(adjust.flags, false);
+            break;
+        }
+        case Daa:
+        case Das: {
+            auto& adjust = (i.type == Daa ? daa_table : das_table)[get(al) | (flags.c() << 8) | (flags.a() << 9)];
+            set(al, adjust.al);
+            set_adjust_flags(adjust.flags, true);
+            break;
+        }
+        case Aam: {
+            u8 base = o1.type == Immediate ? o1.immediate : 10;
+            if (base == 0) {
+                interrupt(divide_error_interrupt);
+                return EndOfBlock;
+            }
+            u8 value = get(al);
+            set(ah, value / base);
+            set(al, value % base);
+            set_adjust_flags(bcd_result_flags(value % base), true);
+            break;
+        }
+        case Aad: {
+            u8 base = o1.type == Immediate ? o1.immediate : 10;
+            u8 value = get(al) + get(ah) * base;
+            set(ax, value);
+            set_adjust_flags(bcd_result_flags(value), true);
+            break;
+        }
+        case Mul:
+        case Imul:
+            ONE_OPERAND_REQUIRED;
+            if (i.flags.wide) execute_multiply<u16>(i.type == Imul, o1);
+            else execute_multiply<u8>(i.type == Imul, o1);
+            break;
+        case Div:
+        case Idiv: {
+            ONE_OPERAND_REQUIRED;
+            bool ok = i.flags.wide ? execute_divide<u16>(i.type == Idiv, o1) : execute_divide<u8>(i.type == Idiv, o1);
+            if (ok) break;
+            interrupt(divide_error_interrupt);
+            return EndOfBlock;
+        }
+        case Rol:
+        case Ror:
+        case Rcl:
+        case Rcr:
+        case Shl:
+        case Shr:
+        case Sar:
             TWO_OPERANDS_REQUIRED;
-            UNIMPLEMENTED_SHORT;
-
-            u16 a = get(o1, true);
-            u16 b = get(o2, true);
-
-            u32 wide_result = a - b;
-            u16 result = wide_result & 0xffff;
-
-            if (i.type == Sub) set(o1, result, true);
-            set_flags(a, b, result, wide_result, true);
-
+            if (i.flags.wide) execute_shift<u16>(i.type, o1, get(o2) & 0xff);
+            else execute_shift<u8>(i.type, o1, get(o2) & 0xff);
+            break;
+        case In: {
+            TWO_OPERANDS_REQUIRED;
+            u16 port = get(o2);
+            auto value = ports[port]->in(port, i.flags.wide);
+            if (trace) trace->input(value);
+            set(o1, value, i.flags.wide);
+            break;
+        }
+        case Out: {
+            TWO_OPERANDS_REQUIRED;
+            u16 port = get(o1);
+            ports[port]->out(port, get(o2), i.flags.wide);
             break;
         }
         case Call:
+        case Jmp:
             ONE_OPERAND_REQUIRED;
-            if (o1.type != IpInc) UNIMPLEMENTED_INSTRUCTION;
-            push(get(ip));
-            ip += o1.ip_inc;
-            break;
+            if (i.flags.intersegment && o1.type == Register) UNIMPLEMENTED_INSTRUCTION;
+            jump(i, i.type == Call);
+            return EndOfBlock;
         case Ret:
-            if (i.flags.intersegment) UNIMPLEMENTED_INSTRUCTION;
             ip = pop();
+            if (i.flags.intersegment) set(cs, pop());
             if (o1.type == Immediate) set(sp, get(sp) + o1.immediate);
-            break;
+            return EndOfBlock;
         case Jb:
             ONE_OPERAND_REQUIRED;
-            if (flags.c) ip += get<i16>(o1);
-            break;
+            if (flags.c()) ip += get<i16>(o1);
+            return EndOfBlock;
         case Je:
             ONE_OPERAND_REQUIRED;
-            if (flags.z) ip += get<i16>(o1);
-            break;
+            if (flags.z()) ip += get<i16>(o1);
+            return EndOfBlock;
         case Jnz:
             ONE_OPERAND_REQUIRED;
-            if (!flags.z) ip += get<i16>(o1);
-            break;
+            if (!flags.z()) ip += get<i16>(o1);
+            return EndOfBlock;
         case Jp:
             ONE_OPERAND_REQUIRED;
-            if (flags.p) ip += get<i16>(o1);
-            break;
+            if (flags.p()) ip += get<i16>(o1);
+            return EndOfBlock;
         case Loop:
             ONE_OPERAND_REQUIRED;
             set(cx, get(cx) - 1);
             if (get(cx) != 0) ip += get<i16>(o1);
-            break;
+            return EndOfBlock;
         case Loopz:
             ONE_OPERAND_REQUIRED;
             set(cx, get(cx) - 1);
-            if (get(cx) != 0 && flags.z) ip += get<i16>(o1);
-            break;
+            if (get(cx) != 0 && flags.z()) ip += get<i16>(o1);
+            return EndOfBlock;
         case Loopnz:
             ONE_OPERAND_REQUIRED;
             set(cx, get(cx) - 1);
-            if (get(cx) != 0 && !flags.z) ip += get<i16>(o1);
-            break;
+            if (get(cx) != 0 && !flags.z()) ip += get<i16>(o1);
+            return EndOfBlock;
+        case Int:
+            ONE_OPERAND_REQUIRED;
+            return software_interrupt(get(o1) & 0xff);
+        case Int3:
+            return software_interrupt(3);
+        case Into:
+            if (!flags.o()) break;
+            return software_interrupt(4);
+        case Iret:
+            ip = pop();
+            set(cs, pop());
+            flags.load(pop());
+            return EndOfBlock;
         case Hlt:
-            return true;
+            return Halt;
         default:
             UNIMPLEMENTED_INSTRUCTION;
     }
 
-    return false;
+    return Continue;
 }
 
-void Intel8086::set_flags(u16 a, u16 b, u16 result, u32 wide_result, bool is_sub) {
-    if constexpr (verbose_execution) {
-        fmt::print(" ; Flags: {}->", flags);
+template<typename T>
+void Intel8086::execute_alu(Instruction::Type type, const Operand& destination, u16 source) {
+    using enum Instruction::Type;
+    using K = AluOperation::Kind;
+    constexpr u32 bits = sizeof(T) * 8;
+    constexpr bool wide = sizeof(T) == 2;
+
+    const auto& operation = alu_operations[static_cast<size_t>(type)];
+    assert(operation.kind != K::None);
+
+    u32 a = static_cast<T>(get(destination, wide));
+    u32 b = static_cast<T>(source);
+    if (operation.negate) {
+        b = a;
+        a = 0;
     }
+    u32 carry = operation.carry_in && flags.c();
 
-    bool a_signed = a & (1 << 15);
-    bool b_signed = (is_sub ? -b : b) & (1 << 15);
-    bool result_signed = result & (1 << 15);
+    u32 result = 0;
+    switch (operation.kind) {
+        case K::Addition:
+            result = a + b + carry;
+            break;
+        case K::Subtraction:
+            result = a - b - carry;
+            break;
+        case K::Logic:
+            switch (type) {
+                case And:
+                case Test:
+                    result = a & b;
+                    break;
+                case Or:
+                    result = a | b;
+                    break;
+                case Xor:
+                    result = a ^ b;
+                    break;
+                case Not:
+                    result = ~a;
+                    break;
+                default:
+                    assert(false);
+                    break;
+            }
+            break;
+        case K::None:
+            break;
+    }
+
+    if (operation.write_back) set(destination, static_cast<T>(result), wide);
+    if (operation.keep_flags) return;
+
+    if (verbose_execution && verbose) fmt::print(" ; Flags: {}->", flags);
+
+    // Bit `bits` of the 32-bit result is the carry out of an addition and the
+    // borrow of a subtraction. Overflow happens when the operands of an
+    // addition (or the minuend and the negated subtrahend) have the same sign
+    // and the result has a different one. The new flags are collected into
+    // their FLAGS word positions and merged with one masked store.
+    u32 overflow = operation.kind == K::Addition ? (a ^ result) & (b ^ result) : (a ^ b) & (a ^ result);
+    u32 arithmetic_flags = ((result >> bits) & 1) * Flags::carry
+        | ((a ^ b ^ result) & Flags::auxiliary)
+        | ((overflow >> (bits - 1)) & 1) * Flags::overflow;
+    if (operation.kind == K::Logic) arithmetic_flags = 0;
+
+    u32 new_flags = arithmetic_flags
+        | parity_table[result & 0xff]
+        | (static_cast<T>(result) == 0) * Flags::zero
+        | ((result >> (bits - 8)) & Flags::sign);
+    flags.assign(operation.keep_carry ? Flags::status & ~Flags::carry : Flags::status, static_cast<u16>(new_flags));
+
+    if (verbose_execution && verbose) fmt::print("{}", flags);
+}
 
-    bool aux_carry = (u32)(a & 0xf) + (u32)(b & 0xf) > 0xf;
-    bool aux_borrow =  (i32)(a & 0xf) - (i32)(b & 0xf) < 0;
+void Intel8086::set_adjust_flags(u8 adjust_flags, bool result_flags) {
+    if (verbose_execution && verbose) fmt::print(" ; Flags: {}->", flags);
 
-    bool argument_same_sign = a_signed == b_signed;
+    u16 mask = Flags::carry | Flags::auxiliary;
+    if (result_flags) mask |= Flags::parity | Flags::zero | Flags::sign;
+    flags.assign(mask, adjust_flags);
 
-    flags.c = wide_result > std::numeric_limits<decltype(result)>::max();
-    flags.p = std::popcount<u8>(result & 0xff) % 2 == 0;
-    flags.a = is_sub ? aux_borrow : aux_carry;
-    flags.z = result == 0;
-    flags.s = result & (1 << 15);
-    flags.o = argument_same_sign && (a_signed != result_signed);
+    if (verbose_execution && verbose) fmt::print("{}", flags);
+}
+
+template<typename T>
+void Intel8086::execute_multiply(bool is_signed, const Operand& source) {
+    constexpr bool wide = sizeof(T) == 2;
+    using S = std::make_signed_t<T>;
 
-    if constexpr (verbose_execution) {
-        fmt::print("{}", flags);
+    u16 accumulator = get(wide ? Register::ax : Register::al);
+    u32 result = 0;
+    bool upper_half_used = false;
+    if (is_signed) {
+        i32 r = static_cast<i32>(static_cast<S>(accumulator)) * static_cast<S>(get(source, wide));
+        result = static_cast<u32>(r);
+        upper_half_used = r != static_cast<S>(r);
+    } else {
+        result = static_cast<u32>(static_cast<T>(accumulator)) * static_cast<T>(get(source, wide));
+        upper_half_used = result >> (sizeof(T) * 8);
     }
+
+    if (wide) {
+        set(Register::ax, result & 0xffff);
+        set(Register::dx, result >> 16);
+    } else {
+        set(Register::ax, result & 0xffff);
+    }
+
+    // Other flags are undefined after a multiplication and are left as they were
+    flags.assign(Flags::carry | Flags::overflow, upper_half_used ? Flags::carry | Flags::overflow : 0);
+}
+
+template<typename T>
+bool Intel8086::execute_divide(bool is_signed, const Operand& source) {
+    constexpr bool wide = sizeof(T) == 2;
+    constexpr u32 bits = sizeof(T) * 8;
+    using S = std::make_signed_t<T>;
+
+    u32 dividend = wide ? (get(Register::dx) << 16) | get(Register::ax) : get(Register::ax);
+    T divisor = get(source, wide);
+    if (divisor == 0) return false;
+
+    u32 quotient = 0;
+    u32 remainder = 0;
+    if (is_signed) {
+        // On an 8086 the most negative quotient also causes a divide error.
+        // Dividing in 64 bits keeps INT32_MIN / -1 from trapping on the host.
+        constexpr i64 max = std::numeric_limits<S>::max();
+        i64 n = wide ? static_cast<i32>(dividend) : static_cast<i16>(dividend);
+        i64 d = static_cast<S>(divisor);
+        i64 q = n / d;
+        if (q > max || q < -max) return false;
+        quotient = static_cast<u32>(q);
+        remainder = static_cast<u32>(n % d);
+    } else {
+        quotient = dividend / divisor;
+        if (quotient >> bits) return false;
+        remainder = dividend % divisor;
+    }
+
+    if (wide) {
+        set(Register::ax, quotient & 0xffff);
+        set(Register::dx, remainder & 0xffff);
+    } else {
+        set(Register::al, quotient & 0xff);
+        set(Register::ah, remainder & 0xff);
+    }
+    return true;
+}
+
+template<typename T>
+void Intel8086::execute_shift(Instruction::Type type, const Operand& destination, u32 count) {
+    using enum Instruction::Type;
+    constexpr u32 bits = sizeof(T) * 8;
+    constexpr u32 mask = std::numeric_limits<T>::max();
+    constexpr bool wide = sizeof(T) == 2;
+
+    // Nothing, not even the flags, changes with a zero count
+    if (count == 0) return;
+
+    u32 value = static_cast<T>(get(destination, wide));
+    u32 result = 0;
+    bool carry = false;
+
+    // The 8086 doesn't mask the count, so shifting by more than the width is
+    // clamped to a count that gives the same result, and the rotations are
+    // reduced modulo their cycle length. No operation loops over the bits.
+    switch (type) {
+        case Shl: {
+            u32 c = std::min(count, bits + 1);
+            u64 shifted = static_cast<u64>(value) << c;
+            result = shifted & mask;
+            carry = (shifted >> bits) & 1;
+            break;
+        }
+        case Shr: {
+            u32 c = std::min(count, bits + 1);
+            result = static_cast<u32>(static_cast<u64>(value) >> c);
+            carry = (value >> (c - 1)) & 1;
+            break;
+        }
+        case Sar: {
+            u32 c = std::min(count, bits);
+            i32 signed_value = static_cast<std::make_signed_t<T>>(value);
+            result = static_cast<u32>(signed_value >> c) & mask;
+            carry = (signed_value >> (c - 1)) & 1;
+            break;
+        }
+        case Rol: {
+            u32 c = count % bits;
+            result = ((value << c) | (value >> (bits - c))) & mask;
+            carry = result & 1;
+            break;
+        }
+        case Ror: {
+            u32 c = count % bits;
+            result = ((value >> c) | (value << (bits - c))) & mask;
+            carry = (result >> (bits - 1)) & 1;
+            break;
+        }
+        case Rcl:
+        case Rcr: {
+            // Rotate the carry and the value as one bits + 1 wide value
+            constexpr u64 wide_mask = (u64(1) << (bits + 1)) - 1;
+            u64 c = count % (bits + 1);
+            u64 v = (static_cast<u64>(flags.c()) << bits) | value;
+            if (type == Rcr) c = (bits + 1 - c) % (bits + 1);
+            u64 rotated = ((v << c) | (v >> (bits + 1 - c))) & wide_mask;
+            result = rotated & mask;
+            carry = (rotated >> bits) & 1;
+            break;
+        }
+        default:
+            assert(false);
+            return;
+    }
+
+    set(destination, static_cast<T>(result), wide);
+
+    if (verbose_execution && verbose) fmt::print(" ; Flags: {}->", flags);
+
+    // The overflow flag is only defined for single bit shifts, but the same
+    // formulas are used for every count
+    bool msb = (result >> (bits - 1)) & 1;
+    bool second_msb = (result >> (bits - 2)) & 1;
+    bool overflow = false;
+    switch (type) {
+        case Shl:
+        case Rol:
+        case Rcl:
+            overflow = msb != carry;
+            break;
+        case Shr:
+            overflow = (value >> (bits - 1)) & 1;
+            break;
+        case Ror:
+        case Rcr:
+            overflow = msb != second_msb;
+            break;
+        default:
+            break;
+    }
+    flags.set(Flags::carry, carry);
+    flags.set(Flags::overflow, overflow);
+    if (type == Shl || type == Shr || type == Sar) {
+        flags.set(Flags::parity, parity_table[result & 0xff]);
+        flags.set(Flags::zero, result == 0);
+        flags.set(Flags::sign, msb);
+    }
+
+    if (verbose_execution && verbose) fmt::print("{}", flags);
+}
+
+void Intel8086::jump(const Instruction& i, bool call) {
+    const auto& o1 = i.operands[0];
+    const auto& o2 = i.operands[1];
+
+    // Direct intersegment transfers have the segment and offset as immediates,
+    // indirect ones read the offset and then the segment from memory
+    u16 target_segment = get(cs);
+    u16 target = 0;
+    if (o1.type == Operand::Type::IpInc) {
+        target = ip + o1.ip_inc;
+    } else if (i.flags.intersegment && o1.type == Operand::Type::Immediate) {
+        target_segment = o1.immediate;
+        target = o2.immediate;
+    } else if (i.flags.intersegment) {
+        auto segment = get(memory_segment(o1.memory));
+        auto offset = calculate_address(o1.memory);
+        target = read_word(segment, offset);
+        target_segment = read_word(segment, offset + 2);
+    } else {
+        target = get(o1, true);
+    }
+
+    if (call) {
+        if (i.flags.intersegment) push(get(cs));
+        push(ip);
+    }
+    set(cs, target_segment);
+    ip = target;
+}
+
+void Intel8086::interrupt(u8 number) {
+    if (hook_callbacks.interrupt) hook_callbacks.interrupt(hook_callbacks.hooks, *this, number);
+    push(flags.word);
+    push(get(cs));
+    push(ip);
+    flags.assign(Flags::interrupt | Flags::trap, 0);
+
+    u32 vector = number * 4;
+    ip = read_word(vector);
+    set(cs, read_word(vector + 2));
+}
+
+Intel8086::ExecuteResult Intel8086::software_interrupt(u8 number) {
+    if (auto handler = interrupt_handlers[number]) {
+        if (hook_callbacks.interrupt) hook_callbacks.interrupt(hook_callbacks.hooks, *this, number);
+        bool armed = breakpoints_armed;
+        arm_breakpoints(false);
+        DEFER { arm_breakpoints(armed); };
+        if (trace) return traced_software_interrupt(*handler, number);
+        return handler->interrupt(*this, number) ? ExecuteResult::EndOfBlock : ExecuteResult::Halt;
+    }
+    interrupt(number);
+    return ExecuteResult::EndOfBlock;
+}
+
+Intel8086::ExecuteResult Intel8086::traced_software_interrupt(InterruptHandler& handler, u8 number) {
+    // The handler runs with a copy of the access table where every page is
+    // write protected, which is cheaper than recomputing the access of every
+    // page on the way in and out
+    untraced_page_access = page_access;
+    for (auto& access : page_access) access |= slow_write;
+    tracing_host_writes = true;
+    bool resume = handler.interrupt(*this, number);
+    tracing_host_writes = false;
+    page_access.swap(untraced_page_access);
+
+    trace->host_interrupt(*this, resume);
+    return resume ? ExecuteResult::EndOfBlock : ExecuteResult::Halt;
 }
 
 void Intel8086::push(u16 value, bool wide) {
     set(sp, get(sp) - 2);
-    u32 s = get(sp);
-    memory[s] = value & 0xff;
-    if (wide) memory[s + 1] = value >> 8;
+    if (wide) write_word(get(ss), get(sp), value);
+    else write_byte(physical_address(get(ss), get(sp)), value & 0xff);
 }
 
 u16 Intel8086::pop(bool wide) {
-    u32 s = get(sp);
-    u16 value = memory[s] | (wide ? (memory[s + 1] << 8) : 0);
-    set(sp, get(s) + 2);
+    u16 value = wide ? read_word(get(ss), get(sp)) : read_byte(physical_address(get(ss), get(sp)));
+    set(sp, get(sp) + 2);
     return value;
 }
 
@@ -1,45 +1,255 @@
 #pragma once
 
 #include "common.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cstdio>
+#include <memory>
 #include <vector>
 #include <fmt/core.h>
 
+#include "device.hpp"
 #include "instruction.hpp"
+#include "scheduler.hpp"
+
+class TraceWriter;
 
 class Intel8086 {
     using enum Register;
 public:
+    // The FLAGS word as it's pushed to the stack
     struct Flags {
-        bool c : 1; // Carry
-        bool p : 1; // Parity
-        bool a : 1; // Auxiliary carry
-        bool z : 1; // Zero
-        bool s : 1; // Sign
-        bool o : 1; // Overflow
-        bool i : 1; // Interrupt-enable
-        bool d : 1; // Direction
-        bool t : 1; // Trap
+        static constexpr u16 carry = 1 << 0;
+        static constexpr u16 parity = 1 << 2;
+        static constexpr u16 auxiliary = 1 << 4;
+        static constexpr u16 zero = 1 << 6;
+        static constexpr u16 sign = 1 << 7;
+        static constexpr u16 trap = 1 << 8;
+        static constexpr u16 interrupt = 1 << 9;
+        static constexpr u16 direction = 1 << 10;
+        static constexpr u16 overflow = 1 << 11;
+
+        static constexpr u16 status = carry | parity | auxiliary | zero | sign | overflow;
+        static constexpr u16 defined = status | trap | interrupt | direction;
+        // Bits 1 and 12-15 always read as set on an 8086
+        static constexpr u16 reserved = 0xf002;
+
+        u16 word = reserved;
+
+        bool c() const { return word & carry; }
+        bool p() const { return word & parity; }
+        bool a() const { return word & auxiliary; }
+        bool z() const { return word & zero; }
+        bool s() const { return word & sign; }
+        bool o() const { return word & overflow; }
+        bool i() const { return word & interrupt; }
+        bool d() const { return word & direction; }
+        bool t() const { return word & trap; }
+
+        void set(u16 flag, bool value) {
+            word = static_cast<u16>((word & ~flag) | (value ? flag : 0));
+        }
+        // Replaces the flags selected by mask with the ones in bits
+        void assign(u16 mask, u16 bits) {
+            word = static_cast<u16>((word & ~mask) | (bits & mask));
+        }
+        void load(u16 value) {
+            word = (value & defined) | reserved;
+        }
 
         bool operator==(const Flags& f) const = default;
         explicit operator bool() const {
-            return *this != Flags();
+            return word & defined;
         }
     };
 
-    static constexpr u32 memory_size = 1 << 16;
+    // Registers and memory at some point of execution. The memory image is
+    // shared between copies of a snapshot. The emulated clock, the scheduler
+    // and the devices are not part of a snapshot.
+    struct Snapshot {
+        std::array<u16, 12> registers = {};
+        u16 ip = 0;
+        Flags flags = {};
+        std::shared_ptr<const std::vector<u8>> memory;
+    };
+
+    // The pages of memory as they were before they were first written since
+    // the log was set, see set_undo_log()
+    struct UndoLog {
+        std::vector<u32> pages;
+        std::vector<u8> data;
+    };
+
+    static constexpr u32 memory_size = 1 << 20;
+    static constexpr u32 page_size = 256;
+    static constexpr u32 page_count = memory_size / page_size;
+    static constexpr u32 port_count = 1 << 16;
+
+    enum class ExecuteResult {
+        Continue,
+        // The instruction transferred control, so it ends a block
+        EndOfBlock,
+        Halt,
+    };
+
+    // Why run() returned without an error
+    enum class StopReason : u8 {
+        // The inserted halt instruction, hlt or a host interrupt handler
+        Halt,
+        // stop() was called
+        Stopped,
+        Breakpoint,
+        Watchpoint,
+        // The limits of RunOptions
+        InstructionLimit,
+        CycleLimit,
+        StopAddress,
+        Cancelled,
+        // An instruction or operand form that isn't emulated
+        Unimplemented,
+    };
+
+    struct RunOptions {
+        bool estimate_cycles = false;
+        // Budgets of the run. They're checked once per block, so the run
+        // stops at the end of the block during which one ran out.
+        u64 max_instructions = UINT64_MAX;
+        u64 max_cycles = UINT64_MAX;
+        // Physical addresses to stop at before executing their instruction,
+        // placed like breakpoints
+        std::span<const u32> stop_addresses = {};
+        // Polled once per block, can be set from another thread
+        const std::atomic<bool>* cancel = nullptr;
+        // A run that starts at a breakpoint or stop address executes its
+        // instruction, unless the run continues one that ran out of its budget
+        // before reaching it
+        bool break_at_start = false;
+    };
+
+    enum class WatchAccess : u8 {
+        Read = 1 << 0,
+        Write = 1 << 1,
+        ReadWrite = Read | Write,
+    };
+    struct WatchpointHit {
+        u32 address = 0;
+        u8 value = 0;
+        bool write = false;
+    };
 
-    Intel8086() : memory(memory_size) {
+    Intel8086() : owned_memory(memory_size), memory(owned_memory), pages(page_count), page_access(page_count), dirty_pages(page_count / 64), written_pages(page_count / 64), logged_pages(page_count / 64), ports(port_count, &unmapped_ports) {
         set(sp, 0xffff);
     }
     Intel8086(std::span<const u8> program) : Intel8086() {
         load_program(program);
     }
+    // The memory may live outside of the emulator, see move_memory_to()
+    Intel8086(const Intel8086&) = delete;
+    Intel8086(Intel8086&&) = delete;
+    Intel8086& operator=(const Intel8086&) = delete;
+    Intel8086& operator=(Intel8086&&) = delete;
+    ~Intel8086() = default;
 
+    // Copies the memory to storage owned by the caller, e.g. a shared memory
+    // object, and keeps using it from there. The storage has to outlive the
+    // emulator.
+    void move_memory_to(std::span<u8> storage);
+    // Uses the storage as the memory in place, with its contents, e.g. a
+    // copy-on-write mapping of a file. The storage has to outlive the
+    // emulator.
+    void use_memory(std::span<u8> storage);
+
+    // Loads a flat binary to address 0 and inserts the halt instruction after it
     void load_program(std::span<const u8> program);
     error_code load_program(const char* filename);
+    // Copy between the memory at a physical address and a host buffer
+    // directly, bypassing devices
+    void load_image(u32 address, std::span<const u8> image);
+    void read_image(u32 address, std::span<u8> image) const;
+
+    // Writes the first size bytes of the memory
+    error_code dump_memory(const char* filename, u32 size = memory_size);
+
+    // Pages written after snapshot() or restore() are tracked, so restoring
+    // the latest snapshot again only copies those pages back. Restoring any
+    // other snapshot copies the whole memory and starts tracking against it.
+    Snapshot snapshot();
+    void restore(const Snapshot& snapshot);
+
+    // Clears the log and copies every page to it before its next first
+    // write, which takes the slow path like dirty tracking does, so undo()
+    // can bring the memory back to this point. Memory-mapped and read-only
+    // pages aren't logged. The log has to outlive the emulator or be reset
+    // with nullptr.
+    void set_undo_log(UndoLog* log);
+    // Writes the pages of a log back to the memory
+    void undo(const UndoLog& log);
+
+    // Devices are not owned by the emulator and have to outlive it
+    void map_ports(u16 first, u16 last, PortDevice& device);
+    void unmap_ports(u16 first, u16 last);
+
+    // The ranges have to be page aligned. Instructions are always fetched
+    // directly from the memory, so code can't be executed from MMIO pages.
+    void map_mmio(u32 address, u32 size, MemoryDevice& device);
+    void map_rom(u32 address, u32 size);
+    void map_ram(u32 address, u32 size);
 
-    error_code dump_memory(const char* filename);
+    // Watched pages are write protected until written, so only the first
+    // write to a page after take_written_pages() takes the slow path and
+    // records it. Used to find the parts of a framebuffer that changed.
+    void watch_writes(u32 address, u32 size);
+    // Calls f(page) for every watched page written since the previous call
+    template<typename F>
+    void take_written_pages(F f) {
+        for (u32 i = 0; i < written_pages.size(); ++i) {
+            while (written_pages[i]) {
+                u32 page = i * 64 + std::countr_zero(written_pages[i]);
+                written_pages[i] &= written_pages[i] - 1;
+                update_page_access(page);
+                f(page);
+            }
+        }
+    }
+
+    // Software interrupts with a handler are serviced on the host instead of
+    // going through the interrupt vector table. Hardware interrupts and CPU
+    // exceptions always use the vector table.
+    void map_interrupt(u8 number, InterruptHandler& handler) { interrupt_handlers[number] = &handler; }
+    void unmap_interrupt(u8 number) { interrupt_handlers[number] = nullptr; }
+    bool has_interrupt_handler(u8 number) const { return interrupt_handlers[number]; }
+    bool is_mmio_page(u32 page) const { return pages[page].device; }
+    bool is_rom_page(u32 page) const { return pages[page].read_only; }
+
+    u8 read_byte(u32 address) const {
+        if (page_access[address / page_size] & slow_read) [[unlikely]] return read_byte_slow(address);
+        return memory[address];
+    }
+    void write_byte(u32 address, u8 value) {
+        if (page_access[address / page_size] & slow_write) [[unlikely]] return write_byte_slow(address, value);
+        memory[address] = value;
+    }
+    // The high byte of a word wraps around within the 1M address space
+    u16 read_word(u32 address) const {
+        return read_byte(address) | (read_byte((address + 1) & (memory_size - 1)) << 8);
+    }
+    void write_word(u32 address, u16 value) {
+        write_byte(address, value & 0xff);
+        write_byte((address + 1) & (memory_size - 1), value >> 8);
+    }
+    // The high byte of a word wraps around within the segment
+    u16 read_word(u16 segment, u16 offset) const {
+        return read_byte(physical_address(segment, offset)) | (read_byte(physical_address(segment, offset + 1)) << 8);
+    }
+    void write_word(u16 segment, u16 offset, u16 value) {
+        write_byte(physical_address(segment, offset), value & 0xff);
+        write_byte(physical_address(segment, offset + 1), value >> 8);
+    }
+
+    static u32 physical_address(u16 segment, u16 offset) {
+        return ((static_cast<u32>(segment) << 4) + offset) & (memory_size - 1);
+    }
 
     template<typename T = u16>
     T get(Register reg) const {
@@ -78,10 +288,9 @@ public:
             case Immediate:
                 return o.immediate;
             case Memory: {
-                auto address = calculate_address(o.memory);
-                u16 value = memory[address];
-                if (wide_memory) value |= memory[address + 1] << 8;
-                return value;
+                auto segment = get(memory_segment(o.memory));
+                auto offset = calculate_address(o.memory);
+                return wide_memory ? read_word(segment, offset) : read_byte(physical_address(segment, offset));
             }
             case IpInc:
                 return o.ip_inc;
@@ -90,9 +299,28 @@ public:
         return 0;
     }
 
+    // Offset of a memory operand within its segment
     u16 calculate_address(const MemoryOperand& mo) const;
+    // The segment override of the instruction being executed, otherwise ss
+    // for bp based addressing and ds for the rest
+    Register memory_segment(const MemoryOperand& mo) const;
     u16 get_ip() const { return ip; }
+    void set_ip(u16 value) { ip = value; }
+    u32 get_physical_ip() const { return physical_address(get(cs), ip); }
     const Flags& get_flags() const { return flags; }
+    void set_flags(const Flags& f) { flags = f; }
+    u64 get_cycle_count() const { return cycle_count; }
+    u64 get_instruction_count() const { return instruction_count; }
+    // Moves the clock, e.g. back to a checkpoint. Scheduled events aren't
+    // affected.
+    void set_counts(u64 instructions, u64 cycles) {
+        instruction_count = instructions;
+        cycle_count = cycles;
+    }
+    // In the order ax, cx, dx, bx, sp, bp, si, di, es, cs, ss, ds
+    const std::array<u16, 12>& get_registers() const { return registers; }
+    void set_registers(const std::array<u16, 12>& r) { registers = r; }
+    Scheduler& get_scheduler() { return scheduler; }
 
     template<typename T = u16>
     void set(Register reg, T value) {
@@ -132,9 +360,10 @@ public:
                 fmt::print(stderr, "Cannot modify an ip_inc value\n");
                 break;
             case Memory:
-                auto address = calculate_address(o.memory);
-                memory[address] = value & 0xff;
-                if (wide_memory) memory[address + 1] = (value & 0xff00) >> 8;
+                auto segment = get(memory_segment(o.memory));
+                auto offset = calculate_address(o.memory);
+                if (wide_memory) write_word(segment, offset, value);
+                else write_byte(physical_address(segment, offset), value & 0xff);
                 break;
         }
     }
@@ -148,7 +377,73 @@ public:
     }
 
     void print_state(FILE* out = stdout) const;
-    error_code run(bool estimate_cycles = false);
+    error_code run(bool estimate_cycles = false) { return run(RunOptions{ .estimate_cycles = estimate_cycles }); }
+    error_code run(const RunOptions& options) {
+        NoHooks hooks;
+        return run(hooks, options);
+    }
+    // Instrumentation of run(). A hooks policy is a class with any of these
+    // members, and run() only calls the ones it has, so a missing hook costs
+    // nothing and run() with NoHooks is the plain run loop:
+    //     void before_instruction(Intel8086& x86, const Instruction& instruction);
+    //     // At the end of a block that didn't continue after its last
+    //     // instruction, which is at the address. ip is at the target.
+    //     void branch_taken(Intel8086& x86, const Instruction& branch, u32 address);
+    //     void memory_read(u32 address, u8 value);
+    //     void memory_write(u32 address, u8 value);
+    //     // Before an interrupt is serviced through the vector table or on the host
+    //     void interrupt(Intel8086& x86, u8 number);
+    // Memory hooks send every access through the slow path of the memory
+    // access table and interrupt hooks are called where interrupts are
+    // entered, so they don't add to the run loop either. The memory accesses
+    // of host interrupt handlers are included. Instantiating run() with
+    // other policies needs emulator_run.hpp.
+    struct NoHooks {};
+    template<typename Hooks>
+    error_code run(Hooks& hooks, const RunOptions& options);
+    // Executes one instruction without delivering scheduled events
+    expected<ExecuteResult, error_code> step(bool estimate_cycles = false);
+    // Runs until the instruction at the physical address is about to be
+    // executed by temporarily placing the inserted halt instruction there
+    error_code run_to(u32 address, bool estimate_cycles = false);
+    // Makes run() return after the current block. It's only checked when
+    // scheduled events are delivered, so it has to be called from a scheduler
+    // callback.
+    void stop() { stop_requested = true; }
+    StopReason get_stop_reason() const { return stop_reason; }
+
+    // Breakpoints are placed into the memory as the inserted halt
+    // instruction while run() executes guest code, so the run loop finds them
+    // with the check it already does for every instruction. Pages with
+    // breakpoints take the slow path, where the guest reads and writes the
+    // original bytes. Host interrupt handlers and scheduler callbacks see the
+    // original memory too. A run that starts at a breakpoint executes its
+    // instruction. Breakpoints have to be at the first byte of an instruction
+    // and aren't checked by step().
+    void add_breakpoint(u32 address);
+    void remove_breakpoint(u32 address);
+    bool has_breakpoint(u32 address) const { return breakpoint_index(address) != breakpoints.size(); }
+    // Watched pages take the slow path for the watched accesses. An access
+    // to a watched range stops run() at the end of the block, or is reported
+    // after step().
+    void add_watchpoint(u32 address, u32 size, WatchAccess access);
+    // Removes the watchpoints that start at the address
+    void remove_watchpoint(u32 address);
+    // The first watched access since run() or step() started
+    const std::optional<WatchpointHit>& get_watchpoint_hit() const { return watchpoint_hit; }
+    void set_verbose(bool v) { verbose = v; }
+
+    // Records the execution into the trace, which has to outlive the
+    // emulator or be reset with nullptr. See TraceWriter::start().
+    void set_trace(TraceWriter* t) { trace = t; }
+
+    // Counts the edges between blocks into the map, which has to have a power
+    // of two size. An empty map disables the coverage collection.
+    void set_coverage_map(std::span<u8> map) {
+        assert(std::has_single_bit(map.size()) || map.empty());
+        coverage_map = map;
+        previous_location = 0;
+    }
 
 #ifdef TESTING
     void assert_registers(u16 a, i16 b, u8 c, i8 d, u8 e, i8 f, bool print) const;
@@ -157,18 +452,172 @@ public:
 
 
 private:
+#ifdef TESTING
+    static constexpr bool verbose_execution = false;
+#else
+    static constexpr bool verbose_execution = true;
+#endif
+    // Normally not used x86 op code
+    static constexpr u8 inserted_halt_instruction = 0xf;
+
     std::array<u16, 12> registers = {};
     u16 ip = 0;
     Flags flags = {};
+    std::optional<Register> segment_override;
+
+    std::vector<u8> owned_memory;
+    std::span<u8> memory;
+
+    // Bits of page_access that send an access to the slow path
+    static constexpr u8 slow_read = 1 << 0;
+    static constexpr u8 slow_write = 1 << 1;
+
+    struct Page {
+        MemoryDevice* device = nullptr;
+        bool read_only = false;
+        bool watched = false;
+    };
+    std::vector<Page> pages;
+    // Kept separate from pages so that the fast path only loads one byte per access
+    std::vector<u8> page_access;
+    // The table without the writes of traced host interrupt handlers, which
+    // is swapped back in after the handler
+    std::vector<u8> untraced_page_access;
+
+    // Clean pages are write protected, so only the first write to a page after
+    // a snapshot takes the slow path and sets its bit in dirty_pages
+    std::vector<u64> dirty_pages;
+    std::shared_ptr<const std::vector<u8>> dirty_baseline;
+    // Watched pages written since take_written_pages(), tracked the same way
+    std::vector<u64> written_pages;
+    // Pages copied to the undo log, tracked the same way
+    std::vector<u64> logged_pages;
+    UndoLog* undo_log = nullptr;
 
-    std::vector<u8> memory;
+    // Indexed directly by the port number, unmapped ports point to unmapped_ports
+    std::vector<PortDevice*> ports;
+    static inline UnmappedPorts unmapped_ports;
+
+    std::array<InterruptHandler*, 256> interrupt_handlers = {};
+
+    struct Breakpoint {
+        u32 address = 0;
+        // The byte under the inserted halt instruction while armed
+        u8 original = 0;
+    };
+    // Sorted by address
+    std::vector<Breakpoint> breakpoints;
+    bool breakpoints_armed = false;
+    struct Watchpoint {
+        u32 address = 0;
+        u32 size = 0;
+        WatchAccess access = WatchAccess::ReadWrite;
+    };
+    std::vector<Watchpoint> watchpoints;
+    // Set from the read path too, which is const
+    mutable std::optional<WatchpointHit> watchpoint_hit;
+    StopReason stop_reason = StopReason::Halt;
+
+    // What run() sets up from its options
+    struct RunState {
+        u64 first_instruction = 0;
+        u64 instruction_limit = UINT64_MAX;
+        // Stop addresses that aren't breakpoints too
+        std::vector<u32> added_breakpoints;
+        std::optional<Scheduler::EventId> cycle_budget;
+        bool out_of_cycles = false;
+    };
+
+    // The hooks of the running policy that are called outside of the run loop
+    struct HookCallbacks {
+        void* hooks = nullptr;
+        void (*memory_read)(void* hooks, u32 address, u8 value) = nullptr;
+        void (*memory_write)(void* hooks, u32 address, u8 value) = nullptr;
+        void (*interrupt)(void* hooks, Intel8086& x86, u8 number) = nullptr;
+    };
+    HookCallbacks hook_callbacks;
+
+    // Emulated clock, advanced by the estimated cycles of every executed instruction
+    u64 cycle_count = 0;
+    u64 instruction_count = 0;
+    Scheduler scheduler;
+    bool stop_requested = false;
+    bool verbose = true;
+
+    std::span<u8> coverage_map;
+    u16 previous_location = 0;
+
+    TraceWriter* trace = nullptr;
+    // Set while a host interrupt handler runs with tracing on. Every page is
+    // write protected then, so the writes of the handler can be recorded.
+    bool tracing_host_writes = false;
+
+    void begin_run(const RunOptions& options, RunState& state);
+    void end_run(RunState& state);
+    // At the inserted halt instruction, which may be a breakpoint. Returns
+    // false if the run stops there, otherwise decodes the instruction under
+    // the breakpoint.
+    bool decode_at_breakpoint(u32 address, const RunOptions& options, const RunState& state, std::optional<Instruction>& instruction);
+    void set_hook_callbacks(const HookCallbacks& callbacks);
+    template<typename Hooks>
+    static HookCallbacks make_hook_callbacks(Hooks& hooks);
+    // The run loop of run(), with a copy for traced runs
+    template<bool traced, typename Hooks>
+    error_code run_blocks(Hooks& hooks, const RunOptions& options);
+
+    ExecuteResult execute(const Instruction& i, bool estimate_cycles, u32& cycles);
+    template<typename T>
+    void execute_alu(Instruction::Type type, const Operand& destination, u16 source);
+    template<typename T>
+    void execute_multiply(bool is_signed, const Operand& source);
+    // Returns false on a divide error
+    template<typename T>
+    [[nodiscard]] bool execute_divide(bool is_signed, const Operand& source);
+    template<typename T>
+    void execute_shift(Instruction::Type type, const Operand& destination, u32 count);
+    void jump(const Instruction& i, bool call);
+    void interrupt(u8 number);
+    ExecuteResult software_interrupt(u8 number);
+    void set_adjust_flags(u8 adjust_flags, bool result_flags);
+    u8 read_byte_slow(u32 address) const;
+    void write_byte_slow(u32 address, u8 value);
+    void update_page_access(u32 page);
+    // Returns breakpoints.size() if there's no breakpoint at the address
+    size_t breakpoint_index(u32 address) const {
+        auto it = std::lower_bound(breakpoints.begin(), breakpoints.end(), address,
+                                   [](const Breakpoint& b, u32 a) { return b.address < a; });
+        return it != breakpoints.end() && it->address == address ? it - breakpoints.begin() : breakpoints.size();
+    }
+    bool has_breakpoint_on_page(u32 page) const;
+    // Places the inserted halt instructions at the breakpoints or restores
+    // the original bytes
+    void arm_breakpoints(bool arm);
+    bool is_watched(u32 page, WatchAccess access) const;
+    void check_watchpoints(u32 address, u8 value, WatchAccess access) const;
+    ExecuteResult traced_software_interrupt(InterruptHandler& handler, u8 number);
+    bool is_dirty(u32 page) const { return dirty_pages[page / 64] & (u64(1) << (page % 64)); }
+    void mark_dirty(u32 page);
+    bool is_written(u32 page) const { return written_pages[page / 64] & (u64(1) << (page % 64)); }
+    void mark_written(u32 page);
+    bool is_logged(u32 page) const { return logged_pages[page / 64] & (u64(1) << (page % 64)); }
+    // Copies the pages that aren't in the undo log yet to it
+    void log_pages(u32 first, u32 last) {
+        if (!undo_log) [[likely]] return;
+        for (u32 page = first; page <= last; ++page) {
+            if (!is_logged(page)) log_page(page);
+        }
+    }
+    void log_page(u32 page);
+    // Records a page whose memory was changed directly
+    void mark_changed(u32 page);
+    void track_dirty_pages(std::shared_ptr<const std::vector<u8>> baseline);
 
-    bool execute(const Instruction& i, bool estimate_cycles, u32& cycles);
-    void set_flags(u16 a, u16 b, u16 result, u32 wide_result, bool is_sub);
     void push(u16 value, bool wide = true);
     u16 pop(bool wide = true);
 };
 
+extern template error_code Intel8086::run(Intel8086::NoHooks& hooks, const Intel8086::RunOptions& options);
+
 template <> struct fmt::formatter<Intel8086::Flags> {
     constexpr format_parse_context::iterator parse(format_parse_context& ctx) {
         return ctx.begin();
@@ -176,15 +625,15 @@ template <> struct fmt::formatter<Intel8086::Flags> {
 
     format_context::iterator format(const Intel8086::Flags& f, format_context& ctx) {
         auto out = ctx.out();
-        if (f.c) format_to(out, "C");
-        if (f.p) format_to(out, "P");
-        if (f.a) format_to(out, "A");
-        if (f.z) format_to(out, "Z");
-        if (f.s) format_to(out, "S");
-        if (f.o) format_to(out, "O");
-        if (f.i) format_to(out, "I");
-        if (f.d) format_to(out, "D");
-        if (f.t) format_to(out, "T");
+        if (f.c()) format_to(out, "C");
+        if (f.p()) format_to(out, "P");
+        if (f.a()) format_to(out, "A");
+        if (f.z()) format_to(out, "Z");
+        if (f.s()) format_to(out, "S");
+        if (f.o()) format_to(out, "O");
+        if (f.i()) format_to(out, "I");
+        if (f.d()) format_to(out, "D");
+        if (f.t()) format_to(out, "T");
         return out;
     }
 };
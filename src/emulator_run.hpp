@@ -0,0 +1,147 @@
+#pragma once
+
+#include "common.hpp"
+#include <optional>
+
+#include "emulator.hpp"
+#include "instruction.hpp"
+#include "trace.hpp"
+
+// The run loop of Intel8086, for instantiating it with hooks policies. The
+// one without hooks is instantiated in emulator.cpp.
+
+template<typename Hooks>
+Intel8086::HookCallbacks Intel8086::make_hook_callbacks(Hooks& hooks) {
+    HookCallbacks callbacks = { &hooks };
+    if constexpr (requires(Hooks& h) { h.memory_read(u32(), u8()); }) {
+        callbacks.memory_read = [](void* h, u32 address, u8 value) { static_cast<Hooks*>(h)->memory_read(address, value); };
+    }
+    if constexpr (requires(Hooks& h) { h.memory_write(u32(), u8()); }) {
+        callbacks.memory_write = [](void* h, u32 address, u8 value) { static_cast<Hooks*>(h)->memory_write(address, value); };
+    }
+    if constexpr (requires(Hooks& h, Intel8086& x86) { h.interrupt(x86, u8()); }) {
+        callbacks.interrupt = [](void* h, Intel8086& x86, u8 number) { static_cast<Hooks*>(h)->interrupt(x86, number); };
+    }
+    return callbacks;
+}
+
+template<typename Hooks>
+error_code Intel8086::run(Hooks& hooks, const RunOptions& options) {
+    // Host interrupt handlers record the instruction count with their writes
+    // to a trace, so traced runs keep it current within blocks. The loop is
+    // chosen once per run, so untraced ones don't test for it.
+    if (trace) return run_blocks<true>(hooks, options);
+    return run_blocks<false>(hooks, options);
+}
+
+template<bool traced, typename Hooks>
+error_code Intel8086::run_blocks(Hooks& hooks, const RunOptions& options) {
+    constexpr bool instruction_hook = requires(Hooks& h, Intel8086& x86, const Instruction& i) { h.before_instruction(x86, i); };
+    constexpr bool branch_hook = requires(Hooks& h, Intel8086& x86, const Instruction& i) { h.branch_taken(x86, i, u32()); };
+    constexpr bool other_hooks = requires(Hooks& h) { h.memory_read(u32(), u8()); }
+                              || requires(Hooks& h) { h.memory_write(u32(), u8()); }
+                              || requires(Hooks& h, Intel8086& x86) { h.interrupt(x86, u8()); };
+
+    DEFER { if (verbose_execution && verbose) print_state(); };
+    auto estimate_cycles = options.estimate_cycles;
+
+    u32 cycles = 0;
+    // Instructions executed since the start of the block, and the last one,
+    // are recorded with every block of a trace
+    u64 block_start = instruction_count;
+    std::optional<Instruction> instruction;
+    DEFER { if (trace) trace->stop(static_cast<u32>(instruction_count - block_start)); };
+    // The instructions of a block are counted in a local and added to
+    // instruction_count at the end of the block, where the budgets and the
+    // trace read it. Only hooks, traced host interrupt handlers and
+    // breakpoints look at it within a block, so it's kept current for them.
+    u32 block_instructions = 0;
+    constexpr bool exact_count = instruction_hook || other_hooks || traced;
+    auto sync_instruction_count = [&] { instruction_count = block_start + block_instructions; };
+    DEFER { sync_instruction_count(); };
+
+    RunState state;
+    begin_run(options, state);
+    DEFER { end_run(state); };
+
+    if constexpr (other_hooks) set_hook_callbacks(make_hook_callbacks(hooks));
+    DEFER { if constexpr (other_hooks) set_hook_callbacks({}); };
+
+    while (true) {
+        // Execute one block, i.e. instructions up to and including the next
+        // control transfer. The scheduler is only consulted between blocks.
+        auto result = ExecuteResult::Continue;
+        block_start = instruction_count;
+        block_instructions = 0;
+        u32 address = 0;
+        while (result == ExecuteResult::Continue) {
+            address = get_physical_ip();
+            if (memory[address] == inserted_halt_instruction) {
+                sync_instruction_count();
+                if (!decode_at_breakpoint(address, options, state, instruction)) return {};
+            } else {
+                instruction = Instruction::decode_at({ memory.data(), (u32)memory.size() }, address);
+            }
+            if (!instruction) {
+                fflush(stdout);
+                fmt::print(stderr, "Unknown instruction at location {:04x}:{:04x} (first byte {:#x})\n", get(Register::cs), ip, memory[address]);
+                return Errc::UnknownInstruction;
+            }
+
+            if constexpr (exact_count) sync_instruction_count();
+            if constexpr (instruction_hook) hooks.before_instruction(*this, *instruction);
+            result = execute(*instruction, estimate_cycles, cycles);
+            ++block_instructions;
+        }
+        sync_instruction_count();
+        if (result == ExecuteResult::Halt) break;
+
+        if constexpr (branch_hook) {
+            if (get_physical_ip() != ((address + instruction->size) & (memory_size - 1))) {
+                hooks.branch_taken(*this, *instruction, address);
+            }
+        }
+
+        if (trace) {
+            trace->block(static_cast<u32>(instruction_count - block_start), *instruction, *this);
+            block_start = instruction_count;
+            block_instructions = 0;
+        }
+
+        if (!coverage_map.empty()) {
+            // The physical address, so that the same offset in different
+            // segments is a different location
+            u32 physical_ip = get_physical_ip();
+            u16 location = static_cast<u16>((physical_ip >> 4) ^ (physical_ip << 8));
+            auto& hits = coverage_map[(location ^ previous_location) & (coverage_map.size() - 1)];
+            hits += hits != 0xff;
+            previous_location = location >> 1;
+        }
+
+        if (watchpoint_hit) [[unlikely]] {
+            stop_reason = StopReason::Watchpoint;
+            break;
+        }
+        if (instruction_count >= state.instruction_limit) [[unlikely]] {
+            stop_reason = StopReason::InstructionLimit;
+            break;
+        }
+        if (options.cancel && options.cancel->load(std::memory_order_relaxed)) [[unlikely]] {
+            stop_reason = StopReason::Cancelled;
+            break;
+        }
+
+        if (cycle_count >= scheduler.next_event_cycle()) {
+            arm_breakpoints(false);
+            scheduler.run_due(cycle_count);
+            arm_breakpoints(true);
+            if (stop_requested) {
+                stop_requested = false;
+                stop_reason = state.out_of_cycles ? StopReason::CycleLimit : StopReason::Stopped;
+                break;
+            }
+        }
+    }
+
+    return {};
+}
@@ -0,0 +1,313 @@
+#include "framebuffer.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fmt/core.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static constexpr u16 dac_write_index_port = 0x3c8;
+static constexpr u16 dac_data_port = 0x3c9;
+
+static constexpr u32 cga_bank_size = 0x2000;
+static constexpr u32 cga_bytes_per_line = 80;
+
+// Palette entries hold the bytes of a pixel in memory order
+static constexpr u32 rgb_color(u8 red, u8 green, u8 blue) {
+    return red | (green << 8) | (blue << 16);
+}
+
+static constexpr u32 hex_color(u32 rrggbb) {
+    return rgb_color(rrggbb >> 16, (rrggbb >> 8) & 0xff, rrggbb & 0xff);
+}
+
+// Drops the fourth byte of every pixel. Pixels are converted in groups of
+// four, as long as there's room for the whole 16 byte store in dst.
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static u32 convert_rgba_ssse3(const u8* src, u8* dst, u32 pixels) {
+    const auto shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    u32 i = 0;
+    for (; i + 6 <= pixels; i += 4) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+    return i;
+}
+
+static u32 convert_rgba_simd(const u8* src, u8* dst, u32 pixels) {
+    static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    return has_ssse3 ? convert_rgba_ssse3(src, dst, pixels) : 0;
+}
+#elif defined(__ARM_NEON)
+static u32 convert_rgba_simd(const u8* src, u8* dst, u32 pixels) {
+    u32 i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        auto v = vld4q_u8(src + i * 4);
+        vst3q_u8(dst + i * 3, { { v.val[0], v.val[1], v.val[2] } });
+    }
+    return i;
+}
+#else
+static u32 convert_rgba_simd(const u8*, u8*, u32) {
+    return 0;
+}
+#endif
+
+static void convert_rgba(const u8* src, u8* dst, u32 pixels) {
+    for (u32 i = convert_rgba_simd(src, dst, pixels); i < pixels; ++i) {
+        memcpy(dst + i * 3, src + i * 4, 3);
+    }
+}
+
+Framebuffer::Framebuffer(Intel8086& x86, Mode mode) : x86(x86), mode(mode) {
+    switch (mode.format) {
+        using enum Format;
+        case Indexed8:
+            region_size = mode.width * mode.height;
+            break;
+        case Rgba32:
+            region_size = mode.width * mode.height * 4;
+            break;
+        case Cga2:
+            assert(mode.width == 320 && mode.height == 200);
+            region_size = 2 * cga_bank_size;
+            break;
+    }
+    assert(mode.address + region_size <= Intel8086::memory_size);
+    assert(mode.format != Format::Rgba32 || mode.address % 4 == 0);
+    rgb.resize(mode.width * mode.height * 3);
+
+    // The 16 CGA colors, a gray ramp and a 6x6x6 color cube
+    constexpr std::array<u32, 16> cga_colors = {
+        0x000000, 0x0000aa, 0x00aa00, 0x00aaaa, 0xaa0000, 0xaa00aa, 0xaa5500, 0xaaaaaa,
+        0x555555, 0x5555ff, 0x55ff55, 0x55ffff, 0xff5555, 0xff55ff, 0xffff55, 0xffffff,
+    };
+    for (u32 i = 0; i < cga_colors.size(); ++i) palette[i] = hex_color(cga_colors[i]);
+    for (u32 i = 0; i < 16; ++i) palette[16 + i] = rgb_color(i * 17, i * 17, i * 17);
+    for (u32 i = 0; i < 216; ++i) palette[32 + i] = rgb_color((i % 6) * 51, (i / 6 % 6) * 51, (i / 36) * 51);
+    if (mode.format == Format::Cga2) {
+        // Palette 1 of mode 4: black, cyan, magenta and light gray
+        palette[1] = hex_color(cga_colors[3]);
+        palette[2] = hex_color(cga_colors[5]);
+        palette[3] = hex_color(cga_colors[7]);
+        update_cga_byte_pixels();
+    }
+
+    auto first_page = mode.address / Intel8086::page_size;
+    auto end_page = (mode.address + region_size + Intel8086::page_size - 1) / Intel8086::page_size;
+    x86.watch_writes(first_page * Intel8086::page_size, (end_page - first_page) * Intel8086::page_size);
+}
+
+void Framebuffer::map_ports(Intel8086& x86) {
+    x86.map_ports(dac_write_index_port, dac_data_port, *this);
+}
+
+bool Framebuffer::update() {
+    if (full_update) {
+        full_update = false;
+        x86.take_written_pages([](u32) {});
+        convert(0, region_size);
+        return true;
+    }
+
+    bool written = false;
+    x86.take_written_pages([&](u32 page) {
+        u32 start = std::max(page * Intel8086::page_size, mode.address);
+        u32 end = std::min((page + 1) * Intel8086::page_size, mode.address + region_size);
+        if (start >= end) return;
+        convert(start - mode.address, end - start);
+        written = true;
+    });
+    return written;
+}
+
+void Framebuffer::convert(u32 offset, u32 size) {
+    std::array<u8, Intel8086::page_size + 4> bytes;
+    for (u32 done = 0; done < size;) {
+        u32 chunk = std::min(size - done, Intel8086::page_size);
+        x86.read_image(mode.address + offset + done, { bytes.data(), chunk });
+        u32 start = offset + done;
+        done += chunk;
+
+        switch (mode.format) {
+            using enum Format;
+            case Indexed8:
+                for (u32 i = 0; i < chunk; ++i) {
+                    u32 color = palette[bytes[i]];
+                    memcpy(rgb.data() + (start + i) * 3, &color, 3);
+                }
+                break;
+            case Rgba32:
+                // Pages hold whole pixels, as long as the framebuffer address
+                // is a multiple of 4
+                convert_rgba(bytes.data(), rgb.data() + start / 4 * 3, chunk / 4);
+                break;
+            case Cga2:
+                for (u32 i = 0; i < chunk; ++i) {
+                    u32 bank = (start + i) / cga_bank_size;
+                    u32 bank_offset = (start + i) % cga_bank_size;
+                    u32 line = bank_offset / cga_bytes_per_line;
+                    if (line * 2 >= mode.height) continue;
+                    u32 y = line * 2 + bank;
+                    u32 x = bank_offset % cga_bytes_per_line * 4;
+                    memcpy(rgb.data() + (y * mode.width + x) * 3, cga_byte_pixels[bytes[i]].data(), 12);
+                }
+                break;
+        }
+    }
+}
+
+void Framebuffer::update_cga_byte_pixels() {
+    for (u32 value = 0; value < cga_byte_pixels.size(); ++value) {
+        for (u32 pixel = 0; pixel < 4; ++pixel) {
+            u32 color = palette[(value >> (6 - pixel * 2)) & 0b11];
+            memcpy(cga_byte_pixels[value].data() + pixel * 3, &color, 3);
+        }
+    }
+}
+
+void Framebuffer::set_palette_color(u8 index, u8 red, u8 green, u8 blue) {
+    palette[index] = rgb_color(red, green, blue);
+    if (mode.format == Format::Cga2) update_cga_byte_pixels();
+    full_update = true;
+}
+
+u16 Framebuffer::in(u16 port, bool wide) {
+    u16 value = port == dac_write_index_port ? dac_write_index : 0;
+    return wide ? value | (in(port + 1, false) << 8) : value;
+}
+
+void Framebuffer::out(u16 port, u16 value, bool wide) {
+    if (wide) {
+        out(port, value & 0xff, false);
+        out(port + 1, value >> 8, false);
+        return;
+    }
+
+    if (port == dac_write_index_port) {
+        dac_write_index = value & 0xff;
+        dac_component = 0;
+    } else if (port == dac_data_port) {
+        // The DAC has 6 bits per component
+        dac_color[dac_component++] = value & 0x3f;
+        if (dac_component == dac_color.size()) {
+            auto expand = [](u8 c) { return static_cast<u8>((c << 2) | (c >> 4)); };
+            set_palette_color(dac_write_index++, expand(dac_color[0]), expand(dac_color[1]), expand(dac_color[2]));
+            dac_component = 0;
+        }
+    }
+}
+
+// The palette followed by the DAC registers
+std::vector<u8> Framebuffer::save_state() const {
+    std::vector<u8> state(sizeof(palette) + 2 + dac_color.size());
+    memcpy(state.data(), palette.data(), sizeof(palette));
+    state[sizeof(palette)] = dac_write_index;
+    state[sizeof(palette) + 1] = dac_component;
+    std::copy(dac_color.begin(), dac_color.end(), state.begin() + sizeof(palette) + 2);
+    return state;
+}
+
+error_code Framebuffer::load_state(std::span<const u8> state) {
+    if (state.size() != sizeof(palette) + 2 + dac_color.size() || state[sizeof(palette) + 1] >= dac_color.size()) {
+        return Errc::InvalidCheckpoint;
+    }
+    memcpy(palette.data(), state.data(), sizeof(palette));
+    dac_write_index = state[sizeof(palette)];
+    dac_component = state[sizeof(palette) + 1];
+    std::copy_n(state.begin() + sizeof(palette) + 2, dac_color.size(), dac_color.begin());
+    update_cga_byte_pixels();
+    full_update = true;
+    return {};
+}
+
+static constexpr std::array<u32, 256> crc_table = [] {
+    std::array<u32, 256> table = {};
+    for (u32 i = 0; i < table.size(); ++i) {
+        u32 c = i;
+        for (u32 k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    return table;
+}();
+
+static void append_u32_be(std::vector<u8>& out, u32 value) {
+    for (i32 shift = 24; shift >= 0; shift -= 8) out.push_back((value >> shift) & 0xff);
+}
+
+static void append_png_chunk(std::vector<u8>& out, const char* type, std::span<const u8> data) {
+    append_u32_be(out, static_cast<u32>(data.size()));
+    auto start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+
+    u32 crc = 0xffffffff;
+    for (auto i = start; i < out.size(); ++i) crc = crc_table[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+    append_u32_be(out, crc ^ 0xffffffff);
+}
+
+// The image data is stored uncompressed in the zlib stream, which keeps
+// encoding a frame as cheap as copying it
+static std::vector<u8> encode_png(std::span<const u8> rgb, u32 width, u32 height) {
+    std::vector<u8> rows;
+    rows.reserve((width * 3 + 1) * height);
+    for (u32 y = 0; y < height; ++y) {
+        rows.push_back(0);
+        auto row = rgb.subspan(y * width * 3, width * 3);
+        rows.insert(rows.end(), row.begin(), row.end());
+    }
+
+    std::vector<u8> zlib = { 0x78, 0x01 };
+    constexpr size_t max_block_size = 0xffff;
+    for (size_t i = 0; i < rows.size() || i == 0; i += max_block_size) {
+        auto size = std::min(rows.size() - i, max_block_size);
+        bool last = i + size >= rows.size();
+        zlib.push_back(last);
+        zlib.push_back(size & 0xff);
+        zlib.push_back(size >> 8);
+        zlib.push_back(~size & 0xff);
+        zlib.push_back((~size >> 8) & 0xff);
+        zlib.insert(zlib.end(), rows.begin() + i, rows.begin() + i + size);
+    }
+    u32 a = 1;
+    u32 b = 0;
+    for (auto byte : rows) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    append_u32_be(zlib, (b << 16) | a);
+
+    std::vector<u8> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    std::vector<u8> header;
+    append_u32_be(header, width);
+    append_u32_be(header, height);
+    // 8 bits per component, RGB, no interlacing
+    header.insert(header.end(), { 8, 2, 0, 0, 0 });
+    append_png_chunk(png, "IHDR", header);
+    append_png_chunk(png, "IDAT", zlib);
+    append_png_chunk(png, "IEND", {});
+    return png;
+}
+
+error_code Framebuffer::write_image(const char* filename, ImageFormat format) const {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_error_code_errno();
+    }
+    DEFER { fclose(file); };
+
+    if (format == ImageFormat::Png) {
+        auto png = encode_png(rgb, mode.width, mode.height);
+        if (fwrite(png.data(), 1, png.size(), file) != png.size()) return make_error_code_errno();
+        return {};
+    }
+
+    fmt::print(file, "P6\n{} {}\n255\n", mode.width, mode.height);
+    if (fwrite(rgb.data(), 1, rgb.size(), file) != rgb.size()) return make_error_code_errno();
+    return {};
+}
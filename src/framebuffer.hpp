@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common.hpp"
+#include <vector>
+
+#include "device.hpp"
+#include "emulator.hpp"
+
+// Converts a video memory region of the guest to RGB frames. The region is
+// watched for writes, so a frame only converts the pages written since the
+// previous one. The VGA DAC ports 3c8h and 3c9h set the palette of the
+// indexed modes. The palette is saved in checkpoints.
+class Framebuffer final : public PortDevice, public DeviceState {
+public:
+    enum class Format {
+        // One palette index per pixel, e.g. VGA mode 13h
+        Indexed8,
+        // Red, green, blue and an unused byte per pixel
+        Rgba32,
+        // CGA 320x200 with four colors: two bits per pixel and the odd lines
+        // in a second bank 2000h bytes after the first
+        Cga2,
+    };
+
+    struct Mode {
+        Format format = Format::Rgba32;
+        u32 address = 0;
+        u32 width = 0;
+        u32 height = 0;
+    };
+
+    // The 64x64 image the computer_enhance listings draw to offset 256
+    static constexpr Mode computer_enhance_mode = { Format::Rgba32, 256, 64, 64 };
+    static constexpr Mode vga_mode_13h = { Format::Indexed8, 0xa0000, 320, 200 };
+    static constexpr Mode cga_mode_4 = { Format::Cga2, 0xb8000, 320, 200 };
+
+    enum class ImageFormat {
+        Ppm,
+        Png,
+    };
+
+    Framebuffer(Intel8086& x86, Mode mode);
+
+    // Maps the VGA DAC ports to this framebuffer
+    void map_ports(Intel8086& x86);
+
+    // Converts the pages written since the previous update. Returns false if
+    // nothing was written, so the frame is the same as the previous one.
+    bool update();
+
+    u32 get_width() const { return mode.width; }
+    u32 get_height() const { return mode.height; }
+    // Three bytes per pixel, rows from top to bottom
+    std::span<const u8> get_rgb() const { return rgb; }
+
+    error_code write_image(const char* filename, ImageFormat format) const;
+
+    u16 in(u16 port, bool wide) override;
+    void out(u16 port, u16 value, bool wide) override;
+
+    u32 state_id() const override { return 0x46425546; } // "FBUF"
+    std::vector<u8> save_state() const override;
+    error_code load_state(std::span<const u8> state) override;
+
+private:
+    Intel8086& x86;
+    Mode mode;
+    u32 region_size;
+    std::vector<u8> rgb;
+    // Colors as red, green, blue and a zero byte
+    std::array<u32, 256> palette = {};
+    // Four CGA pixels of each byte value, converted with the palette
+    std::array<std::array<u8, 12>, 256> cga_byte_pixels = {};
+    // Set when every pixel has to be converted again, e.g. after a palette change
+    bool full_update = true;
+
+    u8 dac_write_index = 0;
+    u8 dac_component = 0;
+    std::array<u8, 3> dac_color = {};
+
+    void convert(u32 offset, u32 size);
+    void update_cga_byte_pixels();
+    void set_palette_color(u8 index, u8 red, u8 green, u8 blue);
+};
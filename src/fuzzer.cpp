@@ -0,0 +1,135 @@
+#include "fuzzer.hpp"
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <fmt/core.h>
+
+static constexpr u32 coverage_map_size = 1 << 16;
+
+// Hit counts are compared in buckets, so that only changes in the magnitude
+// of a loop count are considered new coverage
+static constexpr std::array<u8, 256> hit_count_buckets = [] {
+    std::array<u8, 256> buckets = {};
+    for (u32 i = 1; i < buckets.size(); ++i) {
+        if (i <= 3) buckets[i] = 1 << (i - 1);
+        else if (i <= 7) buckets[i] = 1 << 3;
+        else if (i <= 15) buckets[i] = 1 << 4;
+        else if (i <= 31) buckets[i] = 1 << 5;
+        else if (i <= 127) buckets[i] = 1 << 6;
+        else buckets[i] = 1 << 7;
+    }
+    return buckets;
+}();
+
+static constexpr std::array<u8, 6> interesting_bytes = { 0, 1, 0x7f, 0x80, 0xfe, 0xff };
+
+static void mutate(std::vector<u8>& input, std::mt19937_64& rng) {
+    auto random = [&](u64 n) { return static_cast<u32>(rng() % n); };
+
+    auto count = 1 + random(8);
+    for (u32 i = 0; i < count; ++i) {
+        auto& byte = input[random(input.size())];
+        switch (random(5)) {
+            case 0:
+                byte ^= 1 << random(8);
+                break;
+            case 1:
+                byte = static_cast<u8>(rng());
+                break;
+            case 2:
+                byte += 1 + random(16);
+                break;
+            case 3:
+                byte -= 1 + random(16);
+                break;
+            case 4:
+                byte = interesting_bytes[random(interesting_bytes.size())];
+                break;
+        }
+    }
+}
+
+static void print_statistics(FILE* out, const FuzzResult& result, double seconds) {
+    fmt::print(out, "executions: {}, exec/s: {:.0f}, edges: {}, corpus: {}, crashes: {}, timeouts: {}\n",
+        result.executions, seconds > 0 ? result.executions / seconds : 0.0, result.covered_edges,
+        result.corpus.size(), result.crashes.size(), result.timeouts);
+}
+
+expected<FuzzResult, error_code> fuzz_program(Intel8086& x86, const FuzzOptions& options, FILE* out) {
+    if (options.input_size == 0 || options.input_address + options.input_size > Intel8086::memory_size
+        || options.entry_address >= Intel8086::memory_size) {
+        fmt::print(stderr, "Invalid fuzzing input region {:#07x}+{}\n", options.input_address, options.input_size);
+        return make_unexpected(std::errc::invalid_argument);
+    }
+
+    x86.set_verbose(false);
+    if (auto e = x86.run_to(options.entry_address)) return unexpected(e);
+    auto snapshot = x86.snapshot();
+
+    FuzzResult result;
+    std::mt19937_64 rng(options.seed);
+
+    std::vector<u8> coverage(coverage_map_size);
+    std::vector<u8> seen_buckets(coverage_map_size);
+    x86.set_coverage_map(coverage);
+
+    std::vector<u8> initial_input(options.input_size);
+    for (u32 i = 0; i < options.input_size; ++i) initial_input[i] = x86.read_byte(options.input_address + i);
+    result.corpus.push_back(std::move(initial_input));
+
+    auto start = std::chrono::steady_clock::now();
+    auto seconds_since_start = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    std::vector<u8> input;
+    for (u64 iteration = 0; iteration < options.iterations; ++iteration) {
+        // The first iteration runs the unmodified input
+        input = result.corpus[rng() % result.corpus.size()];
+        if (iteration > 0) mutate(input, rng);
+        for (u32 i = 0; i < input.size(); ++i) x86.write_byte(options.input_address + i, input[i]);
+
+        x86.set_coverage_map(coverage);
+
+        auto e = x86.run({ .max_cycles = options.max_cycles });
+
+        ++result.executions;
+        if (x86.get_stop_reason() == Intel8086::StopReason::CycleLimit) ++result.timeouts;
+        // Instructions the emulator can't execute halt the run instead of
+        // failing it, but they're as much of a dead end for the input
+        bool crashed = e || x86.get_stop_reason() == Intel8086::StopReason::Unimplemented;
+        if (crashed) result.crashes.push_back(input);
+
+        // Only a few edges are hit per run, so untouched words are skipped and
+        // the touched ones are cleared for the next run while going through them
+        bool new_coverage = false;
+        for (u32 word = 0; word < coverage_map_size; word += sizeof(u64)) {
+            u64 hits = 0;
+            memcpy(&hits, coverage.data() + word, sizeof(hits));
+            if (!hits) continue;
+
+            for (u32 i = word; i < word + sizeof(u64); ++i) {
+                auto bucket = hit_count_buckets[coverage[i]];
+                if (bucket & ~seen_buckets[i]) {
+                    if (!seen_buckets[i]) ++result.covered_edges;
+                    seen_buckets[i] |= bucket;
+                    new_coverage = true;
+                }
+            }
+            memset(coverage.data() + word, 0, sizeof(u64));
+        }
+        if (new_coverage && !crashed) result.corpus.push_back(input);
+
+        x86.restore(snapshot);
+
+        if (out && std::has_single_bit(result.executions) && result.executions >= 1024) {
+            print_statistics(out, result, seconds_since_start());
+        }
+    }
+
+    x86.set_coverage_map({});
+    if (out) print_statistics(out, result, seconds_since_start());
+
+    return result;
+}
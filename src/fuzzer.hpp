@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.hpp"
+#include <cstdio>
+#include <vector>
+
+#include "emulator.hpp"
+
+struct FuzzOptions {
+    // Physical addresses, so that programs loaded at any segment can be fuzzed
+    u32 entry_address = 0;
+    u32 input_address = 0;
+    u16 input_size = 0;
+    u64 max_cycles = 1'000'000;
+    u64 iterations = 100'000;
+    u64 seed = 0;
+};
+
+struct FuzzResult {
+    u64 executions = 0;
+    u64 timeouts = 0;
+    u32 covered_edges = 0;
+    std::vector<std::vector<u8>> corpus;
+    std::vector<std::vector<u8>> crashes;
+};
+
+// Runs the loaded program to options.entry_address once and snapshots it there.
+// Every iteration writes a mutated input to the input region, runs until a
+// halt or until the cycle budget runs out, collects the edge coverage and
+// restores the snapshot. Inputs reaching new edges are kept in the corpus and
+// inputs making the emulation fail or reach an unimplemented instruction are
+// collected as crashes.
+expected<FuzzResult, error_code> fuzz_program(Intel8086& x86, const FuzzOptions& options, FILE* out = nullptr);
@@ -124,8 +124,9 @@ static void decode_rm_register(std::span<const u8> program, u32 start, Instructi
     switch (mod) {
         case 0:
             if (is_direct_access) {
-                i.operands[0] = looked_reg;
-                i.operands[1] = MemoryOperand{EffectiveAddressCalculation::DirectAccess, displacement};
+                i.operands[0] = MemoryOperand{EffectiveAddressCalculation::DirectAccess, displacement};
+                i.operands[1] = looked_reg;
+                // xchg lists a direct address first
                 if (type == Xchg) i.swap_operands();
             } else {
                 i.operands[0] = MemoryOperand{eac};
@@ -150,7 +151,7 @@ static void decode_rm_register(std::span<const u8> program, u32 start, Instructi
             break;
     }
 
-    if (!is_direct_access && d) i.swap_operands();
+    if (d) i.swap_operands();
 }
 
 static void decode_immediate_to_rm(std::span<const u8> program, u32 start, Instruction& i, bool is_mov) {
@@ -209,9 +210,9 @@ static void decode_mov_memory_accumulator(std::span<const u8> program, u32 start
     bool to_accumulator = ~a & 0b10;
     bool w = a & 1;
     i16 address = 0;
-    if (read_data(program, start + 1, w + 1, true, address)) return;
+    if (read_data(program, start + 1, true, address)) return;
 
-    i.size = w ? 3 : 2;
+    i.size = 3;
     i.type = Mov;
     i.flags.wide = w;
 
@@ -405,10 +406,11 @@ static void decode_aam_aad(std::span<const u8> program, u32 start, Instruction&
 
     u8 a = program[start];
     u8 b = program[start + 1];
-    if (b != 0b0000'1010) return;
 
     i.size = 2;
     i.type = a & 1 ? Aad : Aam;
+    // The base is implicit in the mnemonic when it's the usual 10
+    if (b != 10) i.operands[0] = static_cast<u16>(b);
 }
 
 static void decode_string_instruction(std::span<const u8> program, u32 start, Instruction& i) {
@@ -713,7 +715,7 @@ u32 Instruction::estimate_cycles(u32 total, FILE* out) const {
     }
     if (cycles == 0 && !memory_operand) {
 #ifndef NDEBUG
-        fmt::print(stderr, "cycle_estimate: unimplemented instruction {}\n", name());
+        if (out) fmt::print(stderr, "cycle_estimate: unimplemented instruction {}\n", name());
 #endif
         return 0;
     }
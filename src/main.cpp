@@ -2,10 +2,22 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <sched.h>
+#include <strings.h>
+#include <unistd.h>
 #include <fmt/core.h>
 
 #include "program.hpp"
 #include "emulator.hpp"
+#include "fuzzer.hpp"
+#include "dos_services.hpp"
+#include "disk.hpp"
+#include "framebuffer.hpp"
+#include "memory_dump.hpp"
+#include "shared_state.hpp"
+#include "trace.hpp"
+#include "checkpoint_file.hpp"
+#include "profiler.hpp"
 
 static int print_instructions_for_help(const char* name) {
     fmt::print(stderr, "{0}: type '{0} --help ' for help.\n", name);
@@ -17,10 +29,33 @@ static int print_requires_parameter(const char* name, const char* option) {
     return print_instructions_for_help(name);
 }
 
+static bool has_extension(const std::string& filename, const char* extension) {
+    auto length = strlen(extension);
+    return filename.size() >= length && strcasecmp(filename.data() + filename.size() - length, extension) == 0;
+}
+
+static bool parse_number(const char* s, u64 max, u64& result) {
+    char* end = nullptr;
+    errno = 0;
+    auto value = strtoull(s, &end, 0);
+    if (errno || end == s || *end != '\0' || value > max) return false;
+    result = value;
+    return true;
+}
+
+enum class DumpFormat {
+    Full,
+    Sparse,
+    Incremental,
+};
+
 enum class Option {
     None,
     Disassemble,
     Execute,
+    Replay,
+    DecodeTrace,
+    Fuzz,
 };
 
 int main(int argc, char** argv) {
@@ -30,15 +65,76 @@ int main(int argc, char** argv) {
     auto option = None;
     std::string filename;
     bool dump_memory = false;
+    auto dump_format = DumpFormat::Full;
     bool estimate_cycles = false;
+    bool dos = false;
+    std::string disk_filename;
+    bool boot = false;
+    std::optional<Framebuffer::Mode> framebuffer_mode;
+    u64 frame_cycles = 0;
+    auto frame_format = Framebuffer::ImageFormat::Ppm;
+    std::string shm_name;
+    u64 shm_cycles = 1'000'000;
+    std::string trace_filename;
+    bool trace_async = false;
+    auto trace_mode = TraceMode::Full;
+    AsyncTraceSink::Options trace_sink_options;
+    u64 replay_to = UINT64_MAX;
+    std::string checkpoint_filename;
+    u64 checkpoint_cycles = 0;
+    bool resume = false;
+    std::vector<u32> breakpoints;
+    std::vector<u32> watchpoints;
+    Intel8086::RunOptions run_options;
+    std::string profile_filename;
+    std::string histogram_filename;
+    SamplingProfiler::Options profiler_options;
+    std::string call_graph_filename;
+    FuzzOptions fuzz_options;
 
     for (i32 i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--help") == 0) {
             fmt::print("usage: {}  [options...]\n", name);
             fmt::print(" -d, --disassemble <program>\tDisassemble the program\n");
-            fmt::print(" -e, --execute <program>    \tExecute the program\n");
+            fmt::print(" -e, --execute <program>    \tExecute the program (a flat binary, or a DOS .COM or .EXE program)\n");
             fmt::print(" -D, --dump                 \tDump the memory after executing the program\n");
+            fmt::print("     --dump-format <format> \tFormat of the memory dump: full (default), sparse or incremental\n");
             fmt::print(" -C, --estimate-cycles      \tEstimate the number of cycles that instructions take\n");
+            fmt::print("     --dos                  \tService BIOS and DOS interrupts on the host\n");
+            fmt::print("     --disk <image>         \tAttach a disk image, accessed through int 13h\n");
+            fmt::print(" -b, --boot <image>         \tAttach a disk image and execute its boot sector\n");
+            fmt::print("     --framebuffer <mode>   \tWrite the video memory to image files: ce (64x64 RGBA at 256), vga (mode 13h) or cga (mode 4)\n");
+            fmt::print("     --frame-cycles <cycles>\tWrite a frame every given number of cycles if the video memory changed\n");
+            fmt::print("     --frame-format <format>\tFormat of the frames: ppm (default) or png\n");
+            fmt::print("     --shm <name>           \tKeep the memory and the CPU state in a POSIX shared memory object\n");
+            fmt::print("     --shm-cycles <cycles>  \tPublish the CPU state to the shared memory every given number of cycles\n");
+            fmt::print("     --trace <file>         \tRecord a binary execution trace to the file\n");
+            fmt::print("     --trace-async          \tWrite the trace on a separate thread\n");
+            fmt::print("     --trace-drop           \tDrop trace data instead of waiting when the writer thread falls behind\n");
+            fmt::print("     --trace-cpu <cpu>      \tPin the trace writer thread to the CPU\n");
+            fmt::print("     --trace-branches       \tOnly record branch outcomes and indirect targets to the trace\n");
+            fmt::print("     --checkpoint <file>    \tSave the state of the emulator to the file at the end of the execution\n");
+            fmt::print("     --checkpoint-cycles <n>\tAlso save the checkpoint every given number of cycles\n");
+            fmt::print("     --resume <checkpoint>  \tResume the execution from a checkpoint\n");
+            fmt::print("     --break <address>      \tStop the execution before the instruction at the physical address\n");
+            fmt::print("     --watch <address>      \tStop the execution after the block that writes to the physical address\n");
+            fmt::print("     --max-instructions <n> \tStop the execution after about the given number of instructions\n");
+            fmt::print("     --max-cycles <n>       \tStop the execution after about the given number of cycles\n");
+            fmt::print("     --profile <file>       \tSample the call stack and write it to the file in the collapsed format of flame graphs\n");
+            fmt::print("     --profile-histogram <file>\tSample the ip and write the number of samples per address to the file\n");
+            fmt::print("     --profile-period <n>   \tSample every given number of cycles (default 10000)\n");
+            fmt::print("     --profile-instructions \tCount the sampling period in instructions instead of cycles\n");
+            fmt::print("     --call-graph <file>    \tCount the instructions and cycles of every function and write the call graph to the file\n");
+            fmt::print(" -r, --replay <trace>       \tReplay a trace and print the registers at its end\n");
+            fmt::print("     --replay-to <count>    \tStop the replay after the given number of instructions of the recording\n");
+            fmt::print("     --decode-trace <trace> \tPrint the instructions executed in a branch trace\n");
+            fmt::print(" -f, --fuzz <program>       \tFuzz the program with mutated inputs\n");
+            fmt::print("     --fuzz-entry <address> \tSnapshot the program at the physical address before each fuzzing iteration (default 0)\n");
+            fmt::print("     --fuzz-input <address> \tPhysical address of the mutated input in the memory\n");
+            fmt::print("     --fuzz-size <size>     \tSize of the mutated input\n");
+            fmt::print("     --fuzz-cycles <cycles> \tCycle budget of each fuzzing iteration (default 1000000)\n");
+            fmt::print("     --fuzz-iterations <n>  \tNumber of fuzzing iterations (default 100000)\n");
+            fmt::print("     --fuzz-seed <seed>     \tSeed of the input mutator (default 0)\n");
             return EXIT_SUCCESS;
         } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--disassemble") == 0) {
             option = Disassemble;
@@ -50,16 +146,212 @@ int main(int argc, char** argv) {
             if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
             ++i;
             filename = argv[i];
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--replay") == 0) {
+            option = Replay;
+            if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
+            ++i;
+            filename = argv[i];
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            option = Execute;
+            resume = true;
+            if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
+            ++i;
+            filename = argv[i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            checkpoint_filename = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-cycles") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (!parse_number(argv[i], UINT64_MAX, checkpoint_cycles)) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--break") == 0 || strcmp(argv[i], "--watch") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            u64 address = 0;
+            if (!parse_number(argv[i], Intel8086::memory_size - 1, address)) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+            (strcmp(argv[i - 1], "--break") == 0 ? breakpoints : watchpoints).push_back(static_cast<u32>(address));
+        } else if (strcmp(argv[i], "--max-instructions") == 0 || strcmp(argv[i], "--max-cycles") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            auto& limit = strcmp(argv[i - 1], "--max-cycles") == 0 ? run_options.max_cycles : run_options.max_instructions;
+            if (!parse_number(argv[i], UINT64_MAX, limit)) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            profile_filename = argv[++i];
+        } else if (strcmp(argv[i], "--profile-histogram") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            histogram_filename = argv[++i];
+        } else if (strcmp(argv[i], "--profile-period") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (!parse_number(argv[i], UINT64_MAX, profiler_options.period) || profiler_options.period == 0) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--call-graph") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            call_graph_filename = argv[++i];
+        } else if (strcmp(argv[i], "--profile-instructions") == 0) {
+            profiler_options.clock = SamplingProfiler::Clock::Instructions;
+        } else if (strcmp(argv[i], "--decode-trace") == 0) {
+            option = DecodeTrace;
+            if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
+            ++i;
+            filename = argv[i];
+        } else if (strcmp(argv[i], "--replay-to") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (!parse_number(argv[i], UINT64_MAX, replay_to)) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            trace_filename = argv[++i];
+        } else if (strcmp(argv[i], "--trace-branches") == 0) {
+            trace_mode = TraceMode::Branches;
+        } else if (strcmp(argv[i], "--trace-async") == 0) {
+            trace_async = true;
+        } else if (strcmp(argv[i], "--trace-drop") == 0) {
+            trace_async = true;
+            trace_sink_options.policy = AsyncTraceSink::Policy::Drop;
+        } else if (strcmp(argv[i], "--trace-cpu") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            u64 cpu = 0;
+            if (!parse_number(argv[i], CPU_SETSIZE - 1, cpu)) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+            trace_async = true;
+            trace_sink_options.cpu = static_cast<u32>(cpu);
+        } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--boot") == 0) {
+            option = Execute;
+            boot = true;
+            if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
+            ++i;
+            filename = argv[i];
+            disk_filename = argv[i];
+        } else if (strcmp(argv[i], "--disk") == 0) {
+            if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
+            ++i;
+            disk_filename = argv[i];
+        } else if (strcmp(argv[i], "--framebuffer") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (strcmp(argv[i], "ce") == 0) framebuffer_mode = Framebuffer::computer_enhance_mode;
+            else if (strcmp(argv[i], "vga") == 0) framebuffer_mode = Framebuffer::vga_mode_13h;
+            else if (strcmp(argv[i], "cga") == 0) framebuffer_mode = Framebuffer::cga_mode_4;
+            else {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--frame-cycles") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (!parse_number(argv[i], UINT64_MAX, frame_cycles)) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--frame-format") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (strcmp(argv[i], "ppm") == 0) frame_format = Framebuffer::ImageFormat::Ppm;
+            else if (strcmp(argv[i], "png") == 0) frame_format = Framebuffer::ImageFormat::Png;
+            else {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            shm_name = argv[++i];
+            if (shm_name.size() < 2 || shm_name[0] != '/') {
+                fmt::print(stderr, "{}: option {}: the name has to start with a slash\n", name, argv[i - 1]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "--shm-cycles") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (!parse_number(argv[i], UINT64_MAX, shm_cycles) || shm_cycles == 0) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--fuzz") == 0) {
+            option = Fuzz;
+            if (i + 1 >= argc || argv[i + 1][0] == '-') return print_requires_parameter(name, argv[i]);
+            ++i;
+            filename = argv[i];
+        } else if (strncmp(argv[i], "--fuzz-", strlen("--fuzz-")) == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            auto parameter = argv[i + 1];
+            u64 value = 0;
+            bool valid = false;
+            if (strcmp(argv[i], "--fuzz-entry") == 0) {
+                valid = parse_number(parameter, Intel8086::memory_size - 1, value);
+                fuzz_options.entry_address = value;
+            } else if (strcmp(argv[i], "--fuzz-input") == 0) {
+                valid = parse_number(parameter, Intel8086::memory_size - 1, value);
+                fuzz_options.input_address = value;
+            } else if (strcmp(argv[i], "--fuzz-size") == 0) {
+                valid = parse_number(parameter, 0xffff, value);
+                fuzz_options.input_size = value;
+            } else if (strcmp(argv[i], "--fuzz-cycles") == 0) {
+                valid = parse_number(parameter, UINT64_MAX, value);
+                fuzz_options.max_cycles = value;
+            } else if (strcmp(argv[i], "--fuzz-iterations") == 0) {
+                valid = parse_number(parameter, UINT64_MAX, value);
+                fuzz_options.iterations = value;
+            } else if (strcmp(argv[i], "--fuzz-seed") == 0) {
+                valid = parse_number(parameter, UINT64_MAX, value);
+                fuzz_options.seed = value;
+            } else {
+                fmt::print(stderr, "{}: option {}: is unknown\n", name, argv[i]);
+                return print_instructions_for_help(name);
+            }
+            if (!valid) {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i], parameter);
+                return print_instructions_for_help(name);
+            }
+            ++i;
         } else if (strcmp(argv[i], "-D") == 0 || strcmp(argv[i], "--dump") == 0) {
             dump_memory = true;
+        } else if (strcmp(argv[i], "--dump-format") == 0) {
+            if (i + 1 >= argc) return print_requires_parameter(name, argv[i]);
+            ++i;
+            if (strcmp(argv[i], "full") == 0) dump_format = DumpFormat::Full;
+            else if (strcmp(argv[i], "sparse") == 0) dump_format = DumpFormat::Sparse;
+            else if (strcmp(argv[i], "incremental") == 0) dump_format = DumpFormat::Incremental;
+            else {
+                fmt::print(stderr, "{}: option {}: invalid parameter '{}'\n", name, argv[i - 1], argv[i]);
+                return print_instructions_for_help(name);
+            }
+            dump_memory = true;
         } else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--estimate-cycles") == 0) {
             estimate_cycles = true;
+        } else if (strcmp(argv[i], "--dos") == 0) {
+            dos = true;
         } else {
             fmt::print(stderr, "{}: option {}: is unknown\n", name, argv[i]);
             return print_instructions_for_help(name);
         }
     }
 
+    // Both profilers keep a shadow call stack through the same hook, so only
+    // one of them runs at a time
+    if (!call_graph_filename.empty() && (!profile_filename.empty() || !histogram_filename.empty())) {
+        fmt::print(stderr, "{}: option --call-graph can't be combined with --profile or --profile-histogram\n", name);
+        return print_instructions_for_help(name);
+    }
+
     bool assemble = filename.ends_with(".asm");
     if (assemble) {
         fmt::print("; ");
@@ -81,21 +373,294 @@ int main(int argc, char** argv) {
             }
             break;
         case Execute: {
+            // The emulator uses the memory of the shared state in place, so
+            // the state has to outlive it
+            std::optional<SharedState> shared_state;
+            if (!shm_name.empty()) {
+                auto created = SharedState::create(shm_name.data());
+                if (!created) {
+                    fmt::print(stderr, "Error while creating shared memory {}: {}\n", shm_name, created.error().message());
+                    return EXIT_FAILURE;
+                }
+                shared_state.emplace(std::move(*created));
+            }
+
+            // A resumed emulator uses the memory of the checkpoint in place
+            std::optional<CheckpointFile> checkpoint;
+            if (resume) {
+                auto opened = CheckpointFile::open(filename.data());
+                if (!opened) {
+                    fmt::print(stderr, "Error while reading checkpoint {}: {}\n", filename, opened.error().message());
+                    return EXIT_FAILURE;
+                }
+                checkpoint.emplace(std::move(*opened));
+            }
+
+            // Periodic events start from the clock of the checkpoint
             Intel8086 x86;
-            if (auto e = x86.load_program(filename.data())) {
-                fmt::print(stderr, "Error while reading file {}: {}\n", filename, e.message());
+            if (checkpoint) checkpoint->restore(x86);
+            if (shared_state) {
+                x86.move_memory_to(shared_state->get_memory());
+                shared_state->publish(x86);
+                x86.get_scheduler().schedule_periodic(x86.get_cycle_count() + shm_cycles, shm_cycles, [&](u64) {
+                    shared_state->publish(x86);
+                });
+            }
+            DosServices dos_services;
+            std::optional<Disk> disk;
+            if (!disk_filename.empty()) {
+                // Images that can't be written, e.g. on a read-only mount,
+                // are attached write-protected
+                bool writable = access(disk_filename.data(), W_OK) == 0 || (errno != EACCES && errno != EROFS);
+                auto opened = Disk::open(disk_filename.data(), writable);
+                if (!opened) {
+                    fmt::print(stderr, "Error while opening disk image {}: {}\n", disk_filename, opened.error().message());
+                    return EXIT_FAILURE;
+                }
+                disk.emplace(std::move(*opened));
+                disk->map(x86);
+            }
+
+            // DOS programs are loaded after a PSP and always get the DOS
+            // services, a boot sector gets them for the int 10h output
+            error_code load_error;
+            bool flat_program = false;
+            if (resume) {
+                // The program is in the restored memory
+            } else if (boot) {
+                dos = true;
+                load_error = disk->boot(x86);
+            } else if (has_extension(filename, ".com")) {
+                dos = true;
+                load_error = load_com_program(x86, filename.data());
+            } else if (has_extension(filename, ".exe")) {
+                dos = true;
+                load_error = load_exe_program(x86, filename.data());
+            } else {
+                flat_program = true;
+                load_error = x86.load_program(filename.data());
+            }
+            if (dos) dos_services.map(x86);
+            if (load_error) {
+                fmt::print(stderr, "Error while reading file {}: {}\n", filename, load_error.message());
                 return EXIT_FAILURE;
             }
-            if (auto e = x86.run(estimate_cycles)) {
+
+            // Frames are only written when the video memory changed since the
+            // previous one, and always at the end of the execution
+            std::optional<Framebuffer> framebuffer;
+            u32 frame_count = 0;
+            error_code frame_error;
+            auto write_frame = [&](bool changed) {
+                if (!changed || frame_error) return;
+                auto frame_filename = fmt::format("x86-emulator.frame.{}.{}", frame_count++,
+                    frame_format == Framebuffer::ImageFormat::Png ? "png" : "ppm");
+                frame_error = framebuffer->write_image(frame_filename.data(), frame_format);
+                if (frame_error) x86.stop();
+            };
+            if (framebuffer_mode) {
+                framebuffer.emplace(x86, *framebuffer_mode);
+                framebuffer->map_ports(x86);
+                if (checkpoint) {
+                    if (auto e = checkpoint->restore_device(*framebuffer)) {
+                        fmt::print(stderr, "Error while restoring the framebuffer: {}\n", e.message());
+                        return EXIT_FAILURE;
+                    }
+                }
+                if (frame_cycles) {
+                    x86.get_scheduler().schedule_periodic(x86.get_cycle_count() + frame_cycles, frame_cycles, [&](u64) {
+                        write_frame(framebuffer->update());
+                    });
+                }
+            }
+
+            std::vector<const DeviceState*> saved_devices;
+            if (framebuffer) saved_devices.push_back(&*framebuffer);
+            error_code checkpoint_error;
+            if (!checkpoint_filename.empty() && checkpoint_cycles) {
+                x86.get_scheduler().schedule_periodic(x86.get_cycle_count() + checkpoint_cycles, checkpoint_cycles, [&](u64) {
+                    checkpoint_error = save_checkpoint(x86, checkpoint_filename.data(), saved_devices);
+                    if (checkpoint_error) x86.stop();
+                });
+            }
+
+            // Started last, so the trace header has the loaded program and
+            // all the device and interrupt mappings
+            std::optional<TraceWriter> trace;
+            if (!trace_filename.empty()) {
+                auto opened = trace_async ? TraceWriter::open_async(trace_filename.data(), trace_sink_options, trace_mode)
+                                          : TraceWriter::open(trace_filename.data(), trace_mode);
+                if (!opened) {
+                    fmt::print(stderr, "Error while opening trace {}: {}\n", trace_filename, opened.error().message());
+                    return EXIT_FAILURE;
+                }
+                trace.emplace(std::move(*opened));
+                trace->start(x86);
+            }
+
+            for (auto address : breakpoints) x86.add_breakpoint(address);
+            for (auto address : watchpoints) x86.add_watchpoint(address, 1, Intel8086::WatchAccess::Write);
+
+            run_options.estimate_cycles = estimate_cycles;
+            // Printing every instruction would dominate a profile
+            std::optional<SamplingProfiler> profiler;
+            std::optional<CallGraphProfiler> call_graph;
+            if (!profile_filename.empty() || !histogram_filename.empty()) {
+                profiler.emplace(profiler_options);
+                x86.set_verbose(false);
+            } else if (!call_graph_filename.empty()) {
+                call_graph.emplace();
+                x86.set_verbose(false);
+            }
+            auto run = [&] {
+                if (profiler) return profiler->run(x86, run_options);
+                if (call_graph) return call_graph->run(x86, run_options);
+                return x86.run(run_options);
+            };
+            if (auto e = run()) {
                 fmt::print(stderr, "Error while executing file {}: {}\n", filename, e.message());
                 return EXIT_FAILURE;
             }
+            if (call_graph) {
+                x86.print_state();
+                if (auto e = call_graph->write_report(call_graph_filename.data())) {
+                    fmt::print(stderr, "Error while writing call graph {}: {}\n", call_graph_filename, e.message());
+                    return EXIT_FAILURE;
+                }
+            }
+            if (profiler) {
+                x86.print_state();
+                if (!profile_filename.empty()) {
+                    if (auto e = profiler->write_collapsed_stacks(profile_filename.data())) {
+                        fmt::print(stderr, "Error while writing profile {}: {}\n", profile_filename, e.message());
+                        return EXIT_FAILURE;
+                    }
+                }
+                if (!histogram_filename.empty()) {
+                    if (auto e = profiler->write_histogram(histogram_filename.data())) {
+                        fmt::print(stderr, "Error while writing histogram {}: {}\n", histogram_filename, e.message());
+                        return EXIT_FAILURE;
+                    }
+                }
+                fmt::print("Took {} samples\n", profiler->get_sample_count());
+            }
+            if (x86.get_stop_reason() == Intel8086::StopReason::Breakpoint) {
+                fmt::print("Stopped at the breakpoint at {:#07x}\n", x86.get_physical_ip());
+            } else if (auto hit = x86.get_watchpoint_hit(); x86.get_stop_reason() == Intel8086::StopReason::Watchpoint) {
+                fmt::print("Stopped after writing {:#04x} to {:#07x}\n", hit->value, hit->address);
+            } else if (x86.get_stop_reason() == Intel8086::StopReason::InstructionLimit
+                       || x86.get_stop_reason() == Intel8086::StopReason::CycleLimit) {
+                fmt::print("Stopped after {} instructions and {} cycles\n", x86.get_instruction_count(), x86.get_cycle_count());
+            }
+            dos_services.flush_console();
+            if (trace) {
+                x86.set_trace(nullptr);
+                if (auto e = trace->flush()) {
+                    fmt::print(stderr, "Error while writing trace {}: {}\n", trace_filename, e.message());
+                    return EXIT_FAILURE;
+                }
+                if (auto dropped = trace->get_dropped_bytes()) {
+                    fmt::print(stderr, "Dropped {} bytes of the trace\n", dropped);
+                }
+            }
+            if (shared_state) shared_state->publish(x86);
+            if (framebuffer) write_frame(framebuffer->update() || frame_count == 0);
+            if (frame_error) {
+                fmt::print(stderr, "Error while writing a frame: {}\n", frame_error.message());
+                return EXIT_FAILURE;
+            }
+            if (!checkpoint_filename.empty() && !checkpoint_error) {
+                checkpoint_error = save_checkpoint(x86, checkpoint_filename.data(), saved_devices);
+            }
+            if (checkpoint_error) {
+                fmt::print(stderr, "Error while saving checkpoint {}: {}\n", checkpoint_filename, checkpoint_error.message());
+                return EXIT_FAILURE;
+            }
             if (dump_memory) {
-                if (auto e = x86.dump_memory("x86-emulator.memory.data")) {
+                auto dump = [&]() -> error_code {
+                    switch (dump_format) {
+                        using enum DumpFormat;
+                        case Full: {
+                            // Flat binaries keep the 64 KB dump of the 8086 emulators they come from
+                            constexpr u32 flat_program_dump_size = 1 << 16;
+                            auto size = flat_program ? flat_program_dump_size : Intel8086::memory_size;
+                            return x86.dump_memory("x86-emulator.memory.data", size);
+                        }
+                        case Sparse:
+                            return write_sparse_dump(x86, "x86-emulator.memory.sparse");
+                        case Incremental: {
+                            UNWRAP_BARE(auto writer, IncrementalDumpWriter::open("x86-emulator.memory.delta"));
+                            return writer.append(x86);
+                        }
+                    }
+                    return {};
+                };
+                if (auto e = dump()) {
                     fmt::print(stderr, "Error while dumping the memory: {}\n", e.message());
                     return EXIT_FAILURE;
                 }
             }
+            if (auto exit_code = dos_services.get_exit_code()) return *exit_code;
+            break;
+        }
+        case Replay: {
+            auto replayer = TraceReplayer::open(filename.data());
+            if (!replayer) {
+                fmt::print(stderr, "Error while reading trace {}: {}\n", filename, replayer.error().message());
+                return EXIT_FAILURE;
+            }
+            if (auto e = (*replayer)->run_to(replay_to)) {
+                fmt::print(stderr, "Error while replaying trace {}: {}\n", filename, e.message());
+                return EXIT_FAILURE;
+            }
+            fmt::print("Replayed {} instructions\n", (*replayer)->get_instruction_count());
+            (*replayer)->get_cpu().print_state();
+            break;
+        }
+        case DecodeTrace: {
+            auto decoder = BranchTraceDecoder::open(filename.data());
+            if (!decoder) {
+                fmt::print(stderr, "Error while reading trace {}: {}\n", filename, decoder.error().message());
+                return EXIT_FAILURE;
+            }
+            DecodedInstruction decoded;
+            while (true) {
+                auto read = decoder->next(decoded);
+                if (!read) {
+                    fmt::print(stderr, "Error while decoding trace {}: {}\n", filename, read.error().message());
+                    return EXIT_FAILURE;
+                }
+                if (!*read) break;
+                fmt::print("{:04x}:{:04x} {}\n", decoded.cs, decoded.ip, decoded.instruction);
+            }
+            break;
+        }
+        case Fuzz: {
+            Intel8086 x86;
+            if (auto e = x86.load_program(filename.data())) {
+                fmt::print(stderr, "Error while reading file {}: {}\n", filename, e.message());
+                return EXIT_FAILURE;
+            }
+            auto result = fuzz_program(x86, fuzz_options, stdout);
+            if (!result) {
+                fmt::print(stderr, "Error while fuzzing file {}: {}\n", filename, result.error().message());
+                return EXIT_FAILURE;
+            }
+            for (size_t i = 0; i < result->crashes.size(); ++i) {
+                auto crash_filename = fmt::format("x86-emulator.crash.{}.data", i);
+                FILE* file = fopen(crash_filename.data(), "wb");
+                if (!file) {
+                    fmt::print(stderr, "Couldn't open file {}\n", crash_filename);
+                    return EXIT_FAILURE;
+                }
+                auto& crash = result->crashes[i];
+                auto written = fwrite(crash.data(), 1, crash.size(), file);
+                fclose(file);
+                if (written != crash.size()) {
+                    fmt::print(stderr, "Error while writing file {}\n", crash_filename);
+                    return EXIT_FAILURE;
+                }
+            }
             break;
         }
         case None:
@@ -0,0 +1,47 @@
+#include "mapped_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fmt/core.h>
+
+expected<MappedFile, error_code> MappedFile::open(const char* filename, bool writable) {
+    if (writable) return map(filename, O_RDWR, PROT_READ | PROT_WRITE, MAP_SHARED);
+    return map(filename, O_RDONLY, PROT_READ, MAP_PRIVATE);
+}
+
+expected<MappedFile, error_code> MappedFile::open_copy_on_write(const char* filename) {
+    return map(filename, O_RDONLY, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+}
+
+expected<MappedFile, error_code> MappedFile::map(const char* filename, int open_flags, int protection, int flags) {
+    int fd = ::open(filename, open_flags);
+    if (fd == -1) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_unexpected_errno();
+    }
+    DEFER { close(fd); };
+
+    struct stat status = {};
+    if (fstat(fd, &status)) return make_unexpected_errno();
+
+    MappedFile file;
+    // An empty file can't be mapped, it's represented by an empty mapping
+    if (status.st_size == 0) return file;
+
+    void* address = mmap(nullptr, status.st_size, protection, flags, fd, 0);
+    if (address == MAP_FAILED) return make_unexpected_errno();
+
+    file.address = static_cast<u8*>(address);
+    file.length = status.st_size;
+    return file;
+}
+
+MappedFile::~MappedFile() {
+    if (address) munmap(address, length);
+}
+
+error_code MappedFile::flush() const {
+    if (address && msync(address, length, MS_SYNC)) return make_error_code_errno();
+    return {};
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.hpp"
+#include <utility>
+
+// A file mapped to memory with mmap. Read-only mappings are private, writable
+// ones are shared, so writes reach the file when flushed or unmapped.
+class MappedFile {
+public:
+    static expected<MappedFile, error_code> open(const char* filename, bool writable = false);
+    // A writable private mapping. Written pages are copied on the first
+    // write and never reach the file.
+    static expected<MappedFile, error_code> open_copy_on_write(const char* filename);
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept
+        : address(std::exchange(other.address, nullptr)), length(std::exchange(other.length, 0)) {}
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        std::swap(address, other.address);
+        std::swap(length, other.length);
+        return *this;
+    }
+    ~MappedFile();
+
+    std::span<u8> data() const { return { address, length }; }
+    size_t size() const { return length; }
+
+    // Writes the modified pages back to the file
+    error_code flush() const;
+
+private:
+    u8* address = nullptr;
+    size_t length = 0;
+
+    static expected<MappedFile, error_code> map(const char* filename, int open_flags, int protection, int flags);
+};
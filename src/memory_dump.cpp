@@ -0,0 +1,150 @@
+#include "memory_dump.hpp"
+#include <cstring>
+#include <fmt/core.h>
+
+static constexpr u32 page_size = Intel8086::page_size;
+
+static std::vector<u8> read_memory(const Intel8086& x86) {
+    std::vector<u8> memory(Intel8086::memory_size);
+    x86.read_image(0, memory);
+    return memory;
+}
+
+// Writes a record with the given pages of memory
+static error_code write_record(FILE* file, u64 cycle_count, std::span<const u32> pages, std::span<const u8> memory) {
+    MemoryDumpHeader header;
+    header.page_count = static_cast<u32>(pages.size());
+    header.cycle_count = cycle_count;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) return make_error_code_errno();
+    if (fwrite(pages.data(), sizeof(u32), pages.size(), file) != pages.size()) return make_error_code_errno();
+    for (auto page : pages) {
+        if (fwrite(memory.data() + page * page_size, 1, page_size, file) != page_size) return make_error_code_errno();
+    }
+    return {};
+}
+
+error_code write_sparse_dump(const Intel8086& x86, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_error_code_errno();
+    }
+    DEFER { fclose(file); };
+
+    static constexpr std::array<u8, page_size> zero_page = {};
+    auto memory = read_memory(x86);
+    std::vector<u32> pages;
+    for (u32 page = 0; page < Intel8086::page_count; ++page) {
+        if (memcmp(memory.data() + page * page_size, zero_page.data(), page_size) != 0) pages.push_back(page);
+    }
+    return write_record(file, x86.get_cycle_count(), pages, memory);
+}
+
+expected<IncrementalDumpWriter, error_code> IncrementalDumpWriter::open(const char* filename) {
+    std::vector<u8> previous(Intel8086::memory_size);
+    if (FILE* existing = fopen(filename, "rb")) {
+        fclose(existing);
+        UNWRAP(auto reader, MemoryDumpReader::open(filename));
+        if (auto e = reader.apply_remaining(previous)) return unexpected(e);
+    }
+
+    FILE* file = fopen(filename, "ab");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_unexpected_errno();
+    }
+    return IncrementalDumpWriter(file, std::move(previous));
+}
+
+IncrementalDumpWriter::~IncrementalDumpWriter() {
+    if (file) fclose(file);
+}
+
+error_code IncrementalDumpWriter::append(const Intel8086& x86) {
+    auto memory = read_memory(x86);
+    std::vector<u32> pages;
+    for (u32 page = 0; page < Intel8086::page_count; ++page) {
+        auto offset = page * page_size;
+        if (memcmp(memory.data() + offset, previous.data() + offset, page_size) != 0) pages.push_back(page);
+    }
+    RET_IF(write_record(file, x86.get_cycle_count(), pages, memory));
+    if (fflush(file) != 0) return make_error_code_errno();
+    previous = std::move(memory);
+    return {};
+}
+
+expected<MemoryDumpReader, error_code> MemoryDumpReader::open(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_unexpected_errno();
+    }
+    return MemoryDumpReader(file);
+}
+
+MemoryDumpReader::~MemoryDumpReader() {
+    if (file) fclose(file);
+}
+
+expected<bool, error_code> MemoryDumpReader::apply_next(std::span<u8> memory) {
+    assert(memory.size() == Intel8086::memory_size);
+    return read_next([&](u32 address, std::span<const u8> page) {
+        memcpy(memory.data() + address, page.data(), page.size());
+    });
+}
+
+error_code MemoryDumpReader::apply_remaining(std::span<u8> memory) {
+    assert(memory.size() == Intel8086::memory_size);
+    // The file offsets of the last copy of each page. Earlier copies are
+    // skipped, so every page is read at most once however long the dump is.
+    std::vector<long> offsets(Intel8086::page_count, -1);
+    while (true) {
+        UNWRAP_BARE(bool found, read_header());
+        if (!found) break;
+        long offset = ftell(file);
+        if (offset < 0) return make_error_code_errno();
+        for (auto page : index) {
+            offsets[page] = offset;
+            offset += page_size;
+        }
+        if (fseek(file, offset, SEEK_SET) != 0) return make_error_code_errno();
+    }
+
+    // Seeking doesn't check that the pages are there, the last one tells
+    // whether the file is truncated
+    if (fseek(file, 0, SEEK_END) != 0) return make_error_code_errno();
+    long end = ftell(file);
+    for (u32 page = 0; page < Intel8086::page_count; ++page) {
+        if (offsets[page] < 0) continue;
+        if (offsets[page] + static_cast<long>(page_size) > end) return Errc::InvalidMemoryDump;
+        if (fseek(file, offsets[page], SEEK_SET) != 0) return make_error_code_errno();
+        RET_IF(read_page(memory.subspan(page * page_size, page_size)));
+    }
+    return {};
+}
+
+expected<bool, error_code> MemoryDumpReader::read_header() {
+    auto read = fread(&header, 1, sizeof(header), file);
+    if (read == 0 && feof(file)) return false;
+    if (read != sizeof(header)) return unexpected(ferror(file) ? make_error_code_errno() : Errc::InvalidMemoryDump);
+    if (header.magic != MemoryDumpHeader::signature || header.version != MemoryDumpHeader::current_version
+        || header.page_size != page_size || header.page_count > Intel8086::page_count) {
+        return unexpected(Errc::InvalidMemoryDump);
+    }
+
+    index.resize(header.page_count);
+    if (fread(index.data(), sizeof(u32), index.size(), file) != index.size()) {
+        return unexpected(ferror(file) ? make_error_code_errno() : Errc::InvalidMemoryDump);
+    }
+    for (auto page : index) {
+        if (page >= Intel8086::page_count) return unexpected(Errc::InvalidMemoryDump);
+    }
+    return true;
+}
+
+error_code MemoryDumpReader::read_page(std::span<u8> page) {
+    if (fread(page.data(), 1, page.size(), file) != page.size()) {
+        return ferror(file) ? make_error_code_errno() : Errc::InvalidMemoryDump;
+    }
+    return {};
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.hpp"
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "emulator.hpp"
+
+// Memory dumps that only store some of the pages. A dump file is a sequence
+// of records, each made of a header, the numbers of the pages it stores and
+// the contents of those pages. Applying the records in order to a zeroed
+// memory image reconstructs the memory at the time of each record.
+//
+// A sparse dump is a single record with the pages that are not all zeros. An
+// incremental dump appends a record with the pages that changed since the
+// previous record every time the memory is dumped.
+struct MemoryDumpHeader {
+    static constexpr std::array<char, 4> signature = { 'X', '8', '6', 'M' };
+    static constexpr u32 current_version = 1;
+
+    std::array<char, 4> magic = signature;
+    u32 version = current_version;
+    u32 page_size = Intel8086::page_size;
+    u32 page_count = 0;
+    u64 cycle_count = 0;
+};
+static_assert(sizeof(MemoryDumpHeader) == 24);
+
+error_code write_sparse_dump(const Intel8086& x86, const char* filename);
+
+class IncrementalDumpWriter {
+public:
+    // Appends to an existing dump. The memory of its last record is read back
+    // first with MemoryDumpReader::apply_remaining.
+    static expected<IncrementalDumpWriter, error_code> open(const char* filename);
+
+    IncrementalDumpWriter(const IncrementalDumpWriter&) = delete;
+    IncrementalDumpWriter(IncrementalDumpWriter&& other) noexcept
+        : file(std::exchange(other.file, nullptr)), previous(std::move(other.previous)) {}
+    IncrementalDumpWriter& operator=(const IncrementalDumpWriter&) = delete;
+    IncrementalDumpWriter& operator=(IncrementalDumpWriter&& other) noexcept {
+        std::swap(file, other.file);
+        std::swap(previous, other.previous);
+        return *this;
+    }
+    ~IncrementalDumpWriter();
+
+    // Appends a record with the pages that differ from the previous one
+    error_code append(const Intel8086& x86);
+
+private:
+    IncrementalDumpWriter(FILE* file, std::vector<u8> previous) : file(file), previous(std::move(previous)) {}
+
+    FILE* file = nullptr;
+    std::vector<u8> previous;
+};
+
+// Reads the records of a sparse or incremental dump one page at a time, so
+// tools don't have to hold the whole file in memory
+class MemoryDumpReader {
+public:
+    static expected<MemoryDumpReader, error_code> open(const char* filename);
+
+    MemoryDumpReader(const MemoryDumpReader&) = delete;
+    MemoryDumpReader(MemoryDumpReader&& other) noexcept
+        : file(std::exchange(other.file, nullptr)), header(other.header), index(std::move(other.index)) {}
+    MemoryDumpReader& operator=(const MemoryDumpReader&) = delete;
+    MemoryDumpReader& operator=(MemoryDumpReader&& other) noexcept {
+        std::swap(file, other.file);
+        std::swap(header, other.header);
+        std::swap(index, other.index);
+        return *this;
+    }
+    ~MemoryDumpReader();
+
+    // Reads the next record and calls f(address, page) for each of its pages.
+    // Returns false at the end of the file.
+    template<typename F>
+    expected<bool, error_code> read_next(F f) {
+        UNWRAP(bool found, read_header());
+        if (!found) return false;
+        std::array<u8, Intel8086::page_size> page;
+        for (auto number : index) {
+            if (auto e = read_page(page)) return unexpected(e);
+            f(number * Intel8086::page_size, std::span<const u8>(page));
+        }
+        return true;
+    }
+    // Reads the next record and copies its pages to memory
+    expected<bool, error_code> apply_next(std::span<u8> memory);
+    // Copies the memory of the last record to memory, reading only the last
+    // copy of each page of the remaining records
+    error_code apply_remaining(std::span<u8> memory);
+
+    // The header of the record read last
+    const MemoryDumpHeader& get_header() const { return header; }
+
+private:
+    explicit MemoryDumpReader(FILE* file) : file(file) {}
+
+    FILE* file = nullptr;
+    MemoryDumpHeader header;
+    std::vector<u32> index;
+
+    expected<bool, error_code> read_header();
+    error_code read_page(std::span<u8> page);
+};
@@ -0,0 +1,177 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fmt/core.h>
+
+#include "emulator_run.hpp"
+
+error_code SamplingProfiler::run(Intel8086& x86, const Intel8086::RunOptions& run_options) {
+    if (options.clock == Clock::Cycles) {
+        auto& scheduler = x86.get_scheduler();
+        auto sampler = scheduler.schedule_periodic(x86.get_cycle_count() + options.period, options.period, [&](u64) {
+            sample(x86);
+        });
+        DEFER { scheduler.cancel(sampler); };
+        return x86.run(*this, run_options);
+    }
+
+    // The budgets of the whole run are split into the slices
+    auto saturating_add = [](u64 a, u64 b) { return b < UINT64_MAX - a ? a + b : UINT64_MAX; };
+    auto instruction_end = saturating_add(x86.get_instruction_count(), run_options.max_instructions);
+    auto cycle_end = saturating_add(x86.get_cycle_count(), run_options.max_cycles);
+    auto slice = run_options;
+    while (true) {
+        auto instructions = x86.get_instruction_count();
+        auto cycles = x86.get_cycle_count();
+        slice.max_instructions = std::min(options.period, instruction_end - std::min(instruction_end, instructions));
+        slice.max_cycles = cycle_end == UINT64_MAX ? UINT64_MAX : cycle_end - std::min(cycle_end, cycles);
+        RET_IF(x86.run(*this, slice));
+        if (x86.get_stop_reason() != Intel8086::StopReason::InstructionLimit || x86.get_instruction_count() >= instruction_end) {
+            return {};
+        }
+        sample(x86);
+        slice.break_at_start = true;
+    }
+}
+
+void SamplingProfiler::sample(const Intel8086& x86) {
+    call_stack.unwind(x86);
+    auto address = x86.get_physical_ip();
+    stack.clear();
+    for (const auto& frame : call_stack.get_frames()) stack.push_back(frame.function);
+    stack.push_back(address);
+
+    ++stacks[stack];
+    ++histogram[address];
+    ++sample_count;
+}
+
+error_code SamplingProfiler::write_collapsed_stacks(const char* filename) const {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_error_code_errno();
+    }
+    DEFER { fclose(file); };
+
+    for (const auto& [addresses, count] : stacks) {
+        for (size_t i = 0; i < addresses.size(); ++i) fmt::print(file, "{}{:05x}", i ? ";" : "", addresses[i]);
+        fmt::print(file, " {}\n", count);
+    }
+    if (ferror(file)) return make_error_code_errno();
+    return {};
+}
+
+error_code SamplingProfiler::write_histogram(const char* filename) const {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_error_code_errno();
+    }
+    DEFER { fclose(file); };
+
+    std::vector<std::pair<u32, u64>> addresses(histogram.begin(), histogram.end());
+    std::sort(addresses.begin(), addresses.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    for (const auto& [address, count] : addresses) {
+        fmt::print(file, "{:05x} {} {:.2f}%\n", address, count, 100.0 * static_cast<double>(count) / static_cast<double>(sample_count));
+    }
+    if (ferror(file)) return make_error_code_errno();
+    return {};
+}
+
+error_code CallGraphProfiler::run(Intel8086& x86, const Intel8086::RunOptions& run_options) {
+    if (!root) {
+        root = x86.get_physical_ip();
+        functions[*root].calls = 1;
+    }
+    auto first_instruction = instruction_count = x86.get_instruction_count();
+    auto first_cycle = cycle_count = x86.get_cycle_count();
+    ++active[*root];
+
+    auto e = x86.run(*this, run_options);
+
+    count_self(x86);
+    call_stack.clear([&](const Frame& frame, const Frame* caller) { leave(x86, frame, caller); });
+    // The root is open for the whole run
+    if (--active[*root] == 0) {
+        auto& function = functions[*root];
+        function.total_instructions += x86.get_instruction_count() - first_instruction;
+        function.total_cycles += x86.get_cycle_count() - first_cycle;
+    }
+    return e;
+}
+
+void CallGraphProfiler::branch_taken(Intel8086& x86, const Instruction& branch, u32 address) {
+    count_self(x86);
+    bool called = call_stack.branch_taken(x86, branch, address, [&](const Frame& frame, const Frame* caller) {
+        leave(x86, frame, caller);
+    });
+    if (!called) return;
+
+    const auto& frames = call_stack.get_frames();
+    auto function = frames.back().function;
+    ++functions[function].calls;
+    ++active[function];
+    auto caller = frames.size() > 1 ? frames[frames.size() - 2].function : *root;
+    ++calls[{ caller, function }].count;
+}
+
+void CallGraphProfiler::count_self(const Intel8086& x86) {
+    const auto& frames = call_stack.get_frames();
+    auto& function = functions[frames.empty() ? *root : frames.back().function];
+    function.self_instructions += x86.get_instruction_count() - instruction_count;
+    function.self_cycles += x86.get_cycle_count() - cycle_count;
+    instruction_count = x86.get_instruction_count();
+    cycle_count = x86.get_cycle_count();
+}
+
+void CallGraphProfiler::leave(const Intel8086& x86, const Frame& frame, const Frame* caller) {
+    auto instructions = x86.get_instruction_count() - frame.instruction_count;
+    auto cycles = x86.get_cycle_count() - frame.cycle_count;
+    if (--active[frame.function] == 0) {
+        auto& function = functions[frame.function];
+        function.total_instructions += instructions;
+        function.total_cycles += cycles;
+    }
+    auto& call = calls[{ caller ? caller->function : *root, frame.function }];
+    call.instructions += instructions;
+    call.cycles += cycles;
+}
+
+error_code CallGraphProfiler::write_report(const char* filename) const {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_error_code_errno();
+    }
+    DEFER { fclose(file); };
+
+    std::vector<std::pair<u32, Function>> sorted(functions.begin(), functions.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.second.total_cycles != b.second.total_cycles ? a.second.total_cycles > b.second.total_cycles : a.first < b.first;
+    });
+
+    // The calls are ordered by caller, so the callees of a function are a
+    // range of them, and the callers are collected in one pass
+    std::unordered_map<u32, std::vector<std::pair<u32, u64>>> callers;
+    for (const auto& [call, counts] : calls) callers[call.second].emplace_back(call.first, counts.count);
+
+    fmt::print(file, "Functions by their physical address, the totals include the callees\n\n");
+    fmt::print(file, "{:>8} {:>10} {:>14} {:>14} {:>14} {:>14}\n", "function", "calls", "self instr", "self cycles", "total instr", "total cycles");
+    for (const auto& [address, function] : sorted) {
+        fmt::print(file, "{:>8} {:>10} {:>14} {:>14} {:>14} {:>14}\n", fmt::format("{:05x}", address), function.calls,
+                   function.self_instructions, function.self_cycles, function.total_instructions, function.total_cycles);
+        if (auto it = callers.find(address); it != callers.end()) {
+            for (const auto& [caller, count] : it->second) fmt::print(file, "    called by {:05x} {:>10} times\n", caller, count);
+        }
+        for (auto it = calls.lower_bound({ address, 0 }); it != calls.end() && it->first.first == address; ++it) {
+            const auto& [call, counts] = *it;
+            fmt::print(file, "    calls     {:05x} {:>10} times {:>14} instructions {:>14} cycles\n", call.second, counts.count,
+                       counts.instructions, counts.cycles);
+        }
+    }
+    if (ferror(file)) return make_error_code_errno();
+    return {};
+}
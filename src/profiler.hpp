@@ -0,0 +1,205 @@
+#pragma once
+
+#include "common.hpp"
+#include <map>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "emulator.hpp"
+#include "instruction.hpp"
+
+// The calls of the guest that haven't returned, kept on the host from the
+// control transfers at the ends of blocks. Calls, software interrupts and
+// exceptions push a frame, and a frame is dropped once its return address is
+// above the top of the guest stack, which is checked at every taken branch.
+// So returns through a different path than ret, e.g. after the return
+// address was dropped or sp was reloaded, and calls that never return unwind
+// the shadow stack at the next jump, call or return.
+//
+// The functions that take a callback call it with every dropped frame and
+// the frame of its caller, which is nullptr for the outermost frame.
+class ShadowCallStack {
+public:
+    struct Frame {
+        // Physical address of the called function or interrupt handler
+        u32 function = 0;
+        // Physical address of the call instruction
+        u32 call_site = 0;
+        // Physical address of the return address on the guest stack
+        u32 stack = 0;
+        // The counters of the emulator after the call
+        u64 instruction_count = 0;
+        u64 cycle_count = 0;
+    };
+
+    // Deeper frames drop the outermost ones
+    static constexpr size_t max_depth = 1024;
+
+    // The branch_taken hook of Intel8086::run(). Returns true if a frame was
+    // pushed.
+    template<typename F>
+    bool branch_taken(const Intel8086& x86, const Instruction& branch, u32 address, F&& dropped);
+    bool branch_taken(const Intel8086& x86, const Instruction& branch, u32 address) {
+        return branch_taken(x86, branch, address, [](const Frame&, const Frame*) {});
+    }
+    // Drops the frames whose return address isn't on the guest stack anymore
+    template<typename F>
+    void unwind(const Intel8086& x86, F&& dropped) { unwind(stack_top(x86), dropped); }
+    void unwind(const Intel8086& x86) {
+        unwind(x86, [](const Frame&, const Frame*) {});
+    }
+    // Drops all frames, the innermost first
+    template<typename F>
+    void clear(F&& dropped) { unwind(UINT32_MAX, dropped); }
+
+    // The outermost first
+    std::span<const Frame> get_frames() const { return frames; }
+
+private:
+    std::vector<Frame> frames;
+
+    static u32 stack_top(const Intel8086& x86) {
+        return Intel8086::physical_address(x86.get(Register::ss), x86.get(Register::sp));
+    }
+    template<typename F>
+    void unwind(u32 top, F& dropped) {
+        while (!frames.empty() && frames.back().stack < top) {
+            auto frame = frames.back();
+            frames.pop_back();
+            dropped(frame, frames.empty() ? nullptr : &frames.back());
+        }
+    }
+};
+
+template<typename F>
+bool ShadowCallStack::branch_taken(const Intel8086& x86, const Instruction& branch, u32 address, F&& dropped) {
+    using enum Instruction::Type;
+    using T = std::underlying_type_t<Instruction::Type>;
+    auto t = static_cast<T>(branch.type);
+    bool jump = branch.type == Jmp || (static_cast<T>(Jo) <= t && t <= static_cast<T>(Jcxz));
+    if (jump || branch.type == Ret || branch.type == Iret) {
+        unwind(x86, dropped);
+        return false;
+    }
+
+    // Calls, software interrupts and exceptions. Frames at or below the new
+    // return address were abandoned.
+    auto top = stack_top(x86);
+    unwind(top + 1, dropped);
+    if (frames.size() == max_depth) {
+        dropped(frames.front(), nullptr);
+        frames.erase(frames.begin());
+    }
+    frames.push_back({ x86.get_physical_ip(), address, top, x86.get_instruction_count(), x86.get_cycle_count() });
+    return true;
+}
+
+// Samples the ip and the shadow call stack of a run every period of emulated
+// cycles or instructions. Cycle periods are delivered by the scheduler and
+// instruction periods run the emulator in slices, so sampling doesn't add to
+// the per-instruction path, only the shadow call stack is kept at the end of
+// blocks that transfer control. Like the scheduler, samples are taken at the
+// ends of blocks.
+class SamplingProfiler {
+public:
+    enum class Clock {
+        Cycles,
+        Instructions,
+    };
+
+    struct Options {
+        u64 period = 10'000;
+        Clock clock = Clock::Cycles;
+    };
+
+    explicit SamplingProfiler(const Options& options) : options(options) { assert(options.period > 0); }
+
+    // Runs the emulator like Intel8086::run()
+    error_code run(Intel8086& x86, const Intel8086::RunOptions& run_options);
+
+    // A line per distinct stack in the collapsed format of flame graph
+    // tools: the function addresses from the outermost one and the sampled
+    // address, separated by semicolons, and the number of samples
+    error_code write_collapsed_stacks(const char* filename) const;
+    // The number of samples of every sampled address, the most sampled first
+    error_code write_histogram(const char* filename) const;
+
+    u64 get_sample_count() const { return sample_count; }
+    const std::map<std::vector<u32>, u64>& get_stacks() const { return stacks; }
+    const std::unordered_map<u32, u64>& get_histogram() const { return histogram; }
+
+    // Hook of Intel8086::run()
+    void branch_taken(Intel8086& x86, const Instruction& branch, u32 address) {
+        call_stack.branch_taken(x86, branch, address);
+    }
+
+private:
+    Options options;
+    ShadowCallStack call_stack;
+    // Function addresses and the sampled address
+    std::map<std::vector<u32>, u64> stacks;
+    std::unordered_map<u32, u64> histogram;
+    u64 sample_count = 0;
+    std::vector<u32> stack;
+
+    void sample(const Intel8086& x86);
+};
+
+// Counts the instructions and cycles spent in every guest function, by the
+// physical address of its entry, from a shadow call stack. Exclusive counts
+// go to the innermost function, inclusive counts to every function on the
+// shadow stack, counted once for recursive calls. Code outside of any call
+// belongs to the address where the first run started. Calls that are still
+// open when a run ends are counted up to there, so every run starts with an
+// empty call stack.
+class CallGraphProfiler {
+public:
+    struct Function {
+        u64 calls = 0;
+        u64 self_instructions = 0;
+        u64 self_cycles = 0;
+        u64 total_instructions = 0;
+        u64 total_cycles = 0;
+    };
+    // Calls from one function to another, with the inclusive counts of the
+    // callee
+    struct Call {
+        u64 count = 0;
+        u64 instructions = 0;
+        u64 cycles = 0;
+    };
+
+    // Runs the emulator like Intel8086::run()
+    error_code run(Intel8086& x86, const Intel8086::RunOptions& run_options);
+
+    // The functions by their inclusive cycles, each with its callers and
+    // callees
+    error_code write_report(const char* filename) const;
+
+    const std::unordered_map<u32, Function>& get_functions() const { return functions; }
+    // By caller and callee
+    const std::map<std::pair<u32, u32>, Call>& get_calls() const { return calls; }
+    std::optional<u32> get_root() const { return root; }
+
+    // Hook of Intel8086::run()
+    void branch_taken(Intel8086& x86, const Instruction& branch, u32 address);
+
+private:
+    using Frame = ShadowCallStack::Frame;
+
+    ShadowCallStack call_stack;
+    std::unordered_map<u32, Function> functions;
+    std::map<std::pair<u32, u32>, Call> calls;
+    // Frames of every function on the shadow stack, for recursion
+    std::unordered_map<u32, u32> active;
+    std::optional<u32> root;
+    // The counters at the previous change of the innermost function
+    u64 instruction_count = 0;
+    u64 cycle_count = 0;
+
+    // Adds the counts since the previous change to the innermost function
+    void count_self(const Intel8086& x86);
+    void leave(const Intel8086& x86, const Frame& frame, const Frame* caller);
+};
@@ -0,0 +1,112 @@
+#include "reverse_debugger.hpp"
+#include <algorithm>
+#include <fmt/core.h>
+
+static size_t undo_log_size(const Intel8086::UndoLog& log) {
+    return log.data.size() + log.pages.size() * sizeof(u32);
+}
+
+ReverseDebugger::ReverseDebugger(Intel8086& x86, const Options& options) : x86(x86), options(options) {
+    assert(options.interval > 0);
+    take_checkpoint();
+}
+
+ReverseDebugger::~ReverseDebugger() {
+    x86.set_undo_log(nullptr);
+}
+
+expected<Intel8086::ExecuteResult, error_code> ReverseDebugger::step() {
+    UNWRAP(auto result, x86.step(options.estimate_cycles));
+    if (x86.get_instruction_count() - checkpoints.back().instruction_count >= options.interval) take_checkpoint();
+    return result;
+}
+
+expected<bool, error_code> ReverseDebugger::reverse_step() {
+    auto current = x86.get_instruction_count();
+    if (current == get_oldest_instruction()) return false;
+    if (auto e = go_to(current - 1)) return unexpected(e);
+    return true;
+}
+
+expected<bool, error_code> ReverseDebugger::reverse_continue(u32 address) {
+    // Each interval is executed again from its checkpoint, from the latest
+    // one back, to find the last time the address was reached
+    auto current = x86.get_instruction_count();
+    auto end = current;
+    for (size_t i = checkpoints.size(); i-- > 0;) {
+        if (checkpoints[i].instruction_count >= end) continue;
+        restore_checkpoint(i);
+        std::optional<u64> found;
+        while (x86.get_instruction_count() < end) {
+            auto count = x86.get_instruction_count();
+            if (x86.get_physical_ip() == address) found = count;
+            UNWRAP(auto result, step());
+            (void)result;
+            if (x86.get_instruction_count() == count) break;
+        }
+        if (found) {
+            if (auto e = go_to(*found)) return unexpected(e);
+            return true;
+        }
+        end = checkpoints[i].instruction_count;
+    }
+    if (auto e = go_to(current)) return unexpected(e);
+    return false;
+}
+
+error_code ReverseDebugger::go_to(u64 instruction_count) {
+    if (instruction_count < get_oldest_instruction()) {
+        fflush(stdout);
+        fmt::print(stderr, "Instruction {} is before the oldest checkpoint at {}\n", instruction_count, get_oldest_instruction());
+        return Errc::EmulationError;
+    }
+    if (instruction_count < x86.get_instruction_count()) {
+        auto newer = std::upper_bound(checkpoints.begin(), checkpoints.end(), instruction_count,
+                                      [](u64 count, const Checkpoint& c) { return count < c.instruction_count; });
+        restore_checkpoint(static_cast<size_t>(newer - checkpoints.begin()) - 1);
+    }
+    return run_to(instruction_count);
+}
+
+void ReverseDebugger::take_checkpoint() {
+    if (!checkpoints.empty()) memory_used += undo_log_size(checkpoints.back().undo);
+    auto& checkpoint = checkpoints.emplace_back();
+    while (checkpoints.size() > 1 && memory_used > options.memory_limit) {
+        memory_used -= undo_log_size(checkpoints.front().undo);
+        checkpoints.pop_front();
+    }
+
+    checkpoint.instruction_count = x86.get_instruction_count();
+    checkpoint.cycle_count = x86.get_cycle_count();
+    checkpoint.registers = x86.get_registers();
+    checkpoint.ip = x86.get_ip();
+    checkpoint.flags = x86.get_flags();
+    x86.set_undo_log(&checkpoint.undo);
+}
+
+void ReverseDebugger::restore_checkpoint(size_t index) {
+    // Undone from the newest, so each page ends up as it was at the checkpoint
+    x86.set_undo_log(nullptr);
+    for (size_t i = checkpoints.size(); i-- > index;) {
+        x86.undo(checkpoints[i].undo);
+        if (i + 1 < checkpoints.size()) memory_used -= undo_log_size(checkpoints[i].undo);
+    }
+    checkpoints.erase(checkpoints.begin() + static_cast<std::ptrdiff_t>(index) + 1, checkpoints.end());
+
+    auto& checkpoint = checkpoints.back();
+    x86.set_registers(checkpoint.registers);
+    x86.set_ip(checkpoint.ip);
+    x86.set_flags(checkpoint.flags);
+    x86.set_counts(checkpoint.instruction_count, checkpoint.cycle_count);
+    x86.set_undo_log(&checkpoint.undo);
+}
+
+error_code ReverseDebugger::run_to(u64 instruction_count) {
+    while (x86.get_instruction_count() < instruction_count) {
+        auto count = x86.get_instruction_count();
+        UNWRAP_BARE(auto result, step());
+        (void)result;
+        if (x86.get_instruction_count() == count) break;
+    }
+    return {};
+}
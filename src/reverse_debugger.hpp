@@ -0,0 +1,71 @@
+#pragma once
+
+#include "common.hpp"
+#include <deque>
+
+#include "emulator.hpp"
+
+// Steps an emulator forward and backward. Every interval instructions a
+// checkpoint keeps the registers, and the memory is tracked with an undo log
+// of the pages written until the next checkpoint. Going back restores the
+// nearest checkpoint before the target and executes forward from it.
+//
+// The oldest checkpoints are dropped when the undo logs exceed the memory
+// limit, so the history reaches back at least one interval. Devices and host
+// interrupt handlers aren't rolled back, so executing again only gives the
+// same results if their reads can be repeated.
+class ReverseDebugger {
+public:
+    struct Options {
+        u64 interval = 100'000;
+        // Bytes of undo logs kept, not counting the one being written
+        size_t memory_limit = 64 << 20;
+        bool estimate_cycles = false;
+    };
+
+    // Takes the first checkpoint, the emulator has to outlive the debugger
+    ReverseDebugger(Intel8086& x86, const Options& options);
+    ReverseDebugger(const ReverseDebugger&) = delete;
+    ReverseDebugger(ReverseDebugger&&) = delete;
+    ReverseDebugger& operator=(const ReverseDebugger&) = delete;
+    ReverseDebugger& operator=(ReverseDebugger&&) = delete;
+    ~ReverseDebugger();
+
+    // Executes one instruction
+    expected<Intel8086::ExecuteResult, error_code> step();
+    // Goes back one instruction. Returns false at the oldest checkpoint.
+    expected<bool, error_code> reverse_step();
+    // Goes back to the latest point where the instruction at the physical
+    // address was about to be executed. Returns false, and stays, if it
+    // wasn't executed since the oldest checkpoint.
+    expected<bool, error_code> reverse_continue(u32 address);
+    // Goes to an instruction count between the oldest checkpoint and the
+    // furthest point executed so far
+    error_code go_to(u64 instruction_count);
+
+    u64 get_oldest_instruction() const { return checkpoints.front().instruction_count; }
+    size_t get_checkpoint_count() const { return checkpoints.size(); }
+    size_t get_memory_used() const { return memory_used; }
+
+private:
+    struct Checkpoint {
+        u64 instruction_count = 0;
+        u64 cycle_count = 0;
+        std::array<u16, 12> registers = {};
+        u16 ip = 0;
+        Intel8086::Flags flags;
+        // The pages written until the next checkpoint, as they were here
+        Intel8086::UndoLog undo;
+    };
+
+    Intel8086& x86;
+    Options options;
+    // The last one is the one being logged
+    std::deque<Checkpoint> checkpoints;
+    size_t memory_used = 0;
+
+    void take_checkpoint();
+    void restore_checkpoint(size_t index);
+    // Steps forward to the instruction count, stopping early at a halt
+    error_code run_to(u64 instruction_count);
+};
@@ -0,0 +1,100 @@
+#include "scheduler.hpp"
+#include <algorithm>
+
+static Scheduler::EventId make_event_id(u32 slot, u32 generation) {
+    return (static_cast<u64>(generation) << 32) | slot;
+}
+
+Scheduler::EventId Scheduler::schedule(u64 deadline, Callback callback) {
+    return schedule_periodic(deadline, 0, std::move(callback));
+}
+
+Scheduler::EventId Scheduler::schedule_periodic(u64 first_deadline, u64 period, Callback callback) {
+    u32 slot = 0;
+    if (free_slots.empty()) {
+        slot = static_cast<u32>(slots.size());
+        slots.emplace_back();
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    auto& s = slots[slot];
+    s.callback = std::move(callback);
+    s.period = period;
+    s.active = true;
+    ++pending;
+
+    push(first_deadline, slot);
+    return make_event_id(slot, s.generation);
+}
+
+bool Scheduler::cancel(EventId id) {
+    u32 slot = id & 0xffff'ffff;
+    u32 generation = id >> 32;
+    if (slot >= slots.size()) return false;
+
+    auto& s = slots[slot];
+    if (!s.active || s.generation != generation) return false;
+
+    // The heap entry is left in place and skipped when it reaches the top
+    release(slot);
+    return true;
+}
+
+void Scheduler::run_due(u64 now) {
+    while (!heap.empty() && heap.front().deadline <= now) {
+        auto event = heap.front();
+        pop();
+
+        auto& s = slots[event.slot];
+        if (!s.active || s.generation != event.generation) continue;
+
+        if (s.period == 0) {
+            auto callback = std::move(s.callback);
+            release(event.slot);
+            callback(event.deadline);
+            continue;
+        }
+
+        // The callback may schedule new events and reallocate the slots
+        auto callback = std::move(s.callback);
+        callback(event.deadline);
+
+        auto& rescheduled = slots[event.slot];
+        if (!rescheduled.active || rescheduled.generation != event.generation) continue;
+        rescheduled.callback = std::move(callback);
+        push(event.deadline + rescheduled.period, event.slot);
+    }
+
+    update_next_deadline();
+}
+
+bool Scheduler::later(const Event& a, const Event& b) {
+    if (a.deadline != b.deadline) return a.deadline > b.deadline;
+    return a.sequence > b.sequence;
+}
+
+void Scheduler::push(u64 deadline, u32 slot) {
+    heap.push_back({ deadline, sequence++, slot, slots[slot].generation });
+    std::push_heap(heap.begin(), heap.end(), later);
+    update_next_deadline();
+}
+
+void Scheduler::pop() {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    heap.pop_back();
+}
+
+void Scheduler::update_next_deadline() {
+    next_deadline = heap.empty() ? never : heap.front().deadline;
+}
+
+void Scheduler::release(u32 slot) {
+    auto& s = slots[slot];
+    s.callback = nullptr;
+    s.active = false;
+    ++s.generation;
+    --pending;
+    free_slots.push_back(slot);
+}
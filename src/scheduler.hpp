@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.hpp"
+#include <functional>
+#include <limits>
+#include <vector>
+
+// Events keyed on the emulated cycle counter, kept in a binary min-heap.
+// Intel8086::run compares the cycle counter against next_event_cycle() once
+// per block, so an event is delivered at the end of the block during which its
+// deadline passed. The callback is given the deadline it was scheduled for, so
+// devices can keep exact time regardless of the block length.
+class Scheduler {
+public:
+    using EventId = u64;
+    using Callback = std::function<void(u64 deadline)>;
+
+    static constexpr u64 never = std::numeric_limits<u64>::max();
+
+    EventId schedule(u64 deadline, Callback callback);
+    // The event is rescheduled relative to its previous deadline, so a
+    // periodic event does not drift even if it is delivered late.
+    EventId schedule_periodic(u64 first_deadline, u64 period, Callback callback);
+    bool cancel(EventId id);
+
+    u64 next_event_cycle() const { return next_deadline; }
+    bool empty() const { return pending == 0; }
+
+    void run_due(u64 now);
+
+private:
+    struct Event {
+        u64 deadline;
+        u64 sequence;
+        u32 slot;
+        u32 generation;
+    };
+    struct Slot {
+        Callback callback;
+        u64 period = 0;
+        u32 generation = 0;
+        bool active = false;
+    };
+
+    std::vector<Event> heap;
+    std::vector<Slot> slots;
+    std::vector<u32> free_slots;
+    u64 sequence = 0;
+    u64 next_deadline = never;
+    u32 pending = 0;
+
+    static bool later(const Event& a, const Event& b);
+    void push(u64 deadline, u32 slot);
+    void pop();
+    void update_next_deadline();
+    void release(u32 slot);
+};
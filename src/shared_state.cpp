@@ -0,0 +1,81 @@
+#include "shared_state.hpp"
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fmt/core.h>
+
+static constexpr size_t object_size = SharedState::memory_offset + Intel8086::memory_size;
+
+// The state is copied a word at a time with relaxed atomics, which the
+// sequence lock orders, so concurrent readers never race with the writer
+static_assert(sizeof(SharedState::State) % sizeof(u64) == 0 && alignof(SharedState::State) == alignof(u64));
+static constexpr size_t state_words = sizeof(SharedState::State) / sizeof(u64);
+
+static void copy_state(SharedState::State& destination, const SharedState::State& source) {
+    auto* d = reinterpret_cast<u64*>(&destination);
+    auto* s = reinterpret_cast<u64*>(const_cast<SharedState::State*>(&source));
+    for (size_t i = 0; i < state_words; ++i) {
+        std::atomic_ref(d[i]).store(std::atomic_ref(s[i]).load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
+
+expected<SharedState, error_code> SharedState::create(const char* name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fmt::print(stderr, "Couldn't create shared memory object {}\n", name);
+        return make_unexpected_errno();
+    }
+    DEFER { close(fd); };
+
+    if (ftruncate(fd, object_size) != 0) {
+        auto e = make_unexpected_errno();
+        shm_unlink(name);
+        return e;
+    }
+    void* address = mmap(nullptr, object_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        auto e = make_unexpected_errno();
+        shm_unlink(name);
+        return e;
+    }
+
+    auto* header = new (address) Header;
+    header->memory_offset = memory_offset;
+    header->memory_size = Intel8086::memory_size;
+    return SharedState(name, static_cast<u8*>(address));
+}
+
+SharedState::~SharedState() {
+    if (!address) return;
+    munmap(address, object_size);
+    shm_unlink(name.data());
+}
+
+void SharedState::publish(const Intel8086& x86) {
+    State state;
+    state.instruction_count = x86.get_instruction_count();
+    state.cycle_count = x86.get_cycle_count();
+    state.registers = x86.get_registers();
+    state.ip = x86.get_ip();
+    state.flags = x86.get_flags().word;
+
+    auto& sequence = header().sequence;
+    auto s = sequence.load(std::memory_order_relaxed);
+    sequence.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    copy_state(header().state, state);
+    sequence.store(s + 2, std::memory_order_release);
+}
+
+SharedState::State SharedState::read(const Header& header) {
+    State state;
+    while (true) {
+        auto before = header.sequence.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        copy_state(state, header.state);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header.sequence.load(std::memory_order_relaxed) == before) return state;
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "common.hpp"
+#include <atomic>
+#include <string>
+#include <utility>
+
+#include "emulator.hpp"
+
+// The guest memory and a header with the CPU state in a POSIX shared memory
+// object, so external tools can map it and watch a run live. The memory is
+// used by the emulator in place, while the header is published from time to
+// time, e.g. from a periodic scheduler event.
+//
+// The header is guarded by a sequence lock: the sequence is odd while the
+// state is being written, and readers retry until they see the same even
+// sequence before and after copying the state.
+class SharedState {
+public:
+    struct State {
+        u64 instruction_count = 0;
+        u64 cycle_count = 0;
+        // In the order of Intel8086::get_registers()
+        std::array<u16, 12> registers = {};
+        u16 ip = 0;
+        u16 flags = 0;
+    };
+
+    struct Header {
+        static constexpr std::array<char, 4> signature = { 'X', '8', '6', 'S' };
+        static constexpr u32 current_version = 1;
+
+        std::array<char, 4> magic = signature;
+        u32 version = current_version;
+        // Offset of the guest memory from the start of the object
+        u32 memory_offset = 0;
+        u32 memory_size = 0;
+        std::atomic<u32> sequence = 0;
+        State state;
+    };
+    static_assert(std::atomic<u32>::is_always_lock_free);
+
+    // The memory starts at the first host page after the header
+    static constexpr u32 memory_offset = 4096;
+    static_assert(sizeof(Header) <= memory_offset);
+
+    // Creates the shared memory object, the name has to start with a slash.
+    // The name is removed when the state is destroyed, which doesn't affect
+    // the mappings of readers.
+    static expected<SharedState, error_code> create(const char* name);
+
+    SharedState(const SharedState&) = delete;
+    SharedState(SharedState&& other) noexcept
+        : name(std::move(other.name)), address(std::exchange(other.address, nullptr)) {}
+    SharedState& operator=(const SharedState&) = delete;
+    SharedState& operator=(SharedState&& other) noexcept {
+        std::swap(name, other.name);
+        std::swap(address, other.address);
+        return *this;
+    }
+    ~SharedState();
+
+    // Storage for Intel8086::move_memory_to()
+    std::span<u8> get_memory() const { return { address + memory_offset, Intel8086::memory_size }; }
+
+    // Writes the current state of the CPU to the header
+    void publish(const Intel8086& x86);
+    // Copies a consistent state out of a mapped header
+    static State read(const Header& header);
+
+private:
+    SharedState(std::string name, u8* address) : name(std::move(name)), address(address) {}
+
+    std::string name;
+    u8* address = nullptr;
+
+    Header& header() const { return *reinterpret_cast<Header*>(address); }
+};
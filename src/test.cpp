@@ -1,14 +1,31 @@
 #include "common.hpp"
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <limits>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fmt/core.h>
+#include <fmt/ranges.h>
 
 #include "program.hpp"
 #include "emulator.hpp"
+#include "emulator_run.hpp"
+#include "dos_services.hpp"
+#include "disk.hpp"
+#include "framebuffer.hpp"
+#include "memory_dump.hpp"
+#include "shared_state.hpp"
+#include "trace.hpp"
+#include "reverse_debugger.hpp"
+#include "checkpoint_file.hpp"
+#include "profiler.hpp"
+#include "fuzzer.hpp"
 
 static expected<std::string, error_code> read_file(const std::string& filename) {
     auto file = fopen(filename.data(), "rb");
@@ -140,31 +157,31 @@ static error_code test_emulator(const std::string& program_filename, const std::
             for (auto f : expected_flags_string) {
                 switch (f) {
                     case 'C':
-                        expected_flags.c = true;
+                        expected_flags.set(Intel8086::Flags::carry, true);
                         break;
                     case 'P':
-                        expected_flags.p = true;
+                        expected_flags.set(Intel8086::Flags::parity, true);
                         break;
                     case 'A':
-                        expected_flags.a = true;
+                        expected_flags.set(Intel8086::Flags::auxiliary, true);
                         break;
                     case 'Z':
-                        expected_flags.z = true;
+                        expected_flags.set(Intel8086::Flags::zero, true);
                         break;
                     case 'S':
-                        expected_flags.s = true;
+                        expected_flags.set(Intel8086::Flags::sign, true);
                         break;
                     case 'O':
-                        expected_flags.o = true;
+                        expected_flags.set(Intel8086::Flags::overflow, true);
                         break;
                     case 'I':
-                        expected_flags.i = true;
+                        expected_flags.set(Intel8086::Flags::interrupt, true);
                         break;
                     case 'D':
-                        expected_flags.d = true;
+                        expected_flags.set(Intel8086::Flags::direction, true);
                         break;
                     case 'T':
-                        expected_flags.t = true;
+                        expected_flags.set(Intel8086::Flags::trap, true);
                         break;
                     default:
                         fflush(stdout);
@@ -218,6 +235,1172 @@ static error_code test_emulator(const std::string& program_filename, const std::
     return ret;
 }
 
+static error_code test_scheduler() {
+    fmt::print("Testing scheduler\n");
+
+    // mov cx, 1000; loop $
+    constexpr std::array<u8, 5> program = { 0xb9, 0xe8, 0x03, 0xe2, 0xfe };
+    Intel8086 x86(program);
+    auto& scheduler = x86.get_scheduler();
+
+    std::vector<u64> fired;
+    scheduler.schedule(300, [&](u64 deadline) { fired.push_back(deadline); });
+    scheduler.schedule(100, [&](u64 deadline) { fired.push_back(deadline); });
+    auto cancelled = scheduler.schedule(200, [&](u64 deadline) { fired.push_back(deadline); });
+    u64 ticks = 0;
+    scheduler.schedule_periodic(50, 50, [&](u64 deadline) {
+        if (deadline == (ticks + 1) * 50) ++ticks;
+    });
+    if (!scheduler.cancel(cancelled) || scheduler.cancel(cancelled)) {
+        fflush(stdout);
+        fmt::print(stderr, "Cancelling a scheduled event failed\n");
+        return Errc::EmulationError;
+    }
+
+    RET_IF(x86.run());
+
+    if (fired != std::vector<u64>{ 100, 300 }) {
+        fflush(stdout);
+        fmt::print(stderr, "Scheduled events fired in wrong order or at wrong deadlines\n");
+        return Errc::EmulationError;
+    }
+    if (ticks != x86.get_cycle_count() / 50) {
+        fflush(stdout);
+        fmt::print(stderr, "Periodic event fired {} times in {} cycles\n", ticks, x86.get_cycle_count());
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_port_io() {
+    fmt::print("Testing port I/O\n");
+
+    struct Latch final : PortDevice {
+        u16 value = 0;
+        u16 last_port = 0;
+        u16 in(u16 port, bool wide) override { last_port = port; return wide ? value : value & 0xff; }
+        void out(u16 port, u16 v, bool wide) override { last_port = port; value = wide ? v : (v & 0xff); }
+    } latch;
+
+    // mov al, 0x42; out 0x10, al; mov dx, 0x1234; in ax, dx; mov bx, ax; in ax, 0x99
+    constexpr std::array<u8, 12> program = { 0xb0, 0x42, 0xe6, 0x10, 0xba, 0x34, 0x12, 0xed, 0x89, 0xc3, 0xe5, 0x99 };
+    Intel8086 x86(program);
+    x86.map_ports(0x10, 0x10, latch);
+    x86.map_ports(0x1234, 0x1235, latch);
+    RET_IF(x86.run());
+
+    if (latch.value != 0x42 || latch.last_port != 0x1234 || x86.get(Register::bx) != 0x42 || x86.get(Register::ax) != 0xffff) {
+        fflush(stdout);
+        fmt::print(stderr, "Port I/O returned unexpected values\n");
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_memory_mapping() {
+    fmt::print("Testing memory mapped I/O\n");
+
+    struct Recorder final : MemoryDevice {
+        std::vector<std::pair<u32, u8>> writes;
+        u8 read(u32 address) override { return address & 0xff; }
+        void write(u32 address, u8 value) override { writes.emplace_back(address, value); }
+    } recorder;
+
+    // mov byte [0x1000], 0x12; mov al, [0x1000]; mov word [0x2000], 0xbeef; mov bx, [0x2002]
+    constexpr std::array<u8, 19> program = {
+        0xc6, 0x06, 0x00, 0x10, 0x12, 0x8a, 0x06, 0x00, 0x10, 0xc7,
+        0x06, 0x00, 0x20, 0xef, 0xbe, 0x8b, 0x1e, 0x02, 0x20,
+    };
+    Intel8086 x86(program);
+    x86.map_rom(0x1000, Intel8086::page_size);
+    x86.map_mmio(0x2000, Intel8086::page_size, recorder);
+    RET_IF(x86.run());
+
+    decltype(recorder.writes) expected_writes = { { 0x2000, 0xef }, { 0x2001, 0xbe } };
+    if (x86.get(Register::al) != 0 || x86.get(Register::bx) != 0x0302 || recorder.writes != expected_writes) {
+        fflush(stdout);
+        fmt::print(stderr, "Memory mapped accesses returned unexpected values\n");
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_snapshot_restore() {
+    fmt::print("Testing snapshot and restore\n");
+
+    // mov word [0x1000], 0x1234; mov ax, 5; mov word [0x3000], ax
+    constexpr std::array<u8, 12> program = { 0xc7, 0x06, 0x00, 0x10, 0x34, 0x12, 0xb8, 0x05, 0x00, 0xa3, 0x00, 0x30 };
+    Intel8086 x86(program);
+    auto snapshot = x86.snapshot();
+
+    for (i32 i = 0; i < 2; ++i) {
+        RET_IF(x86.run());
+        if (x86.read_word(0x1000) != 0x1234 || x86.read_word(0x3000) != 5) {
+            fflush(stdout);
+            fmt::print(stderr, "Program didn't run after restoring a snapshot\n");
+            return Errc::EmulationError;
+        }
+
+        x86.restore(snapshot);
+        if (x86.read_word(0x1000) != 0 || x86.read_word(0x3000) != 0 || x86.get(Register::ax) != 0 || x86.get_ip() != 0) {
+            fflush(stdout);
+            fmt::print(stderr, "Restoring a snapshot didn't restore the state\n");
+            return Errc::EmulationError;
+        }
+    }
+
+    return {};
+}
+
+static error_code test_fuzzer() {
+    fmt::print("Testing the fuzzer\n");
+
+    // mov al, [0x100]; cmp al, 0x10; jb done; cmp al, 0x80; jb done
+    // push ax (not implemented)
+    // done: hlt
+    constexpr std::array<u8, 13> program = { 0xa0, 0x00, 0x01, 0x3c, 0x10, 0x72, 0x05, 0x3c, 0x80, 0x72, 0x01, 0x50, 0xf4 };
+    Intel8086 x86(program);
+    UNWRAP_BARE(auto result, fuzz_program(x86, { .input_address = 0x100, .input_size = 1, .max_cycles = 1000, .iterations = 50 }));
+
+    // The initial input of 0 and at least one that passes the first branch
+    if (result.executions != 50 || result.timeouts != 0 || result.corpus.size() < 2 || result.covered_edges < 2) {
+        fflush(stdout);
+        fmt::print(stderr, "The fuzzer didn't find new coverage\n");
+        return Errc::EmulationError;
+    }
+    if (result.crashes.empty()) {
+        fflush(stdout);
+        fmt::print(stderr, "The fuzzer didn't collect the crashing inputs\n");
+        return Errc::EmulationError;
+    }
+    for (const auto& crash : result.crashes) {
+        if (crash.size() != 1 || crash[0] < 0x80) return Errc::EmulationError;
+    }
+    for (const auto& input : result.corpus) {
+        if (input[0] >= 0x80) return Errc::EmulationError;
+    }
+
+    // The snapshot was restored after the last iteration
+    if (x86.get_ip() != 0 || x86.read_byte(0x100) != 0) return Errc::EmulationError;
+    return {};
+}
+
+static error_code write_test_file(const char* filename, std::span<const u8> data) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return make_error_code_errno();
+    auto written = fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+    return written == data.size() ? error_code{} : make_error_code_errno();
+}
+
+static error_code test_dos_services() {
+    fmt::print("Testing DOS services\n");
+
+    constexpr const char* data_filename = "x86-emulator.dos-test.data";
+    constexpr std::string_view data = "from a file";
+    RET_IF(write_test_file(data_filename, { reinterpret_cast<const u8*>(data.data()), data.size() }));
+    DEFER { remove(data_filename); };
+
+    FILE* console = tmpfile();
+    if (!console) return make_error_code_errno();
+    DEFER { fclose(console); };
+
+    // mov ah, 9; mov dx, 0x30; int 0x21
+    // mov ax, 0x3d00; mov dx, 0x8000; int 0x21
+    // mov bx, ax; mov ah, 0x3f; mov cx, 16; mov dx, 0x9000; int 0x21
+    // mov cx, ax; mov ah, 0x40; mov bx, 1; int 0x21
+    // mov ax, 0x4c07; int 0x21
+    constexpr std::array<u8, 41> program = {
+        0xb4, 0x09, 0xba, 0x30, 0x00, 0xcd, 0x21, 0xb8, 0x00, 0x3d, 0xba, 0x00, 0x80, 0xcd,
+        0x21, 0x89, 0xc3, 0xb4, 0x3f, 0xb9, 0x10, 0x00, 0xba, 0x00, 0x90, 0xcd, 0x21, 0x89,
+        0xc1, 0xb4, 0x40, 0xbb, 0x01, 0x00, 0xcd, 0x21, 0xb8, 0x07, 0x4c, 0xcd, 0x21,
+    };
+    Intel8086 x86(program);
+    constexpr std::string_view message = "Read $";
+    for (u32 i = 0; i < message.size(); ++i) x86.write_byte(0x30 + i, message[i]);
+    for (u32 i = 0; data_filename[i]; ++i) x86.write_byte(0x8000 + i, data_filename[i]);
+
+    {
+        DosServices dos(console);
+        dos.map(x86);
+        RET_IF(x86.run());
+
+        if (dos.get_exit_code() != 7) {
+            fflush(stdout);
+            fmt::print(stderr, "Program didn't exit through DOS\n");
+            return Errc::EmulationError;
+        }
+    }
+
+    rewind(console);
+    std::array<char, 64> buffer = {};
+    std::string output(buffer.data(), fread(buffer.data(), 1, buffer.size(), console));
+    if (output != "Read from a file") {
+        fflush(stdout);
+        fmt::print(stderr, "Unexpected console output '{}'\n", output);
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_dos_program_loading() {
+    fmt::print("Testing DOS program loading\n");
+
+    FILE* console = tmpfile();
+    if (!console) return make_error_code_errno();
+    DEFER { fclose(console); };
+
+    {
+        // mov ah, 9; mov dx, 0x108; int 0x21; ret; db "COM $"
+        constexpr std::array<u8, 13> program = { 0xb4, 0x09, 0xba, 0x08, 0x01, 0xcd, 0x21, 0xc3, 'C', 'O', 'M', ' ', '$' };
+        constexpr const char* filename = "x86-emulator.test.com";
+        RET_IF(write_test_file(filename, program));
+        DEFER { remove(filename); };
+
+        Intel8086 x86;
+        DosServices dos(console);
+        dos.map(x86);
+        RET_IF(load_com_program(x86, filename));
+        RET_IF(x86.run());
+        if (dos.get_exit_code() != 0 || x86.get(Register::cs) != dos_psp_segment) {
+            fflush(stdout);
+            fmt::print(stderr, "The .COM program didn't return to the PSP\n");
+            return Errc::EmulationError;
+        }
+    }
+
+    {
+        // Header of two paragraphs with one relocation, the code segment at
+        // paragraph 0, data at paragraph 2 and the stack at paragraph 3:
+        // mov ax, data; mov ds, ax; mov ah, 9; mov dx, 0; int 0x21; mov ax, 0x4c03; int 0x21
+        std::array<u8, 68> program = {
+            'M', 'Z', 68, 0, 1, 0, 1, 0, 2, 0, 0, 0, 0xff, 0xff, 3, 0,
+            0, 1, 0, 0, 0, 0, 0, 0, 0x1c, 0, 0, 0, 1, 0, 0, 0,
+            0xb8, 0x02, 0x00, 0x8e, 0xd8, 0xb4, 0x09, 0xba, 0x00, 0x00, 0xcd, 0x21, 0xb8, 0x03, 0x4c, 0xcd,
+            0x21, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            'E', 'X', 'E', '$',
+        };
+        constexpr const char* filename = "x86-emulator.test.exe";
+        RET_IF(write_test_file(filename, program));
+        DEFER { remove(filename); };
+
+        Intel8086 x86;
+        DosServices dos(console);
+        dos.map(x86);
+        RET_IF(load_exe_program(x86, filename));
+
+        constexpr u16 load_segment = dos_psp_segment + 0x10;
+        if (x86.get(Register::cs) != load_segment || x86.get(Register::ss) != load_segment + 3 || x86.get(Register::sp) != 0x100) {
+            fflush(stdout);
+            fmt::print(stderr, "The .EXE program has unexpected initial registers\n");
+            return Errc::EmulationError;
+        }
+
+        RET_IF(x86.run());
+        if (dos.get_exit_code() != 3 || x86.get(Register::ds) != load_segment + 2) {
+            fflush(stdout);
+            fmt::print(stderr, "The .EXE program wasn't relocated\n");
+            return Errc::EmulationError;
+        }
+
+        // Headers with no pages or a last page over 512 bytes are rejected
+        // instead of wrapping the image size
+        for (auto [offset, value] : { std::pair<u32, u16>{ 0x04, 0 }, std::pair<u32, u16>{ 0x02, 513 } }) {
+            auto invalid = program;
+            invalid[offset] = static_cast<u8>(value);
+            invalid[offset + 1] = static_cast<u8>(value >> 8);
+            RET_IF(write_test_file(filename, invalid));
+            if (load_exe_program(x86, filename) != Errc::InvalidProgramFile) return Errc::EmulationError;
+        }
+    }
+
+    rewind(console);
+    std::array<char, 64> buffer = {};
+    std::string output(buffer.data(), fread(buffer.data(), 1, buffer.size(), console));
+    if (output != "COM EXE") {
+        fflush(stdout);
+        fmt::print(stderr, "Unexpected console output '{}'\n", output);
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_disk() {
+    fmt::print("Testing disk images\n");
+
+    // Boot sector, which reads sector 2 to 0000:8000 and writes itself to sector 3:
+    // mov ax, 0x0201; mov cx, 2; mov dx, 0x80; mov bx, 0x8000; int 0x13
+    // mov ax, 0x0301; mov cx, 3; mov bx, 0x7c00; int 0x13; hlt
+    constexpr std::array<u8, 26> boot_code = {
+        0xb8, 0x01, 0x02, 0xb9, 0x02, 0x00, 0xba, 0x80, 0x00, 0xbb, 0x00, 0x80, 0xcd,
+        0x13, 0xb8, 0x01, 0x03, 0xb9, 0x03, 0x00, 0xbb, 0x00, 0x7c, 0xcd, 0x13, 0xf4,
+    };
+    std::vector<u8> image(4 * Disk::sector_size);
+    std::copy(boot_code.begin(), boot_code.end(), image.begin());
+    image[510] = 0x55;
+    image[511] = 0xaa;
+    for (u32 i = 0; i < Disk::sector_size; ++i) image[Disk::sector_size + i] = i & 0xff;
+
+    constexpr const char* filename = "x86-emulator.test.img";
+    RET_IF(write_test_file(filename, image));
+    DEFER { remove(filename); };
+
+    {
+        Intel8086 x86;
+        UNWRAP_BARE(auto disk, Disk::open(filename, true));
+        disk.map(x86);
+        RET_IF(disk.boot(x86));
+        RET_IF(x86.run());
+
+        for (u32 i = 0; i < Disk::sector_size; ++i) {
+            if (x86.read_byte(0x8000 + i) != (i & 0xff)) {
+                fflush(stdout);
+                fmt::print(stderr, "Sector read from the disk differs at byte {}\n", i);
+                return Errc::EmulationError;
+            }
+        }
+    }
+
+    UNWRAP_BARE(auto written, read_program(filename));
+    if (!std::equal(image.begin(), image.begin() + Disk::sector_size, written.begin() + 2 * Disk::sector_size)) {
+        fflush(stdout);
+        fmt::print(stderr, "Sector written to the disk didn't reach the image file\n");
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_framebuffer() {
+    fmt::print("Testing the framebuffer\n");
+
+    // Sets color 5 to red through the DAC and draws one pixel with it:
+    // mov dx, 0x3c8; mov al, 5; out dx, al; inc dx; mov al, 63; out dx, al
+    // mov al, 0; out dx, al; out dx, al; mov byte [0x200], 5; hlt
+    constexpr std::array<u8, 20> program = {
+        0xba, 0xc8, 0x03, 0xb0, 0x05, 0xee, 0x42, 0xb0, 0x3f, 0xee,
+        0xb0, 0x00, 0xee, 0xee, 0xc6, 0x06, 0x00, 0x02, 0x05, 0xf4,
+    };
+    Intel8086 x86;
+    x86.load_program(program);
+    Framebuffer framebuffer(x86, { Framebuffer::Format::Indexed8, 0x200, 16, 16 });
+    framebuffer.map_ports(x86);
+    RET_IF(x86.run());
+
+    auto expect_pixel = [&](u32 pixel, std::array<u8, 3> color) -> error_code {
+        auto rgb = framebuffer.get_rgb().subspan(pixel * 3, 3);
+        if (!std::equal(rgb.begin(), rgb.end(), color.begin())) {
+            fflush(stdout);
+            fmt::print(stderr, "Pixel {} is {:02x}, expected {:02x}\n", pixel, fmt::join(rgb, ""), fmt::join(color, ""));
+            return Errc::EmulationError;
+        }
+        return {};
+    };
+
+    if (!framebuffer.update()) return Errc::EmulationError;
+    RET_IF(expect_pixel(0, { 0xff, 0x00, 0x00 }));
+    RET_IF(expect_pixel(1, { 0x00, 0x00, 0x00 }));
+
+    // Only frames after writes to the video memory differ
+    if (framebuffer.update()) {
+        fflush(stdout);
+        fmt::print(stderr, "The framebuffer changed without writes\n");
+        return Errc::EmulationError;
+    }
+    x86.write_byte(0x200 + 16 * 3, 2);
+    if (!framebuffer.update()) {
+        fflush(stdout);
+        fmt::print(stderr, "The framebuffer didn't change after a write\n");
+        return Errc::EmulationError;
+    }
+    RET_IF(expect_pixel(16 * 3, { 0x00, 0xaa, 0x00 }));
+    RET_IF(expect_pixel(0, { 0xff, 0x00, 0x00 }));
+
+    constexpr const char* filename = "x86-emulator.test.png";
+    RET_IF(framebuffer.write_image(filename, Framebuffer::ImageFormat::Png));
+    DEFER { remove(filename); };
+    UNWRAP_BARE(auto png, read_program(filename));
+    constexpr std::array<u8, 8> png_signature = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (png.size() < 8 || !std::equal(png_signature.begin(), png_signature.end(), png.begin())) {
+        fflush(stdout);
+        fmt::print(stderr, "The frame isn't a PNG file\n");
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_memory_dumps() {
+    fmt::print("Testing memory dumps\n");
+
+    Intel8086 x86;
+    x86.write_byte(0x00010, 0x12);
+    x86.write_byte(0x12345, 0x34);
+    x86.write_byte(0xfffff, 0x56);
+
+    auto expect_memory = [&](std::span<const u8> memory) -> error_code {
+        for (u32 address = 0; address < Intel8086::memory_size; ++address) {
+            if (memory[address] != x86.read_byte(address)) {
+                fflush(stdout);
+                fmt::print(stderr, "Memory read back from the dump differs at {:#07x}\n", address);
+                return Errc::EmulationError;
+            }
+        }
+        return {};
+    };
+    auto expect_page_count = [](const MemoryDumpReader& reader, u32 expected_count) -> error_code {
+        if (reader.get_header().page_count != expected_count) {
+            fflush(stdout);
+            fmt::print(stderr, "Dump record has {} pages, expected {}\n", reader.get_header().page_count, expected_count);
+            return Errc::EmulationError;
+        }
+        return {};
+    };
+
+    {
+        constexpr const char* filename = "x86-emulator.test.sparse";
+        RET_IF(write_sparse_dump(x86, filename));
+        DEFER { remove(filename); };
+
+        std::vector<u8> memory(Intel8086::memory_size);
+        UNWRAP_BARE(auto reader, MemoryDumpReader::open(filename));
+        UNWRAP_BARE(bool found, reader.apply_next(memory));
+        if (!found) return Errc::EmulationError;
+        RET_IF(expect_page_count(reader, 3));
+        RET_IF(expect_memory(memory));
+        UNWRAP_BARE(bool more, reader.apply_next(memory));
+        if (more) return Errc::EmulationError;
+    }
+
+    constexpr const char* filename = "x86-emulator.test.delta";
+    remove(filename);
+    DEFER { remove(filename); };
+    {
+        UNWRAP_BARE(auto writer, IncrementalDumpWriter::open(filename));
+        RET_IF(writer.append(x86));
+        x86.write_byte(0x12346, 0x78);
+        RET_IF(writer.append(x86));
+    }
+    {
+        // A reopened dump continues from the memory of its last record
+        UNWRAP_BARE(auto writer, IncrementalDumpWriter::open(filename));
+        x86.write_byte(0x00010, 0);
+        RET_IF(writer.append(x86));
+    }
+
+    std::vector<u8> memory(Intel8086::memory_size);
+    UNWRAP_BARE(auto reader, MemoryDumpReader::open(filename));
+    for (u32 expected_count : { 3, 1, 1 }) {
+        UNWRAP_BARE(bool found, reader.apply_next(memory));
+        if (!found) return Errc::EmulationError;
+        RET_IF(expect_page_count(reader, expected_count));
+    }
+    RET_IF(expect_memory(memory));
+    UNWRAP_BARE(bool more, reader.apply_next(memory));
+    if (more) return Errc::EmulationError;
+
+    // Only the last copy of each page is read when skipping to the end
+    std::vector<u8> last_memory(Intel8086::memory_size);
+    UNWRAP_BARE(auto last_reader, MemoryDumpReader::open(filename));
+    RET_IF(last_reader.apply_remaining(last_memory));
+    RET_IF(expect_memory(last_memory));
+
+    return {};
+}
+
+static error_code test_shared_state() {
+    fmt::print("Testing the shared memory state\n");
+
+    auto name = fmt::format("/x86-emulator.test.{}", getpid());
+    UNWRAP_BARE(auto shared_state, SharedState::create(name.data()));
+
+    // mov ax, 0x1234; mov [0x100], ax
+    constexpr std::array<u8, 6> program = { 0xb8, 0x34, 0x12, 0xa3, 0x00, 0x01 };
+    Intel8086 x86(program);
+    x86.move_memory_to(shared_state.get_memory());
+    RET_IF(x86.run());
+    shared_state.publish(x86);
+
+    // Map the object again, as an external viewer would
+    int fd = shm_open(name.data(), O_RDONLY, 0);
+    if (fd < 0) return make_error_code_errno();
+    DEFER { close(fd); };
+    size_t size = SharedState::memory_offset + Intel8086::memory_size;
+    void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED) return make_error_code_errno();
+    DEFER { munmap(view, size); };
+
+    const auto& header = *static_cast<const SharedState::Header*>(view);
+    auto state = SharedState::read(header);
+    const auto* memory = static_cast<const u8*>(view) + header.memory_offset;
+    if (header.magic != SharedState::Header::signature || header.memory_size != Intel8086::memory_size
+        || state.instruction_count != 2 || state.registers[0] != 0x1234 || state.ip != 6
+        || memory[0x100] != 0x34 || memory[0x101] != 0x12) {
+        fflush(stdout);
+        fmt::print(stderr, "Shared state doesn't match the emulator: {} instructions, ax {:#06x}, ip {:#06x}\n",
+            state.instruction_count, state.registers[0], state.ip);
+        return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_trace_replay() {
+    fmt::print("Testing trace recording and replay\n");
+
+    struct Counter final : PortDevice {
+        u16 value = 1;
+        u16 in(u16, bool) override { return value += 2; }
+        void out(u16, u16, bool) override {}
+    };
+    struct Handler final : InterruptHandler {
+        u8 calls = 0;
+        bool interrupt(Intel8086& x86, u8) override {
+            x86.write_byte(0x300 + calls, 0x70 + calls);
+            x86.set(Register::si, x86.get(Register::si) + 0x10);
+            ++calls;
+            return true;
+        }
+    };
+
+    // mov cx, 5; mov dx, 0x60
+    // top: in al, dx; add bl, al; int 0x80; loop top
+    // jmp over; nop; over: mov [0x200], bx
+    constexpr std::array<u8, 20> program = {
+        0xb9, 0x05, 0x00, 0xba, 0x60, 0x00, 0xec, 0x00, 0xc3, 0xcd,
+        0x80, 0xe2, 0xf9, 0xeb, 0x01, 0x90, 0x89, 0x1e, 0x00, 0x02,
+    };
+    auto make_emulator = [&](Intel8086& x86, Counter& counter, Handler& handler) {
+        x86.load_program(program);
+        x86.map_ports(0x60, 0x60, counter);
+        x86.map_interrupt(0x80, handler);
+    };
+
+    constexpr const char* filename = "x86-emulator.test.trace";
+    DEFER { remove(filename); };
+    Intel8086 recorded;
+    Counter counter;
+    Handler handler;
+    make_emulator(recorded, counter, handler);
+    {
+        UNWRAP_BARE(auto trace, TraceWriter::open(filename));
+        trace.start(recorded);
+        RET_IF(recorded.run());
+        recorded.set_trace(nullptr);
+        RET_IF(trace.flush());
+    }
+
+    auto expect_same_state = [](const Intel8086& replayed, const Intel8086& expected, u64 instruction) -> error_code {
+        if (replayed.get_registers() != expected.get_registers() || replayed.get_ip() != expected.get_ip()
+            || replayed.get_flags() != expected.get_flags()) {
+            fflush(stdout);
+            fmt::print(stderr, "Replayed state differs after {} instructions\n", instruction);
+            return Errc::EmulationError;
+        }
+        return {};
+    };
+
+    // Part way through the recording, compared with stepping the same program
+    {
+        UNWRAP_BARE(auto replayer, TraceReplayer::open(filename));
+        Intel8086 stepped;
+        Counter stepped_counter;
+        Handler stepped_handler;
+        make_emulator(stepped, stepped_counter, stepped_handler);
+        for (u64 instruction = 1; instruction <= 12; ++instruction) {
+            RET_IF(replayer->run_to(instruction));
+            UNWRAP_BARE(auto result, stepped.step());
+            (void)result;
+            RET_IF(expect_same_state(replayer->get_cpu(), stepped, instruction));
+        }
+    }
+
+    // The same trace written on a separate thread
+    constexpr const char* async_filename = "x86-emulator.test.async.trace";
+    DEFER { remove(async_filename); };
+    {
+        Intel8086 x86;
+        Counter async_counter;
+        Handler async_handler;
+        make_emulator(x86, async_counter, async_handler);
+        UNWRAP_BARE(auto trace, TraceWriter::open_async(async_filename, {}));
+        trace.start(x86);
+        RET_IF(x86.run());
+        x86.set_trace(nullptr);
+        RET_IF(trace.flush());
+    }
+    UNWRAP_BARE(auto sync_trace, read_program(filename));
+    UNWRAP_BARE(auto async_trace, read_program(async_filename));
+    if (sync_trace != async_trace) {
+        fflush(stdout);
+        fmt::print(stderr, "Trace written on a separate thread differs\n");
+        return Errc::EmulationError;
+    }
+
+    UNWRAP_BARE(auto replayer, TraceReplayer::open(filename));
+    RET_IF(replayer->run_to(UINT64_MAX));
+    RET_IF(expect_same_state(replayer->get_cpu(), recorded, replayer->get_instruction_count()));
+    if (replayer->get_instruction_count() != recorded.get_instruction_count()) return Errc::EmulationError;
+    for (u32 address : { 0x200, 0x201, 0x300, 0x301, 0x302, 0x303, 0x304 }) {
+        if (replayer->get_cpu().read_byte(address) != recorded.read_byte(address)) {
+            fflush(stdout);
+            fmt::print(stderr, "Replayed memory differs at {:#x}\n", address);
+            return Errc::EmulationError;
+        }
+    }
+
+    // A traced run that stops on its budget at the end of a block
+    {
+        // top: inc ax; add bx, 2; jmp top
+        constexpr std::array<u8, 6> loop = { 0x40, 0x83, 0xc3, 0x02, 0xeb, 0xfa };
+        Intel8086 x86(loop);
+        x86.set_verbose(false);
+        {
+            UNWRAP_BARE(auto trace, TraceWriter::open(filename));
+            trace.start(x86);
+            RET_IF(x86.run({ .max_instructions = 10 }));
+            x86.set_trace(nullptr);
+            RET_IF(trace.flush());
+        }
+        if (x86.get_instruction_count() != 12) {
+            fflush(stdout);
+            fmt::print(stderr, "Traced run stopped after {} instructions, expected 12\n", x86.get_instruction_count());
+            return Errc::EmulationError;
+        }
+        UNWRAP_BARE(auto budget_replayer, TraceReplayer::open(filename));
+        RET_IF(budget_replayer->run_to(UINT64_MAX));
+        RET_IF(expect_same_state(budget_replayer->get_cpu(), x86, budget_replayer->get_instruction_count()));
+        if (budget_replayer->get_instruction_count() != 12) return Errc::EmulationError;
+    }
+
+    return {};
+}
+
+static error_code test_branch_trace() {
+    fmt::print("Testing branch traces\n");
+
+    struct Handler final : InterruptHandler {
+        u8 calls = 0;
+        bool interrupt(Intel8086& x86, u8) override {
+            x86.write_byte(0x300 + calls, 0x70 + calls);
+            x86.set(Register::si, x86.get(Register::si) + 0x10);
+            ++calls;
+            return true;
+        }
+    };
+
+    // At 0100:0000
+    // mov cx, 3; top: call sub; int 0x80; loop top
+    // mov bl, 0; div bl; jmp over; nop; over: mov [0x200], ax; hlt
+    // sub: inc ax; ret
+    // The division error is handled by an iret at 0000:0500
+    constexpr std::array<u8, 26> program = {
+        0xb9, 0x03, 0x00, 0xe8, 0x12, 0x00, 0xcd, 0x80, 0xe2, 0xf9, 0xb3, 0x00, 0xf6,
+        0xf3, 0xeb, 0x01, 0x90, 0xa3, 0x00, 0x02, 0xf4, 0x90, 0x90, 0x90, 0x40, 0xc3,
+    };
+    auto make_emulator = [&](Intel8086& x86, Handler& handler) {
+        constexpr std::array<u8, 4> divide_error_vector = { 0x00, 0x05, 0x00, 0x00 };
+        constexpr std::array<u8, 1> iret = { 0xcf };
+        x86.load_image(0, divide_error_vector);
+        x86.load_image(0x500, iret);
+        x86.load_image(0x1000, program);
+        x86.set(Register::cs, 0x100);
+        x86.set(Register::sp, 0xf00);
+        x86.map_interrupt(0x80, handler);
+    };
+
+    constexpr const char* filename = "x86-emulator.test.branches";
+    constexpr const char* full_filename = "x86-emulator.test.full";
+    DEFER {
+        remove(filename);
+        remove(full_filename);
+    };
+    for (auto [name, mode] : { std::pair(filename, TraceMode::Branches), std::pair(full_filename, TraceMode::Full) }) {
+        Intel8086 x86;
+        Handler handler;
+        make_emulator(x86, handler);
+        UNWRAP_BARE(auto trace, TraceWriter::open(name, mode));
+        trace.start(x86);
+        RET_IF(x86.run());
+        x86.set_trace(nullptr);
+        RET_IF(trace.flush());
+    }
+
+    UNWRAP_BARE(auto decoder, BranchTraceDecoder::open(filename));
+    Intel8086 stepped;
+    Handler handler;
+    make_emulator(stepped, handler);
+    DecodedInstruction decoded;
+    while (true) {
+        UNWRAP_BARE(bool read, decoder.next(decoded));
+        if (!read) break;
+        if (decoded.cs != stepped.get(Register::cs) || decoded.ip != stepped.get_ip()
+            || decoded.instruction.address != stepped.get_physical_ip()) {
+            fflush(stdout);
+            fmt::print(stderr, "Decoded instruction {} differs at {:04x}:{:04x}\n", decoded.instruction,
+                       stepped.get(Register::cs), stepped.get_ip());
+            return Errc::EmulationError;
+        }
+        UNWRAP_BARE(auto result, stepped.step());
+        (void)result;
+    }
+    if (decoder.get_instruction_count() != stepped.get_instruction_count() || stepped.get_instruction_count() != 22) {
+        fflush(stdout);
+        fmt::print(stderr, "Decoded {} instructions, executed {}\n", decoder.get_instruction_count(), stepped.get_instruction_count());
+        return Errc::EmulationError;
+    }
+
+    UNWRAP_BARE(auto branch_trace, read_program(filename));
+    UNWRAP_BARE(auto full_trace, read_program(full_filename));
+    if (branch_trace.size() >= full_trace.size()) return Errc::EmulationError;
+    // Full traces can't be decoded, branch traces can't be replayed
+    if (BranchTraceDecoder::open(full_filename) || TraceReplayer::open(filename)) return Errc::EmulationError;
+    return {};
+}
+
+static error_code test_reverse_debugger() {
+    fmt::print("Testing reverse execution\n");
+
+    // mov cx, 40; mov bx, 0x1000
+    // top: mov [bx], cx; add bx, 0x80; call f; loop top; hlt
+    // f: inc ax; ret
+    constexpr std::array<u8, 20> program = {
+        0xb9, 0x28, 0x00, 0xbb, 0x00, 0x10, 0x89, 0x0f, 0x81, 0xc3,
+        0x80, 0x00, 0xe8, 0x03, 0x00, 0xe2, 0xf5, 0xf4, 0x40, 0xc3,
+    };
+    constexpr u32 function_address = 0x12;
+
+    struct State {
+        std::array<u16, 12> registers;
+        u16 ip;
+        Intel8086::Flags flags;
+        std::vector<u8> data;
+        std::vector<u8> stack;
+        bool operator==(const State&) const = default;
+    };
+    auto get_state = [](const Intel8086& x86) {
+        State state = { x86.get_registers(), x86.get_ip(), x86.get_flags(), std::vector<u8>(0x1400), std::vector<u8>(0x100) };
+        x86.read_image(0x1000, state.data);
+        x86.read_image(0xfff00, state.stack);
+        return state;
+    };
+
+    Intel8086 x86(program);
+    x86.set_verbose(false);
+    ReverseDebugger debugger(x86, { .interval = 16 });
+    std::vector<State> states;
+    while (true) {
+        states.push_back(get_state(x86));
+        UNWRAP_BARE(auto result, debugger.step());
+        if (result == Intel8086::ExecuteResult::Halt) break;
+    }
+    states.push_back(get_state(x86));
+
+    auto expect_state = [&](u64 instruction) -> error_code {
+        if (x86.get_instruction_count() != instruction || get_state(x86) != states[instruction]) {
+            fflush(stdout);
+            fmt::print(stderr, "State differs after going back to instruction {}\n", instruction);
+            return Errc::EmulationError;
+        }
+        return {};
+    };
+    for (u64 instruction = states.size() - 1; instruction-- > 0;) {
+        UNWRAP_BARE(bool stepped, debugger.reverse_step());
+        if (!stepped) return Errc::EmulationError;
+        RET_IF(expect_state(instruction));
+    }
+    UNWRAP_BARE(bool stepped, debugger.reverse_step());
+    if (stepped) return Errc::EmulationError;
+
+    // The last call before instruction 150
+    RET_IF(debugger.go_to(150));
+    RET_IF(expect_state(150));
+    UNWRAP_BARE(bool found, debugger.reverse_continue(function_address));
+    u64 expected = 149;
+    while (states[expected].ip != function_address) --expected;
+    if (!found) return Errc::EmulationError;
+    RET_IF(expect_state(expected));
+    UNWRAP_BARE(found, debugger.reverse_continue(0x100));
+    if (found) return Errc::EmulationError;
+    RET_IF(expect_state(expected));
+
+    // Without memory for older undo logs, only the current interval is kept
+    Intel8086 limited(program);
+    limited.set_verbose(false);
+    ReverseDebugger limited_debugger(limited, { .interval = 16, .memory_limit = 0 });
+    for (u32 i = 0; i < 100; ++i) {
+        UNWRAP_BARE(auto result, limited_debugger.step());
+        (void)result;
+    }
+    if (limited_debugger.get_checkpoint_count() != 1 || limited_debugger.get_oldest_instruction() != 96
+        || limited_debugger.get_memory_used() != 0) {
+        return Errc::EmulationError;
+    }
+    RET_IF(limited_debugger.go_to(97));
+    UNWRAP_BARE(stepped, limited_debugger.reverse_step());
+    if (!stepped) return Errc::EmulationError;
+    UNWRAP_BARE(stepped, limited_debugger.reverse_step());
+    return stepped ? Errc::EmulationError : error_code();
+}
+
+static error_code test_breakpoints() {
+    fmt::print("Testing breakpoints and watchpoints\n");
+
+    // mov cx, 5; mov bx, 0x200
+    // top: mov al, [6]; mov [bx], al; inc bx; loop top
+    // mov [0x300], cx; hlt
+    constexpr std::array<u8, 19> program = {
+        0xb9, 0x05, 0x00, 0xbb, 0x00, 0x02, 0xa0, 0x06, 0x00, 0x88,
+        0x07, 0x43, 0xe2, 0xf8, 0x89, 0x0e, 0x00, 0x03, 0xf4,
+    };
+    constexpr u32 top = 6;
+    using enum Intel8086::StopReason;
+
+    Intel8086 x86(program);
+    x86.set_verbose(false);
+    x86.add_breakpoint(top);
+    RET_IF(x86.run());
+    if (x86.get_stop_reason() != Breakpoint || x86.get_physical_ip() != top || x86.get_instruction_count() != 2) {
+        return Errc::EmulationError;
+    }
+    // Resuming executes the instruction at the breakpoint
+    RET_IF(x86.run());
+    if (x86.get_stop_reason() != Breakpoint || x86.get_physical_ip() != top || x86.get_instruction_count() != 6) {
+        return Errc::EmulationError;
+    }
+
+    // The guest and the host see the original code
+    std::array<u8, 2> data = {};
+    x86.read_image(0x200, data);
+    if (data[0] != program[top] || x86.read_byte(top) != program[top]) return Errc::EmulationError;
+
+    x86.add_watchpoint(top, 1, Intel8086::WatchAccess::Read);
+    RET_IF(x86.run());
+    auto hit = x86.get_watchpoint_hit();
+    if (x86.get_stop_reason() != Watchpoint || !hit || hit->address != top || hit->write || hit->value != program[top]
+        || x86.get_instruction_count() != 10) {
+        return Errc::EmulationError;
+    }
+
+    x86.remove_breakpoint(top);
+    x86.remove_watchpoint(top);
+    x86.add_watchpoint(0x300, 2, Intel8086::WatchAccess::Write);
+    RET_IF(x86.run());
+    hit = x86.get_watchpoint_hit();
+    if (x86.get_stop_reason() != Watchpoint || !hit || hit->address != 0x300 || !hit->write || hit->value != 0) {
+        return Errc::EmulationError;
+    }
+    RET_IF(x86.run());
+    if (x86.get_stop_reason() != Halt || x86.get_watchpoint_hit()) return Errc::EmulationError;
+    return {};
+}
+
+static error_code test_run_limits() {
+    fmt::print("Testing run limits\n");
+
+    // top: inc ax; add bx, 2; jmp top
+    constexpr std::array<u8, 6> program = { 0x40, 0x83, 0xc3, 0x02, 0xeb, 0xfa };
+    using enum Intel8086::StopReason;
+
+    Intel8086 x86(program);
+    x86.set_verbose(false);
+    // Budgets end the run at the end of a block
+    RET_IF(x86.run({ .max_instructions = 10 }));
+    if (x86.get_stop_reason() != InstructionLimit || x86.get_instruction_count() != 12) return Errc::EmulationError;
+
+    auto cycles = x86.get_cycle_count();
+    RET_IF(x86.run({ .estimate_cycles = true, .max_cycles = 1000 }));
+    if (x86.get_stop_reason() != CycleLimit || x86.get_cycle_count() < cycles + 1000 || x86.get_cycle_count() > cycles + 1100) {
+        return Errc::EmulationError;
+    }
+    if (!x86.get_scheduler().empty()) return Errc::EmulationError;
+
+    // Stop addresses are exact
+    constexpr std::array<u32, 1> stops = { 1 };
+    RET_IF(x86.run({ .max_instructions = 100, .stop_addresses = stops }));
+    if (x86.get_stop_reason() != StopAddress || x86.get_ip() != 1 || x86.has_breakpoint(1)) return Errc::EmulationError;
+    auto count = x86.get_instruction_count();
+    RET_IF(x86.run({ .stop_addresses = stops }));
+    if (x86.get_stop_reason() != StopAddress || x86.get_ip() != 1 || x86.get_instruction_count() != count + 3) {
+        return Errc::EmulationError;
+    }
+
+    std::atomic<bool> cancel = true;
+    RET_IF(x86.run({ .cancel = &cancel }));
+    if (x86.get_stop_reason() != Cancelled || x86.get_instruction_count() != count + 5) return Errc::EmulationError;
+    return {};
+}
+
+static error_code test_run_hooks() {
+    fmt::print("Testing run hooks\n");
+
+    // mov bx, 0x200; mov byte [bx], 7; mov al, [bx]; call f; int 0x81; hlt
+    // f: ret
+    constexpr std::array<u8, 15> program = {
+        0xbb, 0x00, 0x02, 0xc6, 0x07, 0x07, 0x8a, 0x07, 0xe8, 0x03, 0x00, 0xcd, 0x81, 0xf4, 0xc3,
+    };
+
+    struct Counter {
+        u32 instructions = 0;
+        u32 reads = 0;
+        u32 writes = 0;
+        u32 interrupts = 0;
+        std::vector<u32> branches;
+
+        void before_instruction(Intel8086&, const Instruction&) { ++instructions; }
+        void branch_taken(Intel8086&, const Instruction&, u32 address) { branches.push_back(address); }
+        void memory_read(u32, u8) { ++reads; }
+        void memory_write(u32, u8) { ++writes; }
+        void interrupt(Intel8086&, u8 number) { interrupts += number == 0x81; }
+    };
+
+    Intel8086 x86(program);
+    x86.set_verbose(false);
+    // The handler of int 0x81 at 0:0x20 is an iret
+    constexpr std::array<u8, 4> vector = { 0x20, 0x00, 0x00, 0x00 };
+    x86.load_image(0x81 * 4, vector);
+    x86.load_image(0x20, std::array<u8, 1>{ 0xcf });
+
+    Counter counter;
+    RET_IF(x86.run(counter, {}));
+    // Stack accesses: 2 bytes for call and ret, 6 for int and iret, plus the
+    // interrupt vector and the data
+    std::vector<u32> branches = { 0x8, 0xe, 0xb, 0x20 };
+    if (counter.instructions != 8 || counter.reads != 2 + 4 + 6 + 1 || counter.writes != 2 + 6 + 1
+        || counter.interrupts != 1 || counter.branches != branches) {
+        fflush(stdout);
+        fmt::print(stderr, "Hooks called {} {} {} {} {} times\n", counter.instructions, counter.reads, counter.writes,
+                   counter.interrupts, counter.branches.size());
+        return Errc::EmulationError;
+    }
+
+    // The hooks are detached after the run
+    x86.set_ip(0);
+    RET_IF(x86.run());
+    if (counter.instructions != 8 || counter.reads != 13) return Errc::EmulationError;
+    return {};
+}
+
+// The guest of the profiler tests:
+// mov cx, 200
+// top: call f; call h; loop top; hlt
+// f: call g; ret
+// g: mov dx, 20; l: dec dx; jnz l; ret
+// h: add sp, 2; jmp top + 6 (never returns with ret)
+static constexpr std::array<u8, 37> profiled_program = {
+    0xb9, 0xc8, 0x00, 0xe8, 0x0a, 0x00, 0xe8, 0x17, 0x00, 0xe2, 0xf8, 0xf4, 0x90, 0x90, 0x90, 0x90,
+    0xe8, 0x05, 0x00, 0xc3, 0x90, 0x90, 0x90, 0x90, 0xba, 0x14, 0x00, 0x4a, 0x75, 0xfd, 0xc3, 0x90,
+    0x83, 0xc4, 0x02, 0xeb, 0xe4,
+};
+static constexpr u32 profiled_f = 0x10;
+static constexpr u32 profiled_g = 0x18;
+static constexpr u32 profiled_h = 0x20;
+
+static error_code test_sampling_profiler() {
+    fmt::print("Testing the sampling profiler\n");
+
+    constexpr u32 f = profiled_f;
+    constexpr u32 g = profiled_g;
+    constexpr u32 h = profiled_h;
+
+    for (auto clock : { SamplingProfiler::Clock::Cycles, SamplingProfiler::Clock::Instructions }) {
+        Intel8086 x86(profiled_program);
+        x86.set_verbose(false);
+        SamplingProfiler profiler({ .period = 100, .clock = clock });
+        RET_IF(profiler.run(x86, {}));
+        if (x86.get_physical_ip() != 0xc) return Errc::EmulationError;
+
+        u64 samples = 0;
+        u64 samples_in_g = 0;
+        for (const auto& [stack, count] : profiler.get_stacks()) {
+            std::vector<u32> functions(stack.begin(), stack.end() - 1);
+            // h's frame is dropped once it drops its return address
+            bool valid = functions.empty() || functions == std::vector<u32>{ f } || functions == std::vector<u32>{ f, g }
+                      || functions == std::vector<u32>{ h };
+            if (!valid) {
+                fflush(stdout);
+                fmt::print(stderr, "Unexpected sampled stack {}\n", stack);
+                return Errc::EmulationError;
+            }
+            samples += count;
+            if (functions.size() == 2) samples_in_g += count;
+        }
+        u64 histogram_samples = 0;
+        for (const auto& [address, count] : profiler.get_histogram()) histogram_samples += count;
+        if (samples != profiler.get_sample_count() || histogram_samples != samples || samples_in_g < samples * 3 / 4) {
+            return Errc::EmulationError;
+        }
+
+        auto total = clock == SamplingProfiler::Clock::Cycles ? x86.get_cycle_count() : x86.get_instruction_count();
+        if (samples > total / 100 || samples < total / 110) return Errc::EmulationError;
+    }
+    return {};
+}
+
+static error_code test_call_graph_profiler() {
+    fmt::print("Testing the call graph profiler\n");
+
+    constexpr u32 f = profiled_f;
+    constexpr u32 g = profiled_g;
+    constexpr u32 h = profiled_h;
+
+    Intel8086 x86(profiled_program);
+    x86.set_verbose(false);
+    CallGraphProfiler profiler;
+    RET_IF(profiler.run(x86, {}));
+    if (x86.get_physical_ip() != 0xc || profiler.get_root() != 0u) return Errc::EmulationError;
+
+    const auto& functions = profiler.get_functions();
+    u64 self_instructions = 0;
+    u64 self_cycles = 0;
+    for (const auto& [address, function] : functions) {
+        self_instructions += function.self_instructions;
+        self_cycles += function.self_cycles;
+    }
+    const auto& root = functions.at(0);
+    if (self_instructions != x86.get_instruction_count() || self_cycles != x86.get_cycle_count()
+        || root.total_instructions != x86.get_instruction_count() || root.total_cycles != x86.get_cycle_count()) {
+        return Errc::EmulationError;
+    }
+
+    // f: call g; ret. g: mov dx, 20, 20 times dec dx; jnz, ret. h's frame is
+    // dropped at its jmp.
+    const auto& in_f = functions.at(f);
+    const auto& in_g = functions.at(g);
+    const auto& in_h = functions.at(h);
+    if (in_f.calls != 200 || in_f.self_instructions != 200 * 2 || in_f.total_instructions != 200 * 44) return Errc::EmulationError;
+    if (in_g.calls != 200 || in_g.self_instructions != 200 * 42 || in_g.total_instructions != 200 * 42) return Errc::EmulationError;
+    if (in_h.calls != 200 || in_h.self_instructions != 200 * 2 || in_h.total_instructions != 200 * 2) return Errc::EmulationError;
+    if (in_f.total_cycles <= in_g.total_cycles || in_g.total_cycles != in_g.self_cycles) return Errc::EmulationError;
+
+    const auto& calls = profiler.get_calls();
+    if (calls.size() != 3) return Errc::EmulationError;
+    const auto& root_f = calls.at({ 0, f });
+    const auto& f_g = calls.at({ f, g });
+    const auto& root_h = calls.at({ 0, h });
+    if (root_f.count != 200 || root_f.instructions != in_f.total_instructions || root_f.cycles != in_f.total_cycles) return Errc::EmulationError;
+    if (f_g.count != 200 || f_g.instructions != in_g.total_instructions || root_h.count != 200) return Errc::EmulationError;
+
+    constexpr const char* filename = "x86-emulator.test.call-graph";
+    DEFER { remove(filename); };
+    RET_IF(profiler.write_report(filename));
+    return {};
+}
+
+static error_code test_checkpoint_file() {
+    fmt::print("Testing checkpoint files\n");
+
+    struct Counter final : DeviceState {
+        u16 value = 0;
+        u32 state_id() const override { return 1; }
+        std::vector<u8> save_state() const override { return { static_cast<u8>(value), static_cast<u8>(value >> 8) }; }
+        error_code load_state(std::span<const u8> state) override {
+            if (state.size() != 2) return Errc::InvalidCheckpoint;
+            value = static_cast<u16>(state[0] | (state[1] << 8));
+            return {};
+        }
+    };
+
+    // mov cx, 40; mov bx, 0x1000
+    // top: mov [bx], cx; add bx, 0x80; call f; loop top; hlt
+    // f: inc ax; ret
+    constexpr std::array<u8, 20> program = {
+        0xb9, 0x28, 0x00, 0xbb, 0x00, 0x10, 0x89, 0x0f, 0x81, 0xc3,
+        0x80, 0x00, 0xe8, 0x03, 0x00, 0xe2, 0xf5, 0xf4, 0x40, 0xc3,
+    };
+    Intel8086 x86(program);
+    x86.set_verbose(false);
+    for (u32 i = 0; i < 100; ++i) {
+        UNWRAP_BARE(auto result, x86.step());
+        (void)result;
+    }
+    Counter counter;
+    counter.value = 0x1234;
+
+    constexpr const char* filename = "x86-emulator.test.checkpoint";
+    DEFER { remove(filename); };
+    RET_IF(save_checkpoint(x86, filename, std::array<const DeviceState*, 1>{ &counter }));
+
+    UNWRAP_BARE(auto checkpoint, CheckpointFile::open(filename));
+    if (checkpoint.get_header().memory_offset % CheckpointHeader::memory_alignment != 0) return Errc::EmulationError;
+    Intel8086 resumed;
+    resumed.set_verbose(false);
+    checkpoint.restore(resumed);
+    Counter resumed_counter;
+    RET_IF(checkpoint.restore_device(resumed_counter));
+    if (resumed_counter.value != counter.value || resumed.get_instruction_count() != x86.get_instruction_count()) {
+        return Errc::EmulationError;
+    }
+
+    RET_IF(x86.run());
+    RET_IF(resumed.run());
+    std::vector<u8> memory(Intel8086::memory_size);
+    std::vector<u8> resumed_memory(Intel8086::memory_size);
+    x86.read_image(0, memory);
+    resumed.read_image(0, resumed_memory);
+    if (resumed.get_registers() != x86.get_registers() || resumed.get_ip() != x86.get_ip()
+        || resumed.get_flags() != x86.get_flags() || resumed.get_cycle_count() != x86.get_cycle_count() || resumed_memory != memory) {
+        fflush(stdout);
+        fmt::print(stderr, "Resumed execution differs\n");
+        return Errc::EmulationError;
+    }
+
+    // The memory is mapped copy-on-write, so the file still has the memory
+    // at the time of the checkpoint
+    UNWRAP_BARE(auto file, read_program(filename));
+    auto offset = checkpoint.get_header().memory_offset;
+    if (file[offset + 0x1000 + 39 * 0x80] != 0 || memory[0x1000 + 39 * 0x80] != 1) return Errc::EmulationError;
+
+    file.resize(offset);
+    FILE* truncated = fopen(filename, "wb");
+    if (!truncated) return make_error_code_errno();
+    fwrite(file.data(), 1, file.size(), truncated);
+    fclose(truncated);
+    return CheckpointFile::open(filename) ? Errc::EmulationError : error_code();
+}
+
+static error_code test_async_trace_sink() {
+    fmt::print("Testing the asynchronous trace sink\n");
+
+    constexpr const char* filename = "x86-emulator.test.sink";
+    DEFER { remove(filename); };
+
+    std::vector<u8> data(10000);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<u8>(i * 7);
+    {
+        FILE* file = fopen(filename, "wb");
+        if (!file) return make_error_code_errno();
+        AsyncTraceSink sink(file, { 4096, AsyncTraceSink::Policy::Block, {} });
+        // Wraps around the ring, and waits for the writer when it's full
+        for (size_t i = 0; i < data.size(); i += 1000) {
+            if (!sink.push(std::span(data).subspan(i, 1000))) return Errc::EmulationError;
+        }
+        RET_IF(sink.flush());
+    }
+    UNWRAP_BARE(auto written, read_program(filename));
+    if (written != data) {
+        fflush(stdout);
+        fmt::print(stderr, "Data written through the ring differs\n");
+        return Errc::EmulationError;
+    }
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) return make_error_code_errno();
+    AsyncTraceSink sink(file, { 4096, AsyncTraceSink::Policy::Drop, {} });
+    if (sink.push(data) || sink.get_dropped_bytes() != data.size()) {
+        fflush(stdout);
+        fmt::print(stderr, "A batch larger than the ring wasn't dropped\n");
+        return Errc::EmulationError;
+    }
+    if (!sink.push(std::span(data).first(100))) return Errc::EmulationError;
+    return sink.flush();
+}
+
 static error_code assemble_and_test_disassembler(const std::string& filename) {
     UNWRAP_BARE(auto assembled_filename, assemble_program_to_tmp(filename.data()));
     DEFER { (void)unlink_tmp_file(assembled_filename); };
@@ -246,6 +1429,13 @@ static constexpr std::array emulator_tests = {
     "short_memory.asm",
     "function_call.asm",
     "recursive_call.asm",
+    "byte_arithmetic.asm",
+    "logic_operations.asm",
+    "multiply_divide.asm",
+    "shifts_rotates.asm",
+    "bcd_adjust.asm",
+    "flags_transfer.asm",
+    "software_interrupts.asm",
 };
 static constexpr std::array ce_emulator_tests = {
     "part1/listing_0043_immediate_movs",
@@ -281,6 +1471,27 @@ static error_code run_tests() {
         Intel8086 x86;
         x86.test_set_get();
     }
+    RET_IF(test_scheduler());
+    RET_IF(test_port_io());
+    RET_IF(test_memory_mapping());
+    RET_IF(test_snapshot_restore());
+    RET_IF(test_fuzzer());
+    RET_IF(test_dos_services());
+    RET_IF(test_dos_program_loading());
+    RET_IF(test_disk());
+    RET_IF(test_framebuffer());
+    RET_IF(test_memory_dumps());
+    RET_IF(test_shared_state());
+    RET_IF(test_trace_replay());
+    RET_IF(test_branch_trace());
+    RET_IF(test_async_trace_sink());
+    RET_IF(test_reverse_debugger());
+    RET_IF(test_checkpoint_file());
+    RET_IF(test_breakpoints());
+    RET_IF(test_run_limits());
+    RET_IF(test_run_hooks());
+    RET_IF(test_sampling_profiler());
+    RET_IF(test_call_graph_profiler());
     for (auto test : emulator_tests) {
         filename = test_prefix;
         filename += test;
@@ -0,0 +1,744 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fmt/core.h>
+
+// A record starts with a tag byte: the type in bits 0-2, a flag in bit 3 and
+// a count in bits 4-7. Counts that don't fit follow the tag as a varint.
+static constexpr u32 tag_flag = 1 << 3;
+static constexpr u32 tag_count_shift = 4;
+static constexpr u32 tag_count_escape = 15;
+
+static u64 zigzag_encode(i32 value) {
+    return (static_cast<u32>(value) << 1) ^ static_cast<u32>(value >> 31);
+}
+
+static i32 zigzag_decode(u64 value) {
+    return static_cast<i32>(static_cast<u32>(value >> 1) ^ -static_cast<u32>(value & 1));
+}
+
+static bool test_bit(std::span<const u64> bits, u32 i) {
+    return bits[i / 64] & (u64(1) << (i % 64));
+}
+
+static void set_bit(std::span<u64> bits, u32 i) {
+    bits[i / 64] |= u64(1) << (i % 64);
+}
+
+// What a branch trace records about an instruction that ended a block
+enum class BranchKind {
+    // An outcome bit
+    Conditional,
+    // Nothing, the target is in the instruction
+    Direct,
+    // The target
+    Indirect,
+    // The target and the position, the instruction only ends a block when
+    // it raises an interrupt
+    Other,
+};
+
+static BranchKind classify_branch(const Instruction& i) {
+    using enum Instruction::Type;
+    using T = std::underlying_type_t<Instruction::Type>;
+    auto t = static_cast<T>(i.type);
+    if (static_cast<T>(Jo) <= t && t <= static_cast<T>(Jcxz)) return BranchKind::Conditional;
+
+    switch (i.type) {
+        case Call:
+        case Jmp: {
+            auto type = i.operands[0].type;
+            bool direct = type == Operand::Type::IpInc || (i.flags.intersegment && type == Operand::Type::Immediate);
+            return direct ? BranchKind::Direct : BranchKind::Indirect;
+        }
+        case Ret:
+        case Iret:
+        case Int:
+        case Int3:
+            return BranchKind::Indirect;
+        default:
+            return BranchKind::Other;
+    }
+}
+
+expected<TraceWriter, error_code> TraceWriter::open(const char* filename, TraceMode mode) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_unexpected_errno();
+    }
+    return TraceWriter(mode, file, nullptr);
+}
+
+expected<TraceWriter, error_code> TraceWriter::open_async(const char* filename, const AsyncTraceSink::Options& options, TraceMode mode) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_unexpected_errno();
+    }
+    return TraceWriter(mode, nullptr, std::make_unique<AsyncTraceSink>(file, options));
+}
+
+TraceWriter::~TraceWriter() {
+    if (!file && !sink) return;
+    (void)flush();
+    if (file) fclose(file);
+}
+
+void TraceWriter::start(Intel8086& x86) {
+    for (auto c : TraceHeader::signature) put(c);
+    put_bytes({ reinterpret_cast<const u8*>(&TraceHeader::current_version), sizeof(u32) });
+    put(static_cast<u8>(mode));
+    instructions = x86.get_instruction_count();
+    event_instructions = instructions;
+    segment = x86.get(Register::cs);
+    traced = &x86;
+    put_varint(instructions);
+    put_varint(x86.get_cycle_count());
+    put_state(x86);
+
+    TraceHeader header;
+    for (u32 page = 0; page < Intel8086::page_count; ++page) {
+        if (x86.is_mmio_page(page)) set_bit(header.mmio_pages, page);
+        if (x86.is_rom_page(page)) set_bit(header.rom_pages, page);
+    }
+    for (u32 number = 0; number < 256; ++number) {
+        if (x86.has_interrupt_handler(static_cast<u8>(number))) set_bit(header.host_interrupts, number);
+    }
+    for (auto bits : header.mmio_pages) put_varint(bits);
+    for (auto bits : header.rom_pages) put_varint(bits);
+    for (auto bits : header.host_interrupts) put_varint(bits);
+
+    // Only the pages that aren't all zeros
+    static constexpr std::array<u8, Intel8086::page_size> zero_page = {};
+    std::vector<u8> memory(Intel8086::memory_size);
+    x86.read_image(0, memory);
+    std::vector<u32> pages;
+    for (u32 page = 0; page < Intel8086::page_count; ++page) {
+        if (memcmp(memory.data() + page * Intel8086::page_size, zero_page.data(), Intel8086::page_size) != 0) pages.push_back(page);
+    }
+    put_varint(pages.size());
+    for (auto page : pages) {
+        put_varint(page);
+        put_bytes(std::span(memory).subspan(page * Intel8086::page_size, Intel8086::page_size));
+    }
+
+    x86.set_trace(this);
+}
+
+error_code TraceWriter::flush() {
+    flush_memory_write();
+    flush_outcomes();
+    write_buffer();
+    if (sink) {
+        auto e = sink->flush();
+        if (!error) error = e;
+    } else if (!error && fflush(file) != 0) {
+        error = make_error_code_errno();
+    }
+    return error;
+}
+
+void TraceWriter::block(u32 count, const Instruction& last, const Intel8086& x86) {
+    flush_memory_write();
+    instructions += count;
+    if (mode == TraceMode::Branches) {
+        branch_block(last, x86);
+        return;
+    }
+
+    u32 fall_through = (last.address + last.size) & (Intel8086::memory_size - 1);
+    u32 target = x86.get_physical_ip();
+    bool taken = target != fall_through;
+    put_tag(TraceRecord::Type::Block, count, !taken);
+    if (taken) put_varint(zigzag_encode(static_cast<i32>(target - fall_through)));
+}
+
+void TraceWriter::branch_block(const Instruction& last, const Intel8086& x86) {
+    // The code segment can only change at the end of a block
+    u16 fall_through = static_cast<u16>(last.address - (segment << 4) + last.size);
+    if (last.type == Instruction::Type::Call) returns.push(segment, fall_through);
+    if (last.type == Instruction::Type::Ret) {
+        if (auto expected = returns.pop()) {
+            bool predicted = *expected == ((static_cast<u32>(x86.get(Register::cs)) << 16) | x86.get_ip());
+            put_outcome(predicted);
+            if (predicted) {
+                segment = x86.get(Register::cs);
+                event_instructions = instructions;
+                return;
+            }
+        }
+    }
+    switch (classify_branch(last)) {
+        case BranchKind::Conditional:
+            put_outcome(x86.get_ip() != fall_through);
+            break;
+        case BranchKind::Direct:
+            segment = x86.get(Register::cs);
+            return;
+        case BranchKind::Indirect:
+            put_target(0, fall_through, x86);
+            break;
+        case BranchKind::Other:
+            put_target(static_cast<u32>(instructions - event_instructions), fall_through, x86);
+            break;
+    }
+    event_instructions = instructions;
+}
+
+void TraceWriter::put_target(u32 count, u16 fall_through, const Intel8086& x86) {
+    u16 target_segment = x86.get(Register::cs);
+    bool segment_changed = target_segment != segment;
+    put_tag(TraceRecord::Type::Target, count, segment_changed);
+    if (segment_changed) put_varint(target_segment);
+    put_varint(zigzag_encode(static_cast<i16>(x86.get_ip() - fall_through)));
+    segment = target_segment;
+}
+
+void TraceWriter::input(u16 value) {
+    if (mode == TraceMode::Branches) return;
+    flush_memory_write();
+    put_tag(TraceRecord::Type::Input, 0, false);
+    put_varint(value);
+}
+
+void TraceWriter::memory_write(u32 address, std::span<const u8> data) {
+    if (!write_data.empty() && address != write_address + write_data.size()) flush_memory_write();
+    if (write_data.empty()) {
+        write_address = address;
+        if (traced) write_position = static_cast<u32>(traced->get_instruction_count() - event_instructions);
+    }
+    write_data.insert(write_data.end(), data.begin(), data.end());
+}
+
+void TraceWriter::host_interrupt(const Intel8086& x86, bool resumed) {
+    if (mode == TraceMode::Branches) return;
+    flush_memory_write();
+    put_tag(TraceRecord::Type::HostInterrupt, 0, resumed);
+    put_state(x86);
+}
+
+void TraceWriter::stop(u32 count) {
+    flush_memory_write();
+    instructions += count;
+    if (mode == TraceMode::Branches) {
+        put_tag(TraceRecord::Type::Stop, static_cast<u32>(instructions - event_instructions), false);
+        event_instructions = instructions;
+        return;
+    }
+    put_tag(TraceRecord::Type::Stop, count, false);
+}
+
+void TraceWriter::put_bytes(std::span<const u8> bytes) {
+    if (used + bytes.size() > buffer.size()) buffer.resize(std::max(2 * buffer.size(), used + bytes.size()));
+    memcpy(buffer.data() + used, bytes.data(), bytes.size());
+    used += bytes.size();
+}
+
+void TraceWriter::put_tag(TraceRecord::Type type, u32 count, bool flag) {
+    // Outcomes come before any record that follows them
+    if (outcome_count != 0) flush_outcomes();
+    if (used >= batch_size) [[unlikely]] write_buffer();
+    u32 inline_count = std::min(count, tag_count_escape);
+    put(static_cast<u8>(static_cast<u32>(type) | (flag ? tag_flag : 0) | (inline_count << tag_count_shift)));
+    if (inline_count == tag_count_escape) put_varint(count - tag_count_escape);
+}
+
+void TraceWriter::put_state(const Intel8086& x86) {
+    for (auto r : x86.get_registers()) put_varint(r);
+    put_varint(x86.get_ip());
+    put_varint(x86.get_flags().word);
+}
+
+void TraceWriter::flush_outcomes() {
+    if (outcome_count == 0) return;
+    u32 count = std::exchange(outcome_count, 0);
+    put_tag(TraceRecord::Type::Outcomes, count, false);
+    for (u32 i = 0; i < count; i += 8) put(static_cast<u8>(outcomes >> i));
+    outcomes = 0;
+}
+
+void TraceWriter::flush_memory_write() {
+    if (write_data.empty()) return;
+    put_tag(TraceRecord::Type::MemoryWrite, mode == TraceMode::Branches ? write_position : 0, false);
+    put_varint(write_address);
+    put_varint(write_data.size());
+    put_bytes(write_data);
+    write_data.clear();
+}
+
+void TraceWriter::write_buffer() {
+    if (used == 0) return;
+    if (sink) {
+        bool pushed = sink->push({ buffer.data(), used });
+        used = 0;
+        if (!pushed) {
+            // The next batch starts with a gap record, in case it isn't
+            // dropped too
+            put(static_cast<u8>(TraceRecord::Type::Gap));
+            put_varint(instructions);
+        }
+        return;
+    }
+    if (!error && fwrite(buffer.data(), 1, used, file) != used) error = make_error_code_errno();
+    used = 0;
+}
+
+expected<TraceReader, error_code> TraceReader::open(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        fmt::print(stderr, "Couldn't open file {}\n", filename);
+        return make_unexpected_errno();
+    }
+    return TraceReader(file);
+}
+
+TraceReader::~TraceReader() {
+    if (file) fclose(file);
+}
+
+expected<TraceHeader, error_code> TraceReader::read_header(std::span<u8> memory) {
+    assert(memory.size() == Intel8086::memory_size);
+
+    std::array<u8, 8> start;
+    if (auto e = get_bytes(start)) return unexpected(e);
+    u32 version = 0;
+    memcpy(&version, start.data() + 4, sizeof(version));
+    if (!std::equal(TraceHeader::signature.begin(), TraceHeader::signature.end(), start.begin()) || version != TraceHeader::current_version) {
+        return unexpected(Errc::InvalidTrace);
+    }
+
+    TraceHeader header;
+    UNWRAP(auto mode, get());
+    if (mode > static_cast<u8>(TraceMode::Branches)) return unexpected(Errc::InvalidTrace);
+    header.mode = static_cast<TraceMode>(mode);
+    UNWRAP(header.instruction_count, get_varint());
+    UNWRAP(header.cycle_count, get_varint());
+    if (auto e = get_state(header.state)) return unexpected(e);
+    if (auto e = get_bitmap(header.mmio_pages)) return unexpected(e);
+    if (auto e = get_bitmap(header.rom_pages)) return unexpected(e);
+    if (auto e = get_bitmap(header.host_interrupts)) return unexpected(e);
+
+    std::fill(memory.begin(), memory.end(), 0);
+    UNWRAP(auto page_count, get_varint());
+    for (u64 i = 0; i < page_count; ++i) {
+        UNWRAP(auto page, get_varint());
+        if (page >= Intel8086::page_count) return unexpected(Errc::InvalidTrace);
+        if (auto e = get_bytes(memory.subspan(page * Intel8086::page_size, Intel8086::page_size))) return unexpected(e);
+    }
+    return header;
+}
+
+expected<bool, error_code> TraceReader::next(TraceRecord& record) {
+    if (position == end && !fill()) {
+        if (ferror(file)) return make_unexpected_errno();
+        return false;
+    }
+
+    using enum TraceRecord::Type;
+    u8 tag = buffer[position++];
+    record.type = static_cast<TraceRecord::Type>(tag & 7);
+    bool flag = tag & tag_flag;
+    record.count = tag >> tag_count_shift;
+    if (record.count == tag_count_escape) {
+        UNWRAP(auto count, get_varint());
+        record.count = static_cast<u32>(count + tag_count_escape);
+    }
+
+    switch (record.type) {
+        case Block:
+            record.fall_through = flag;
+            record.delta = 0;
+            if (!flag) {
+                UNWRAP(auto delta, get_varint());
+                record.delta = zigzag_decode(delta);
+            }
+            break;
+        case Input: {
+            UNWRAP(auto value, get_varint());
+            record.value = static_cast<u16>(value);
+            break;
+        }
+        case HostInterrupt:
+            record.resumed = flag;
+            if (auto e = get_state(record.state)) return unexpected(e);
+            break;
+        case MemoryWrite: {
+            UNWRAP(auto address, get_varint());
+            UNWRAP(auto size, get_varint());
+            if (address >= Intel8086::memory_size || size > Intel8086::memory_size - address) return unexpected(Errc::InvalidTrace);
+            record.address = static_cast<u32>(address);
+            record.data.resize(size);
+            if (auto e = get_bytes(record.data)) return unexpected(e);
+            break;
+        }
+        case Stop:
+            break;
+        case Gap: {
+            UNWRAP(record.instruction, get_varint());
+            break;
+        }
+        case Target: {
+            record.segment.reset();
+            if (flag) {
+                UNWRAP(auto segment, get_varint());
+                record.segment = static_cast<u16>(segment);
+            }
+            UNWRAP(auto delta, get_varint());
+            record.delta = zigzag_decode(delta);
+            break;
+        }
+        case Outcomes:
+            if (record.count == 0 || record.count > 64) return unexpected(Errc::InvalidTrace);
+            record.data.resize((record.count + 7) / 8);
+            if (auto e = get_bytes(record.data)) return unexpected(e);
+            break;
+        default:
+            return unexpected(Errc::InvalidTrace);
+    }
+    return true;
+}
+
+bool TraceReader::fill() {
+    position = 0;
+    end = fread(buffer.data(), 1, buffer.size(), file);
+    return end != 0;
+}
+
+expected<u8, error_code> TraceReader::get() {
+    if (position == end && !fill()) return unexpected(ferror(file) ? make_error_code_errno() : Errc::InvalidTrace);
+    return buffer[position++];
+}
+
+expected<u64, error_code> TraceReader::get_varint() {
+    u64 value = 0;
+    for (u32 shift = 0; shift < 64; shift += 7) {
+        UNWRAP(u8 byte, get());
+        value |= static_cast<u64>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    return unexpected(Errc::InvalidTrace);
+}
+
+error_code TraceReader::get_bytes(std::span<u8> bytes) {
+    while (!bytes.empty()) {
+        if (position == end && !fill()) return ferror(file) ? make_error_code_errno() : Errc::InvalidTrace;
+        auto size = std::min(bytes.size(), end - position);
+        memcpy(bytes.data(), buffer.data() + position, size);
+        position += size;
+        bytes = bytes.subspan(size);
+    }
+    return {};
+}
+
+error_code TraceReader::get_bitmap(std::span<u64> bits) {
+    for (auto& word : bits) {
+        UNWRAP_BARE(word, get_varint());
+    }
+    return {};
+}
+
+error_code TraceReader::get_state(TraceState& state) {
+    for (auto& r : state.registers) {
+        UNWRAP_BARE(auto value, get_varint());
+        r = static_cast<u16>(value);
+    }
+    UNWRAP_BARE(auto ip, get_varint());
+    UNWRAP_BARE(auto flags, get_varint());
+    state.ip = static_cast<u16>(ip);
+    state.flags = static_cast<u16>(flags);
+    return {};
+}
+
+static void apply_state(Intel8086& x86, const TraceState& state) {
+    x86.set_registers(state.registers);
+    x86.set_ip(state.ip);
+    Intel8086::Flags flags;
+    flags.load(state.flags);
+    x86.set_flags(flags);
+}
+
+expected<std::unique_ptr<TraceReplayer>, error_code> TraceReplayer::open(const char* filename) {
+    UNWRAP(auto reader, TraceReader::open(filename));
+    auto replayer = std::unique_ptr<TraceReplayer>(new TraceReplayer(std::move(reader)));
+    auto& x86 = replayer->x86;
+    x86.set_verbose(false);
+
+    std::vector<u8> memory(Intel8086::memory_size);
+    UNWRAP(auto header, replayer->reader.read_header(memory));
+    if (header.mode != TraceMode::Full) {
+        fmt::print(stderr, "Only full traces can be replayed, decode branch traces instead\n");
+        return unexpected(Errc::InvalidTrace);
+    }
+    x86.load_image(0, memory);
+    apply_state(x86, header.state);
+    replayer->first_instruction = header.instruction_count;
+
+    constexpr u32 page_size = Intel8086::page_size;
+    for (u32 page = 0; page < Intel8086::page_count; ++page) {
+        if (test_bit(header.mmio_pages, page)) x86.map_mmio(page * page_size, page_size, *replayer);
+        else if (test_bit(header.rom_pages, page)) x86.map_rom(page * page_size, page_size);
+    }
+    for (u32 number = 0; number < 256; ++number) {
+        if (test_bit(header.host_interrupts, number)) x86.map_interrupt(static_cast<u8>(number), *replayer);
+    }
+    x86.map_ports(0, Intel8086::port_count - 1, *replayer);
+    return replayer;
+}
+
+expected<bool, error_code> TraceReplayer::step() {
+    using enum TraceRecord::Type;
+
+    // Runs end with a stop record, possibly followed by memory written by
+    // the host before the next run
+    while (auto record = peek()) {
+        if (record->type == Gap) {
+            fflush(stdout);
+            fmt::print(stderr, "The trace has a gap after instruction {}\n", get_instruction_count());
+            return unexpected(Errc::InvalidTrace);
+        }
+        if (record->type == Stop && record->count == x86.get_instruction_count() - block_start) {
+            block_start = x86.get_instruction_count();
+        } else if (record->type == MemoryWrite) {
+            x86.load_image(record->address, record->data);
+        } else {
+            break;
+        }
+        pending.reset();
+    }
+    if (error) return unexpected(error);
+    if (!pending) return false;
+
+    // The address after the instruction, to compare with the recorded block
+    std::array<u8, 6> bytes;
+    auto address = x86.get_physical_ip();
+    x86.read_image(address, std::span(bytes).first(std::min<u32>(bytes.size(), Intel8086::memory_size - address)));
+    auto instruction = Instruction::decode_at(bytes, 0);
+    u32 fall_through = (address + (instruction ? instruction->size : 0)) & (Intel8086::memory_size - 1);
+
+    auto count = x86.get_instruction_count();
+    UNWRAP(auto result, x86.step());
+    if (error) return unexpected(error);
+    if (x86.get_instruction_count() == count) return false;
+    if (result != Intel8086::ExecuteResult::EndOfBlock) return true;
+
+    auto record = peek();
+    if (!record || record->type != Block || record->count != x86.get_instruction_count() - block_start) {
+        desynchronized("the end of a block");
+        return unexpected(error);
+    }
+    u32 target = (fall_through + record->delta) & (Intel8086::memory_size - 1);
+    if (target != x86.get_physical_ip()) {
+        desynchronized("a branch target");
+        return unexpected(error);
+    }
+    pending.reset();
+    block_start = x86.get_instruction_count();
+    return true;
+}
+
+error_code TraceReplayer::run_to(u64 instruction_count) {
+    while (get_instruction_count() < instruction_count) {
+        UNWRAP_BARE(bool stepped, step());
+        if (!stepped) break;
+    }
+    return {};
+}
+
+u16 TraceReplayer::in(u16, bool) {
+    return next_input();
+}
+
+u8 TraceReplayer::read(u32) {
+    return next_input() & 0xff;
+}
+
+bool TraceReplayer::interrupt(Intel8086& cpu, u8) {
+    using enum TraceRecord::Type;
+    while (auto record = peek()) {
+        if (record->type == MemoryWrite) {
+            cpu.load_image(record->address, record->data);
+            pending.reset();
+            continue;
+        }
+        if (record->type != HostInterrupt) break;
+        apply_state(cpu, record->state);
+        bool resumed = record->resumed;
+        pending.reset();
+        return resumed;
+    }
+    return desynchronized("a host interrupt");
+}
+
+const TraceRecord* TraceReplayer::peek() {
+    if (pending) return &*pending;
+    if (error) return nullptr;
+    TraceRecord record;
+    auto read = reader.next(record);
+    if (!read) {
+        error = read.error();
+        return nullptr;
+    }
+    if (!*read) return nullptr;
+    pending = std::move(record);
+    return &*pending;
+}
+
+u16 TraceReplayer::next_input() {
+    auto record = peek();
+    if (!record || record->type != TraceRecord::Type::Input) {
+        desynchronized("an input");
+        return 0;
+    }
+    auto value = record->value;
+    pending.reset();
+    return value;
+}
+
+bool TraceReplayer::desynchronized(const char* what) {
+    if (!error) {
+        fflush(stdout);
+        fmt::print(stderr, "Replay diverged from the trace at instruction {}, expected {}\n", get_instruction_count(), what);
+        error = Errc::InvalidTrace;
+    }
+    return false;
+}
+
+expected<BranchTraceDecoder, error_code> BranchTraceDecoder::open(const char* filename) {
+    UNWRAP(auto reader, TraceReader::open(filename));
+    BranchTraceDecoder decoder(std::move(reader));
+    UNWRAP(auto header, decoder.reader.read_header(decoder.memory));
+    if (header.mode != TraceMode::Branches) {
+        fmt::print(stderr, "Only branch traces can be decoded, replay full traces instead\n");
+        return unexpected(Errc::InvalidTrace);
+    }
+    decoder.cs = header.state.registers[9]; // cs
+    decoder.ip = header.state.ip;
+    decoder.instruction_count = header.instruction_count;
+    return decoder;
+}
+
+expected<bool, error_code> BranchTraceDecoder::next(DecodedInstruction& decoded) {
+    using enum TraceRecord::Type;
+
+    // Records located between instructions. They follow all the outcomes
+    // before them, so they can't be reached while outcomes are left.
+    while (outcome_count == 0) {
+        UNWRAP(auto record, peek());
+        if (!record) return false;
+        if (record->type == Gap) {
+            fflush(stdout);
+            fmt::print(stderr, "The trace has a gap after instruction {}\n", instruction_count);
+            return unexpected(Errc::InvalidTrace);
+        }
+        if (record->count != since_event) break;
+        if (record->type == MemoryWrite) {
+            std::copy(record->data.begin(), record->data.end(), memory.begin() + record->address);
+        } else if (record->type == Stop) {
+            since_event = 0;
+        } else if (record->type == Target && record->count != 0) {
+            apply_target(*record);
+        } else {
+            break;
+        }
+        pending.reset();
+    }
+
+    u32 address = ((cs << 4) + ip) & (Intel8086::memory_size - 1);
+    auto instruction = Instruction::decode_at(memory, address);
+    if (!instruction) {
+        fflush(stdout);
+        fmt::print(stderr, "Unknown instruction at location {:04x}:{:04x} of the trace (first byte {:#x})\n", cs, ip, memory[address]);
+        return unexpected(Errc::InvalidTrace);
+    }
+    decoded = { cs, ip, *instruction };
+    ++instruction_count;
+    ++since_event;
+
+    ip += instruction->size;
+    if (instruction->type == Instruction::Type::Call) returns.push(cs, ip);
+    if (instruction->type == Instruction::Type::Ret) {
+        if (auto expected = returns.pop()) {
+            UNWRAP(bool predicted, next_outcome());
+            if (predicted) {
+                cs = static_cast<u16>(*expected >> 16);
+                ip = static_cast<u16>(*expected);
+                since_event = 0;
+                return true;
+            }
+        }
+    }
+    const auto& o1 = instruction->operands[0];
+    switch (classify_branch(*instruction)) {
+        case BranchKind::Conditional: {
+            UNWRAP(bool taken, next_outcome());
+            if (taken) ip += o1.ip_inc;
+            since_event = 0;
+            break;
+        }
+        case BranchKind::Direct:
+            if (o1.type == Operand::Type::IpInc) {
+                ip += o1.ip_inc;
+            } else {
+                cs = o1.immediate;
+                ip = instruction->operands[1].immediate;
+            }
+            break;
+        case BranchKind::Indirect: {
+            // Unless a host interrupt handler stopped the run
+            UNWRAP(auto record, peek());
+            if (record && record->type == Stop && record->count == since_event && outcome_count == 0) break;
+            if (auto e = next_target()) return unexpected(e);
+            break;
+        }
+        case BranchKind::Other:
+            break;
+    }
+    return true;
+}
+
+expected<const TraceRecord*, error_code> BranchTraceDecoder::peek() {
+    if (pending) return &*pending;
+    TraceRecord record;
+    UNWRAP(bool read, reader.next(record));
+    if (!read) return nullptr;
+    pending = std::move(record);
+    return &*pending;
+}
+
+expected<bool, error_code> BranchTraceDecoder::next_outcome() {
+    if (outcome_count == 0) {
+        UNWRAP(auto record, peek());
+        if (!record || record->type != TraceRecord::Type::Outcomes) return unexpected(desynchronized("a branch outcome"));
+        outcomes = 0;
+        for (size_t i = 0; i < record->data.size(); ++i) outcomes |= static_cast<u64>(record->data[i]) << (8 * i);
+        outcome_count = record->count;
+        pending.reset();
+    }
+    bool taken = outcomes & 1;
+    outcomes >>= 1;
+    --outcome_count;
+    return taken;
+}
+
+error_code BranchTraceDecoder::next_target() {
+    UNWRAP_BARE(auto record, peek());
+    if (outcome_count != 0 || !record || record->type != TraceRecord::Type::Target || record->count != 0) {
+        return desynchronized("a branch target");
+    }
+    apply_target(*record);
+    pending.reset();
+    return {};
+}
+
+void BranchTraceDecoder::apply_target(const TraceRecord& record) {
+    if (record.segment) cs = *record.segment;
+    ip = static_cast<u16>(ip + record.delta);
+    since_event = 0;
+}
+
+error_code BranchTraceDecoder::desynchronized(const char* what) {
+    fflush(stdout);
+    fmt::print(stderr, "The trace doesn't match the program at instruction {}, expected {}\n", instruction_count, what);
+    return Errc::InvalidTrace;
+}
@@ -0,0 +1,332 @@
+#pragma once
+
+#include "common.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "device.hpp"
+#include "emulator.hpp"
+#include "instruction.hpp"
+#include "trace_sink.hpp"
+
+// Compact binary execution trace. The header holds the CPU state, the
+// memory and the device mappings at the start of the trace. After it, every
+// block of executed instructions is a record with its instruction count and
+// where execution continued: one bit tells whether that's the address after
+// the last instruction (a conditional branch that wasn't taken), otherwise
+// the difference from that address follows. Everything that doesn't follow
+// from re-executing the program is recorded too: values read from ports and
+// memory-mapped devices, and the memory writes and registers of host
+// interrupt handlers. Most blocks take one or two bytes.
+//
+// Branch traces only record what can't be found by decoding the program
+// again, like hardware processor traces: one bit per conditional branch,
+// packed into outcome records, and the targets of indirect transfers (returns,
+// interrupts and jumps and calls through registers or memory). Returns to the
+// address after the matching call take an outcome bit too. Inputs and the
+// registers of host interrupt handlers aren't recorded, so such a trace can
+// only be decoded into the executed instructions, see BranchTraceDecoder,
+// not replayed. Code written by the guest isn't recorded either.
+//
+// Records are written in batches, either directly or through an
+// AsyncTraceSink. Batches always end at a record boundary, so when the sink
+// drops one, the trace continues with a gap record.
+//
+// Numbers are little-endian base 128 varints, signed ones zigzag encoded.
+enum class TraceMode : u8 {
+    // Every block, input and host interrupt, for TraceReplayer
+    Full,
+    // Branch outcomes and indirect targets, for BranchTraceDecoder
+    Branches,
+};
+
+struct TraceState {
+    // In the order of Intel8086::get_registers()
+    std::array<u16, 12> registers = {};
+    u16 ip = 0;
+    u16 flags = 0;
+};
+
+struct TraceRecord {
+    enum class Type : u8 {
+        // The instructions up to and including a control transfer
+        Block,
+        // A value read from a port or a memory-mapped device
+        Input,
+        // The state after a host interrupt handler, after the memory writes
+        // made by the handler
+        HostInterrupt,
+        // Memory written by the host
+        MemoryWrite,
+        // The end of a run, after count instructions of an unfinished block
+        Stop,
+        // Records were dropped, the trace continues at instruction
+        Gap,
+        // Branch traces: where an indirect transfer went, relative to the
+        // address after it. A count is set when an instruction that doesn't
+        // always transfer control did, like a division error or into.
+        Target,
+        // Branch traces: whether the next count conditional branches were
+        // taken, one bit each from the lowest
+        Outcomes,
+    };
+
+    Type type = Type::Block;
+    u32 count = 0;
+    // Block: execution continued after the last instruction
+    bool fall_through = false;
+    i32 delta = 0;
+    // Target: the new code segment, if it changed
+    std::optional<u16> segment;
+    u16 value = 0;
+    // HostInterrupt: false if the handler stopped the emulation
+    bool resumed = false;
+    TraceState state;
+    u32 address = 0;
+    std::vector<u8> data;
+    u64 instruction = 0;
+};
+
+struct TraceHeader {
+    static constexpr std::array<char, 4> signature = { 'X', '8', '6', 'T' };
+    static constexpr u32 current_version = 2;
+
+    TraceMode mode = TraceMode::Full;
+    u64 instruction_count = 0;
+    u64 cycle_count = 0;
+    TraceState state;
+    // Bitmaps of the memory-mapped and read-only pages and of the interrupts
+    // serviced on the host
+    std::vector<u64> mmio_pages = std::vector<u64>(Intel8086::page_count / 64);
+    std::vector<u64> rom_pages = std::vector<u64>(Intel8086::page_count / 64);
+    std::array<u64, 4> host_interrupts = {};
+};
+
+// Return addresses of the recent calls of a branch trace, the oldest ones are
+// dropped. The writer and the decoder keep the same stack.
+class TraceReturnStack {
+public:
+    void push(u16 cs, u16 ip) {
+        entries[top++ % entries.size()] = (static_cast<u32>(cs) << 16) | ip;
+        size = std::min<u32>(size + 1, entries.size());
+    }
+    // As cs << 16 | ip
+    std::optional<u32> pop() {
+        if (size == 0) return {};
+        --size;
+        return entries[--top % entries.size()];
+    }
+
+private:
+    std::array<u32, 64> entries = {};
+    u32 top = 0;
+    u32 size = 0;
+};
+
+class TraceWriter {
+public:
+    static expected<TraceWriter, error_code> open(const char* filename, TraceMode mode = TraceMode::Full);
+    // Writes the trace on a separate thread
+    static expected<TraceWriter, error_code> open_async(const char* filename, const AsyncTraceSink::Options& options,
+                                                       TraceMode mode = TraceMode::Full);
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter(TraceWriter&& other) noexcept
+        : mode(other.mode), file(std::exchange(other.file, nullptr)), sink(std::move(other.sink)),
+          buffer(std::move(other.buffer)), used(std::exchange(other.used, 0)), error(other.error),
+          instructions(other.instructions), write_address(other.write_address), write_data(std::move(other.write_data)) {}
+    TraceWriter& operator=(const TraceWriter&) = delete;
+    TraceWriter& operator=(TraceWriter&&) = delete;
+    ~TraceWriter();
+
+    // Writes the header with the current state of x86 and starts recording
+    // its execution. The writer must not be moved afterwards.
+    void start(Intel8086& x86);
+    // Writes out the buffered records. Returns the first error of any write.
+    error_code flush();
+
+    // The block ended with the instruction, x86 is at its target
+    void block(u32 count, const Instruction& last, const Intel8086& x86);
+    void input(u16 value);
+    void memory_write(u32 address, std::span<const u8> data);
+    void host_interrupt(const Intel8086& x86, bool resumed);
+    void stop(u32 count);
+
+    // Bytes dropped by an asynchronous sink
+    u64 get_dropped_bytes() const { return sink ? sink->get_dropped_bytes() : 0; }
+
+private:
+    static constexpr size_t batch_size = 1 << 20;
+
+    TraceWriter(TraceMode mode, FILE* file, std::unique_ptr<AsyncTraceSink> sink)
+        : mode(mode), file(file), sink(std::move(sink)), buffer(2 * batch_size) {}
+
+    TraceMode mode;
+    // Only one of them is used, the sink owns its file
+    FILE* file = nullptr;
+    std::unique_ptr<AsyncTraceSink> sink;
+    std::vector<u8> buffer;
+    size_t used = 0;
+    error_code error;
+    // Instruction count of the traced emulator, for gap records
+    u64 instructions = 0;
+    // Adjacent host writes are merged into one record
+    u32 write_address = 0;
+    std::vector<u8> write_data;
+
+    // Branch traces. Memory writes, stops and exceptions are located by the
+    // instructions executed since the last outcome or target, which the
+    // decoder counts too.
+    const Intel8086* traced = nullptr;
+    u64 event_instructions = 0;
+    u32 write_position = 0;
+    u16 segment = 0;
+    TraceReturnStack returns;
+    u64 outcomes = 0;
+    u32 outcome_count = 0;
+
+    void put(u8 byte) {
+        if (used == buffer.size()) [[unlikely]] buffer.resize(2 * buffer.size());
+        buffer[used++] = byte;
+    }
+    void put_varint(u64 value) {
+        while (value >= 0x80) {
+            put(static_cast<u8>(value | 0x80));
+            value >>= 7;
+        }
+        put(static_cast<u8>(value));
+    }
+    void put_bytes(std::span<const u8> bytes);
+    void put_tag(TraceRecord::Type type, u32 count, bool flag);
+    void put_state(const Intel8086& x86);
+    void put_outcome(bool taken) {
+        outcomes |= static_cast<u64>(taken) << outcome_count;
+        if (++outcome_count == 64) flush_outcomes();
+    }
+    void put_target(u32 count, u16 fall_through, const Intel8086& x86);
+    void branch_block(const Instruction& last, const Intel8086& x86);
+    void flush_outcomes();
+    void flush_memory_write();
+    void write_buffer();
+};
+
+class TraceReader {
+public:
+    static expected<TraceReader, error_code> open(const char* filename);
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader(TraceReader&& other) noexcept
+        : file(std::exchange(other.file, nullptr)), buffer(std::move(other.buffer)),
+          position(std::exchange(other.position, 0)), end(std::exchange(other.end, 0)) {}
+    TraceReader& operator=(const TraceReader&) = delete;
+    TraceReader& operator=(TraceReader&&) = delete;
+    ~TraceReader();
+
+    // Reads the header and writes the initial memory to memory
+    expected<TraceHeader, error_code> read_header(std::span<u8> memory);
+    // Returns false at the end of the trace
+    expected<bool, error_code> next(TraceRecord& record);
+
+private:
+    static constexpr size_t buffer_size = 1 << 20;
+
+    explicit TraceReader(FILE* file) : file(file), buffer(buffer_size) {}
+
+    FILE* file = nullptr;
+    std::vector<u8> buffer;
+    size_t position = 0;
+    size_t end = 0;
+
+    // Returns false at the end of the file
+    bool fill();
+    expected<u8, error_code> get();
+    expected<u64, error_code> get_varint();
+    error_code get_bytes(std::span<u8> bytes);
+    error_code get_bitmap(std::span<u64> bits);
+    error_code get_state(TraceState& state);
+};
+
+// Re-executes a trace in its own emulator, feeding it the recorded inputs and
+// host interrupt results, and checks that execution follows the recorded
+// blocks. The state at any instruction of the trace can be inspected.
+class TraceReplayer final : public PortDevice, public MemoryDevice, public InterruptHandler {
+public:
+    static expected<std::unique_ptr<TraceReplayer>, error_code> open(const char* filename);
+
+    // Executes one instruction. Returns false at the end of the trace.
+    expected<bool, error_code> step();
+    // Executes until the instruction count of the recording emulator
+    // reaches the given one or the trace ends
+    error_code run_to(u64 instruction_count);
+
+    u64 get_instruction_count() const { return first_instruction + x86.get_instruction_count(); }
+    const Intel8086& get_cpu() const { return x86; }
+
+    u16 in(u16 port, bool wide) override;
+    void out(u16, u16, bool) override {}
+    u8 read(u32 address) override;
+    void write(u32, u8) override {}
+    bool interrupt(Intel8086& x86, u8 number) override;
+
+private:
+    explicit TraceReplayer(TraceReader reader) : reader(std::move(reader)) {}
+
+    Intel8086 x86;
+    TraceReader reader;
+    std::optional<TraceRecord> pending;
+    u64 first_instruction = 0;
+    u64 block_start = 0;
+    error_code error;
+
+    // Returns nullptr at the end of the trace
+    const TraceRecord* peek();
+    u16 next_input();
+    bool desynchronized(const char* what);
+};
+
+struct DecodedInstruction {
+    u16 cs = 0;
+    u16 ip = 0;
+    Instruction instruction;
+};
+
+// Reconstructs the executed instructions from a branch trace by decoding the
+// program in the initial memory again, following the recorded branch
+// outcomes and targets.
+class BranchTraceDecoder {
+public:
+    static expected<BranchTraceDecoder, error_code> open(const char* filename);
+
+    // Returns false at the end of the trace
+    expected<bool, error_code> next(DecodedInstruction& decoded);
+
+    // Including the instructions executed before the trace started
+    u64 get_instruction_count() const { return instruction_count; }
+
+private:
+    explicit BranchTraceDecoder(TraceReader reader) : reader(std::move(reader)), memory(Intel8086::memory_size) {}
+
+    TraceReader reader;
+    std::optional<TraceRecord> pending;
+    std::vector<u8> memory;
+    u16 cs = 0;
+    u16 ip = 0;
+    u64 instruction_count = 0;
+    // Instructions decoded since the last outcome or target
+    u32 since_event = 0;
+    TraceReturnStack returns;
+    u64 outcomes = 0;
+    u32 outcome_count = 0;
+
+    // Returns nullptr at the end of the trace
+    expected<const TraceRecord*, error_code> peek();
+    expected<bool, error_code> next_outcome();
+    error_code next_target();
+    void apply_target(const TraceRecord& record);
+    error_code desynchronized(const char* what);
+};
@@ -0,0 +1,97 @@
+#include "trace_sink.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <fmt/core.h>
+
+AsyncTraceSink::AsyncTraceSink(FILE* file, const Options& options)
+    : file(file), policy(options.policy), ring(std::bit_ceil(std::max<size_t>(options.ring_size, 4096))) {
+    writer = std::thread([this] { write_loop(); });
+
+    if (options.cpu) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(*options.cpu, &cpus);
+        if (int e = pthread_setaffinity_np(writer.native_handle(), sizeof(cpus), &cpus)) {
+            fmt::print(stderr, "Couldn't pin the trace writer thread to CPU {}: {}\n", *options.cpu, make_error_code_errno(e).message());
+        }
+    }
+}
+
+AsyncTraceSink::~AsyncTraceSink() {
+    tail.fetch_or(closed, std::memory_order_release);
+    tail.notify_one();
+    writer.join();
+    fclose(file);
+}
+
+bool AsyncTraceSink::push(std::span<const u8> batch) {
+    if (policy == Policy::Drop && batch.size() > ring.size()) {
+        dropped_bytes += batch.size();
+        return false;
+    }
+
+    u64 position = tail.load(std::memory_order_relaxed);
+    while (!batch.empty()) {
+        // Batches larger than the ring are pushed in parts when blocking
+        auto size = std::min(batch.size(), ring.size());
+        if (ring.size() - (position - cached_head) < size) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (policy == Policy::Drop && ring.size() - (position - cached_head) < size) {
+                dropped_bytes += batch.size();
+                return false;
+            }
+            while (ring.size() - (position - cached_head) < size) {
+                head.wait(cached_head, std::memory_order_acquire);
+                cached_head = head.load(std::memory_order_acquire);
+            }
+        }
+
+        auto offset = position & (ring.size() - 1);
+        auto first = std::min(size, ring.size() - offset);
+        memcpy(ring.data() + offset, batch.data(), first);
+        memcpy(ring.data(), batch.data() + first, size - first);
+        position += size;
+        tail.store(position, std::memory_order_release);
+        tail.notify_one();
+        batch = batch.subspan(size);
+    }
+    return true;
+}
+
+error_code AsyncTraceSink::flush() {
+    u64 position = tail.load(std::memory_order_relaxed);
+    while ((cached_head = head.load(std::memory_order_acquire)) != position) head.wait(cached_head, std::memory_order_acquire);
+    if (!error && fflush(file) != 0) return make_error_code_errno();
+    return error;
+}
+
+void AsyncTraceSink::write_loop() {
+    u64 position = 0;
+    while (true) {
+        u64 published = tail.load(std::memory_order_acquire);
+        cached_tail = published & ~closed;
+        if (cached_tail == position) {
+            if (published & closed) break;
+            tail.wait(published, std::memory_order_acquire);
+            continue;
+        }
+
+        write_ring(position, cached_tail);
+        position = cached_tail;
+        head.store(position, std::memory_order_release);
+        head.notify_one();
+    }
+}
+
+void AsyncTraceSink::write_ring(u64 from, u64 to) {
+    if (error) return;
+    auto offset = from & (ring.size() - 1);
+    auto size = to - from;
+    auto first = std::min<u64>(size, ring.size() - offset);
+    if (fwrite(ring.data() + offset, 1, first, file) != first || fwrite(ring.data(), 1, size - first, file) != size - first) {
+        error = make_error_code_errno();
+    }
+}
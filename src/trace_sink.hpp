@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.hpp"
+#include <atomic>
+#include <cstdio>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Writes trace data to a file on a separate thread. The producer copies
+// batches into a lock-free single-producer/single-consumer byte ring and
+// the writer thread drains the ring to the file, so the emulator thread
+// never waits for the file system unless the ring is full.
+class AsyncTraceSink {
+public:
+    enum class Policy {
+        // Wait for the writer thread when the ring is full
+        Block,
+        // Drop batches that don't fit into the ring
+        Drop,
+    };
+
+    struct Options {
+        // Rounded up to a power of two
+        size_t ring_size = 64 << 20;
+        Policy policy = Policy::Block;
+        // Pins the writer thread to the CPU
+        std::optional<u32> cpu;
+    };
+
+    // Takes ownership of the file and starts the writer thread
+    AsyncTraceSink(FILE* file, const Options& options);
+    AsyncTraceSink(const AsyncTraceSink&) = delete;
+    AsyncTraceSink(AsyncTraceSink&&) = delete;
+    AsyncTraceSink& operator=(const AsyncTraceSink&) = delete;
+    AsyncTraceSink& operator=(AsyncTraceSink&&) = delete;
+    ~AsyncTraceSink();
+
+    // Returns false if the batch was dropped
+    bool push(std::span<const u8> batch);
+    // Waits until everything pushed so far is written and flushed to the
+    // file. Returns the first write error.
+    error_code flush();
+    u64 get_dropped_bytes() const { return dropped_bytes; }
+
+private:
+    // Set in tail when the sink is closed, so the writer thread wakes up
+    static constexpr u64 closed = u64(1) << 63;
+
+    FILE* file;
+    Policy policy;
+    std::vector<u8> ring;
+    u64 dropped_bytes = 0;
+
+    // Producer and consumer positions, on separate cache lines. Each side
+    // keeps a copy of the other's position and only reloads it when the
+    // ring looks full or empty.
+    alignas(64) std::atomic<u64> tail = 0;
+    u64 cached_head = 0;
+    alignas(64) std::atomic<u64> head = 0;
+    u64 cached_tail = 0;
+    // Written by the writer thread before it advances head
+    error_code error;
+
+    std::thread writer;
+
+    void write_loop();
+    void write_ring(u64 from, u64 to);
+};
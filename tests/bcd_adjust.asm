@@ -0,0 +1,31 @@
+bits 16
+
+mov al, 0x08
+add al, 0x09
+daa
+mov bl, al
+
+mov al, 0x15
+sub al, 0x09
+das
+mov bh, al
+
+mov ax, 0x0009
+add al, 0x08
+aaa
+mov cx, ax
+
+mov al, 0x13
+aam
+mov dx, ax
+aad
+mov si, ax
+
+mov al, 0x2f
+aam 16
+mov di, ax
+
+mov ax, 0x0105
+sub al, 0x06
+aas
+mov bp, ax
@@ -0,0 +1,17 @@
+bits 16
+
+mov al, 0x7f
+add al, 1
+mov bl, 0xff
+add bl, 1
+adc bh, 0
+mov cl, 0x10
+sub cl, 0x20
+sbb ch, 0
+inc byte [1000]
+inc byte [1000]
+dec byte [1000]
+mov dl, 5
+neg dl
+mov dh, [1000]
+cmp dl, 0xfb
@@ -0,0 +1,12 @@
+bits 16
+
+mov ah, 0xd5
+sahf
+lahf
+mov dl, ah
+
+pushf
+mov bx, sp
+mov cx, [bx]
+mov word [bx], 0x0801
+popf
@@ -0,0 +1,11 @@
+bits 16
+
+mov ax, 0xf0f0
+and ax, 0x0ff0
+mov bx, 0x1234
+or bx, ax
+mov cx, 0xffff
+xor cx, bx
+not dx
+mov word [2000], 0x8001
+test word [2000], 0x8000
@@ -0,0 +1,46 @@
+bits 16
+
+mov ax, 300
+mov bx, 400
+mul bx
+mov cx, ax
+
+mov ax, -7
+mov bl, 3
+imul bl
+mov si, ax
+
+mov ax, 1000
+mov dx, 0
+mov bx, 7
+div bx
+mov di, dx
+
+mov ax, -100
+mov dx, -1
+idiv bx
+mov bp, dx
+
+; The quotient of 0x80000000 / -1 doesn't fit in 16 bits
+mov word [0], idiv_error
+mov word [2], 0
+mov dx, 0x8000
+mov ax, 0
+mov bx, -1
+idiv bx
+hlt
+
+idiv_error:
+add sp, 6
+mov bp, dx
+mov ax, -100
+
+mov word [0], divide_error
+mov word [2], 0
+mov bl, 0
+div bl
+hlt
+
+divide_error:
+mov bx, 0x1234
+hlt
@@ -0,0 +1,24 @@
+bits 16
+
+mov ax, 0x8001
+shl ax, 1
+mov bx, ax
+
+mov cl, 4
+mov ax, 0x1234
+rol ax, cl
+mov dx, ax
+
+mov ax, 0x8000
+sar ax, cl
+mov si, ax
+
+mov al, 0x81
+ror al, 1
+mov ah, 0
+rcl ah, 1
+mov di, ax
+
+mov cl, 20
+mov bp, 0xffff
+shr bp, cl
@@ -0,0 +1,36 @@
+bits 16
+
+; Leave room for the vectors of int 3 and into at the start of the
+; interrupt vector table, which overlaps the code
+jmp start
+dw 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+start:
+mov word [0x80 * 4], handler
+mov word [3 * 4], breakpoint
+mov word [4 * 4], overflow
+
+mov ax, 1
+int 0x80
+int 0x80
+int3
+
+mov al, 0x7f
+add al, 1
+into
+mov al, 0x10
+add al, 1
+into
+hlt
+
+handler:
+add ax, ax
+iret
+
+breakpoint:
+mov bx, 0x1234
+iret
+
+overflow:
+inc cx
+iret